@@ -0,0 +1,142 @@
+/*
+ * Packet expansion benchmark
+ *
+ * Times dcc_hal_expand_packet() against the bit by bit decode the TIM2
+ * interrupt used to do, where each bit is picked out of the byte with a
+ * shift and mask. Both produce the same half bit stream, which is checked
+ * before anything is timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "dcc_hal.h"
+#include "dcc_hal_priv.h"
+
+
+#define N_PACKETS (1024)
+#define ROUNDS (2000)
+
+
+static uint8_t packets[N_PACKETS][DCC_HAL_MAX_PACKET];
+static uint8_t lengths[N_PACKETS];
+
+
+static void
+put_half_bit(uint32_t *half_bits, uint8_t i, uint32_t value)
+{
+    half_bits[i >> 5] |= value << (31 - (i & 31));
+}
+
+
+/* Reference expansion, one bit at a time */
+static uint8_t
+expand_bitwise(const uint8_t *packet, uint8_t len, uint32_t *half_bits)
+{
+    uint8_t pos = 0;
+    uint8_t byte, bit_shift;
+    uint32_t bit;
+
+    memset(half_bits, 0, DCC_HAL_HALF_BIT_WORDS * sizeof(uint32_t));
+
+    for (byte = 0; byte < len; byte++)
+    {
+        /* Start bit */
+        pos += 2;
+
+        for (bit_shift = 8; bit_shift-- > 0;)
+        {
+            bit = ((1 << bit_shift) & packet[byte]) >> bit_shift;
+            put_half_bit(half_bits, pos++, bit);
+            put_half_bit(half_bits, pos++, bit);
+        }
+    }
+
+    /* End bit */
+    put_half_bit(half_bits, pos++, 1);
+    put_half_bit(half_bits, pos++, 1);
+
+    return pos;
+}
+
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* Returns the mean time per packet in ns */
+static double
+time_expand(uint8_t (*expand)(const uint8_t *, uint8_t, uint32_t *),
+            uint32_t *sink)
+{
+    uint32_t half_bits[DCC_HAL_HALF_BIT_WORDS];
+    double start;
+    int r, i;
+
+    start = now_ns();
+
+    for (r = 0; r < ROUNDS; r++)
+    {
+        for (i = 0; i < N_PACKETS; i++)
+        {
+            *sink += expand(packets[i], lengths[i], half_bits);
+            *sink ^= half_bits[0];
+            __asm__ volatile("" : : "r"(half_bits) : "memory");
+        }
+    }
+
+    return (now_ns() - start) / ((double)ROUNDS * N_PACKETS);
+}
+
+
+int
+main(void)
+{
+    uint32_t table[DCC_HAL_HALF_BIT_WORDS];
+    uint32_t bitwise[DCC_HAL_HALF_BIT_WORDS];
+    uint32_t sink = 0;
+    uint8_t len;
+    double t_bitwise, t_table;
+    int i, j;
+
+    srand(1);
+
+    for (i = 0; i < N_PACKETS; i++)
+    {
+        lengths[i] = 3 + rand() % (DCC_HAL_MAX_PACKET - 2);
+        for (j = 0; j < lengths[i]; j++)
+            packets[i][j] = rand();
+    }
+
+    for (i = 0; i < N_PACKETS; i++)
+    {
+        memset(table, 0, sizeof(table));
+        len = dcc_hal_expand_packet(packets[i], lengths[i], table);
+
+        if (len != expand_bitwise(packets[i], lengths[i], bitwise) ||
+            memcmp(table, bitwise, sizeof(table)) != 0)
+        {
+            fprintf(stderr, "Expansions differ for packet %d\n", i);
+            return 1;
+        }
+    }
+
+    t_bitwise = time_expand(expand_bitwise, &sink);
+    t_table = time_expand(dcc_hal_expand_packet, &sink);
+
+    printf("%d packets of 3 to %d bytes, %d rounds\n",
+           N_PACKETS, DCC_HAL_MAX_PACKET, ROUNDS);
+    printf("bit by bit:  %6.1f ns/packet\n", t_bitwise);
+    printf("table:       %6.1f ns/packet (%.1fx)\n",
+           t_table, t_bitwise / t_table);
+
+    return sink == 0xdeadbeef ? 2 : 0;
+}
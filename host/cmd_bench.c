@@ -0,0 +1,171 @@
+/*
+ * Command protocol benchmark
+ *
+ * Times cmd_poll() taking frames out of a receive ring, with the DCC driver
+ * stubbed out so only the protocol is measured. Frames carrying a batch of
+ * speeds are compared with a frame for every speed, and both with what a
+ * 115200 baud line can carry.
+ *
+ * With -d, decodes a file of frames instead, e.g. as written by
+ * host/dcc_cmd.py -o, and prints the commands. It exits non-zero if any
+ * frame is dropped.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "cmd.h"
+#include "cmd_encode.h"
+#include "dcc.h"
+#include "dcc_stub.h"
+
+
+/* The receive ring. Big enough for every frame of a round at once. */
+#define RING_SIZE (1 << 16)
+
+#define N_FRAMES (64)
+#define BATCH (32)
+#define ROUNDS (200)
+
+#define BAUD (115200)
+
+
+static uint8_t ring_buf[RING_SIZE];
+static ringbuf_t ring;
+
+static uint8_t stream[RING_SIZE];
+static size_t stream_len;
+
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* Fill the stream with frames of batch speeds each */
+static uint32_t
+build_stream(int batch)
+{
+    cmd_encoder_t e;
+    uint32_t commands = 0;
+    int i, j;
+
+    stream_len = 0;
+    srand(1);
+
+    for (i = 0; i < N_FRAMES; i++)
+    {
+        cmd_encode_start(&e);
+
+        for (j = 0; j < batch; j++)
+        {
+            cmd_encode_speed(&e, 1 + rand() % DCC_MAX_ADDRESS,
+                             rand() % (DCC_MAX_SPEED + 1), rand() & 1, true);
+            commands++;
+        }
+
+        stream_len += cmd_encode_finish(&e, &stream[stream_len]);
+    }
+
+    return commands;
+}
+
+
+/* Returns the mean time per command in ns */
+static double
+time_poll(uint32_t commands)
+{
+    double total = 0, start;
+    int r;
+
+    dcc_stub_calls = 0;
+
+    for (r = 0; r < ROUNDS; r++)
+    {
+        ringbuf_write(&ring, stream, stream_len);
+
+        start = now_ns();
+        cmd_poll(&ring);
+        total += now_ns() - start;
+    }
+
+    if (dcc_stub_calls != commands * ROUNDS)
+    {
+        fprintf(stderr, "%u of %u commands carried out\n",
+                dcc_stub_calls, commands * ROUNDS);
+        exit(1);
+    }
+
+    return total / ((double)ROUNDS * commands);
+}
+
+
+static void
+bench(int batch)
+{
+    uint32_t commands = build_stream(batch);
+    double ns = time_poll(commands);
+
+    printf("%2d per frame: %5.1f ns/command, %6.2f M commands/s, "
+           "%.1f bytes/command, %5.0f commands/s at %d baud\n",
+           batch, ns, 1e3 / ns, (double)stream_len / commands,
+           BAUD / 10.0 * commands / stream_len, BAUD);
+}
+
+
+static int
+decode(const char *path)
+{
+    cmd_stats_t stats;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        return 1;
+    }
+
+    stream_len = fread(stream, 1, sizeof(stream), f);
+    fclose(f);
+
+    dcc_stub_verbose = true;
+    ringbuf_write(&ring, stream, stream_len);
+    cmd_poll(&ring);
+
+    cmd_get_stats(&stats);
+    printf("%u frames, %u commands, %u bad CRCs, %u dropped\n",
+           stats.frames, stats.commands, stats.bad_crc, stats.bad_frames);
+
+    return stats.bad_crc == 0 && stats.bad_frames == 0 &&
+        ringbuf_get_len(&ring) == 0 ? 0 : 1;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    ringbuf_init(&ring, ring_buf, sizeof(ring_buf));
+
+    if (argc == 3 && strcmp(argv[1], "-d") == 0)
+        return decode(argv[2]);
+
+    if (argc != 1)
+    {
+        fprintf(stderr, "usage: %s [-d frames]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%d frames, %d rounds\n", N_FRAMES, ROUNDS);
+    bench(1);
+    bench(BATCH);
+
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+ * Command protocol frame builder
+ */
+#include "cmd_encode.h"
+
+#include <string.h>
+
+
+void
+cmd_encode_start(cmd_encoder_t *e)
+{
+    e->len = 0;
+    e->count = NULL;
+}
+
+
+/* Add a command, closing any open speed batch */
+static bool
+add(cmd_encoder_t *e, uint8_t op, const uint8_t *args, size_t len)
+{
+    if (e->len + 1 + len > CMD_MAX_PAYLOAD)
+        return false;
+
+    e->payload[e->len++] = op;
+    memcpy(&e->payload[e->len], args, len);
+    e->len += len;
+    e->count = NULL;
+
+    return true;
+}
+
+
+bool
+cmd_encode_speed(cmd_encoder_t *e, uint16_t address, uint8_t speed,
+                 bool is_forward, bool steps_128)
+{
+    bool open = e->count == NULL || *e->count == 0xff;
+    uint8_t *entry;
+
+    /* Open a batch unless this follows another speed */
+    if (e->len + (open ? 2 : 0) + 4 > CMD_MAX_PAYLOAD)
+        return false;
+
+    if (open)
+    {
+        e->payload[e->len++] = CMD_SPEED;
+        e->count = &e->payload[e->len++];
+        *e->count = 0;
+    }
+
+    entry = &e->payload[e->len];
+    entry[0] = (uint8_t)address;
+    entry[1] = (uint8_t)(address >> 8);
+    entry[2] = speed;
+    entry[3] = (is_forward ? CMD_SPEED_FORWARD : 0) |
+        (steps_128 ? CMD_SPEED_128 : 0);
+
+    e->len += 4;
+    (*e->count)++;
+
+    return true;
+}
+
+
+bool
+cmd_encode_function(cmd_encoder_t *e, uint16_t address, uint8_t function,
+                    bool on)
+{
+    uint8_t args[4] = { (uint8_t)address, (uint8_t)(address >> 8),
+                        function, on };
+
+    return add(e, CMD_FUNCTION, args, sizeof(args));
+}
+
+
+bool
+cmd_encode_accessory(cmd_encoder_t *e, uint16_t address, uint8_t sub,
+                     bool activate)
+{
+    uint8_t args[4] = { (uint8_t)address, (uint8_t)(address >> 8),
+                        sub, activate };
+
+    return add(e, CMD_ACCESSORY, args, sizeof(args));
+}
+
+
+bool
+cmd_encode_e_stop(cmd_encoder_t *e, bool enabled)
+{
+    uint8_t arg = enabled;
+
+    return add(e, CMD_E_STOP, &arg, 1);
+}
+
+
+size_t
+cmd_encode_finish(cmd_encoder_t *e, uint8_t *out)
+{
+    uint8_t frame[CMD_MAX_PAYLOAD + 2];
+    uint16_t crc;
+    size_t len = e->len + 2;
+    size_t code = 0, n = 1;
+    size_t i;
+
+    memcpy(frame, e->payload, len - 2);
+    crc = cmd_crc16(CMD_CRC_INIT, frame, len - 2);
+    frame[len - 2] = crc >> 8;
+    frame[len - 1] = (uint8_t)crc;
+
+    /* COBS: each block starts with the distance to the next zero, and runs
+     * of 254 bytes without one are split */
+    for (i = 0; i < len; i++)
+    {
+        if (frame[i] == 0)
+        {
+            out[code] = n - code;
+            code = n++;
+            continue;
+        }
+
+        out[n++] = frame[i];
+        if (n - code == 0xff)
+        {
+            out[code] = 0xff;
+            code = n++;
+        }
+    }
+
+    out[code] = n - code;
+    out[n++] = 0;
+
+    return n;
+}
@@ -0,0 +1,67 @@
+/*
+ * Builds frames for the binary command protocol, as described in
+ * src/driver/cmd.h
+ */
+#ifndef _CMD_ENCODE_H
+#define _CMD_ENCODE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cmd.h"
+
+
+/* Most bytes cmd_encode_finish writes, including the zero at the end */
+#define CMD_ENCODE_MAX (CMD_MAX_FRAME + 1)
+
+
+/**
+ * A frame being built. Speeds added one after another go in one CMD_SPEED
+ * batch, and count points at the batch's count while it's open.
+ */
+typedef struct
+{
+    uint8_t payload[CMD_MAX_PAYLOAD];
+    size_t len;
+    uint8_t *count;
+} cmd_encoder_t;
+
+
+/**
+ * Start a new frame
+ */
+extern void
+cmd_encode_start(cmd_encoder_t *e);
+
+
+/**
+ * Add commands to the frame. Each returns false if the frame is full, and
+ * leaves the frame as it was.
+ */
+extern bool
+cmd_encode_speed(cmd_encoder_t *e, uint16_t address, uint8_t speed,
+                 bool is_forward, bool steps_128);
+
+extern bool
+cmd_encode_function(cmd_encoder_t *e, uint16_t address, uint8_t function,
+                    bool on);
+
+extern bool
+cmd_encode_accessory(cmd_encoder_t *e, uint16_t address, uint8_t sub,
+                     bool activate);
+
+extern bool
+cmd_encode_e_stop(cmd_encoder_t *e, bool enabled);
+
+
+/**
+ * Add the CRC and encode the frame, ready to send
+ * \param out at least CMD_ENCODE_MAX bytes
+ * \return the number of bytes written, ending with the zero
+ */
+extern size_t
+cmd_encode_finish(cmd_encoder_t *e, uint8_t *out);
+
+
+#endif /* _CMD_ENCODE_H */
@@ -0,0 +1,177 @@
+/*
+ * Command receive lap test
+ *
+ * The UART's DMA writes into the receive ring whatever the main loop is
+ * doing. This puts three frames in a ring, then has the "DMA" write more
+ * than the whole ring's worth of new frames over them while the first is
+ * being carried out, as a stalled main loop would see it.
+ *
+ * The first frame has to be carried out in full, with none of the new data
+ * mixed into it. The two after it have been written over, so nothing from
+ * them may be carried out. Of the new data, the frame the lap cut into has
+ * to be dropped, and the whole frames after it carried out. Every speed is
+ * worked out from its address, so a command put together from the wrong
+ * bytes shows up. Exits non-zero if any of that goes wrong.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "cmd.h"
+#include "cmd_encode.h"
+#include "dcc.h"
+#include "dcc_stub.h"
+
+
+#define RING_SIZE (512)
+
+/* Trains in each frame */
+#define BATCH (8)
+
+/* Frames in the ring to start with, and the addresses in them */
+#define OLD_FRAMES (3)
+#define OLD_BASE (1)
+
+/* Addresses in the frames that lap the ring, and how much is written */
+#define NEW_BASE (1000)
+#define NEW_FRAMES (32)
+#define LAP_BYTES (RING_SIZE + RING_SIZE / 4)
+
+
+static uint8_t ring_buf[RING_SIZE];
+static ringbuf_t ring;
+
+static uint8_t stream[NEW_FRAMES * CMD_ENCODE_MAX];
+
+static bool lapped;
+static uint32_t old_set[OLD_FRAMES];
+static uint32_t new_set;
+static uint32_t wrong;
+
+
+static uint8_t
+speed_for(uint16_t address)
+{
+    return address % (DCC_MAX_SPEED + 1);
+}
+
+
+/* Frames of BATCH speeds each, for addresses from base on */
+static size_t
+build_frames(uint8_t *out, int frames, uint16_t base)
+{
+    cmd_encoder_t e;
+    size_t len = 0;
+    uint16_t address;
+    int i, j;
+
+    for (i = 0; i < frames; i++)
+    {
+        cmd_encode_start(&e);
+
+        for (j = 0; j < BATCH; j++)
+        {
+            address = base + i * BATCH + j;
+            cmd_encode_speed(&e, address, speed_for(address), true, true);
+        }
+
+        len += cmd_encode_finish(&e, &out[len]);
+    }
+
+    return len;
+}
+
+
+/* Write straight into the buffer from the head on and commit it all, as
+ * the UART's DMA does, however much room the ring has */
+static void
+dma_write(const uint8_t *data, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        ring_buf[(ring.head + i) & (RING_SIZE - 1)] = data[i];
+
+    ringbuf_commit(&ring, len);
+}
+
+
+static void
+speed_set(uint16_t address, uint8_t speed)
+{
+    if (speed != speed_for(address))
+        wrong++;
+    else if (address >= NEW_BASE && address < NEW_BASE + NEW_FRAMES * BATCH)
+        new_set++;
+    else if (address >= OLD_BASE && address < OLD_BASE + OLD_FRAMES * BATCH)
+        old_set[(address - OLD_BASE) / BATCH]++;
+    else
+        wrong++;
+
+    /* Lap the ring part way through the first frame */
+    if (!lapped)
+    {
+        lapped = true;
+        build_frames(stream, NEW_FRAMES, NEW_BASE);
+        dma_write(stream, LAP_BYTES);
+    }
+}
+
+
+int
+main(void)
+{
+    cmd_stats_t stats;
+    size_t len;
+    int failed = 0;
+
+    ringbuf_init(&ring, ring_buf, sizeof(ring_buf));
+
+    len = build_frames(stream, OLD_FRAMES, OLD_BASE);
+    if (len > RING_SIZE)
+    {
+        fprintf(stderr, "the first frames don't fit in the ring\n");
+        return 1;
+    }
+    ringbuf_write(&ring, stream, len);
+
+    dcc_stub_speed_hook = speed_set;
+    cmd_poll(&ring);
+    cmd_get_stats(&stats);
+
+    printf("first frame:     %u of %d speeds set\n", old_set[0], BATCH);
+    printf("written over:    %u speeds set\n", old_set[1] + old_set[2]);
+    printf("new frames:      %u speeds set\n", new_set);
+    printf("wrong speeds:    %u\n", wrong);
+    printf("frames:          %u carried out, %u bad, %u bad CRC\n",
+           stats.frames, stats.bad_frames, stats.bad_crc);
+
+    if (old_set[0] != BATCH)
+    {
+        fprintf(stderr, "the first frame wasn't carried out as sent\n");
+        failed = 1;
+    }
+
+    if (old_set[1] + old_set[2] != 0)
+    {
+        fprintf(stderr, "frames that were written over were carried out\n");
+        failed = 1;
+    }
+
+    if (wrong != 0)
+    {
+        fprintf(stderr, "commands were put together from the wrong bytes\n");
+        failed = 1;
+    }
+
+    if (new_set == 0 || new_set % BATCH != 0 ||
+        stats.bad_frames + stats.bad_crc == 0)
+    {
+        fprintf(stderr, "the new data wasn't picked up from the next "
+                "whole frame\n");
+        failed = 1;
+    }
+
+    return failed;
+}
@@ -0,0 +1,544 @@
+/*
+ * DCC waveform checker
+ *
+ * Reads a trace of the two DCC outputs, as written by dcc_sim, and decodes
+ * it back into bits and packets. The timing of each half bit, the preamble
+ * length and the checksum of each packet are checked against NMRA S-9.1 and
+ * S-9.2, and the throughput of the track is reported, with the bits each
+ * packet costs beyond its data.
+ *
+ * With -p, every packet is printed with the shortest and longest one and
+ * zero half bits from its start bit to its end bit, and nothing else.
+ * host/dcc_compare.py compares these lists from two encoders.
+ *
+ * The track polarity is taken from the leg that is driven. Each half bit
+ * starts when the other leg is switched on, so the dead time between the
+ * legs is part of the half bit before it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+
+/* Half bit limits for a command station, in ns, from S-9.1 */
+#define ONE_HALF_MIN (55000)
+#define ONE_HALF_MAX (61000)
+#define ONE_HALF_DIFF_MAX (3000)
+#define ZERO_HALF_MIN (95000)
+#define ZERO_HALF_MAX (9900000)
+#define ZERO_BIT_MAX (12000000)
+
+
+/* A command station has to send at least 14 preamble bits, and a decoder
+ * will accept 10. The end bit of a packet can count towards the next
+ * preamble. */
+#define PREAMBLE_MIN (14)
+#define DECODER_PREAMBLE_MIN (10)
+
+
+/* Shortest and longest packets, including the checksum */
+#define PACKET_MIN (3)
+#define PACKET_MAX (6)
+
+
+#define MAX_ADDRESS (10239)
+#define LONG_ADDRESS_FIRST (0xc0)
+#define LONG_ADDRESS_LAST (0xe7)
+#define IDLE_ADDRESS (0xff)
+
+
+typedef enum
+{
+    HALF_ONE,
+    HALF_ZERO,
+    HALF_NONE,
+} half_t;
+
+
+typedef enum
+{
+    STATE_PREAMBLE,
+    STATE_DATA,
+    STATE_SEPARATOR,
+} state_t;
+
+
+/* Refresh statistics for one address */
+typedef struct
+{
+    uint32_t packets;
+    uint64_t last;
+    uint64_t min;
+    uint64_t max;
+    uint64_t total;
+} address_stats_t;
+
+
+/* Conformance errors. Only counted once the first good packet has been
+ * seen, so the trace can start part way through a bit. */
+typedef struct
+{
+    uint32_t half_timing;
+    uint32_t one_mismatch;
+    uint32_t zero_too_long;
+    uint32_t misaligned;
+    uint32_t short_preamble;
+    uint32_t bad_length;
+    uint32_t bad_checksum;
+    uint32_t shoot_through;
+} errors_t;
+
+
+static bool verbose;
+static bool print_packets;
+static bool synced;
+static errors_t errors;
+
+
+/* Half bit waiting for its partner */
+static half_t pending_half = HALF_NONE;
+static uint64_t pending_start;
+static uint64_t pending_len;
+
+
+/* Packet decoder */
+static state_t state = STATE_PREAMBLE;
+static int ones;
+static uint64_t preamble_start[PREAMBLE_MIN];
+static uint8_t packet[PACKET_MAX];
+static int packet_len;
+static int packet_bits;
+static uint64_t packet_start;
+
+/* Preamble ones before the packet's start bit, not counting the end bit of
+ * the packet before, which the decoder counts as the first of them */
+static int packet_preamble;
+static bool end_bit_counted;
+
+/* Shortest and longest half bits in the packet, zeros then ones */
+static uint64_t packet_half_min[2];
+static uint64_t packet_half_max[2];
+
+
+/* Totals for the report */
+static uint64_t n_ones, n_zeros;
+static uint64_t n_packets, n_idle, n_broadcast, n_other;
+static uint64_t preamble_bits, start_bits, data_bits;
+static int preamble_min = INT32_MAX;
+static uint64_t busy_time;
+static address_stats_t addresses[MAX_ADDRESS + 1];
+
+
+static void
+error(uint32_t *counter, uint64_t time, const char *what)
+{
+    if (!synced)
+        return;
+
+    (*counter)++;
+
+    if (verbose)
+        printf("%12.6f  error: %s\n", time / 1e9, what);
+}
+
+
+static void
+record_address(uint16_t address, uint64_t time)
+{
+    address_stats_t *a = &addresses[address];
+    uint64_t interval;
+
+    if (a->packets > 0)
+    {
+        interval = time - a->last;
+
+        if (a->packets == 1 || interval < a->min)
+            a->min = interval;
+        if (interval > a->max)
+            a->max = interval;
+        a->total += interval;
+    }
+
+    a->packets++;
+    a->last = time;
+}
+
+
+static void
+end_packet(uint64_t end)
+{
+    uint8_t checksum = 0;
+    int i;
+
+    if (packet_len < PACKET_MIN)
+    {
+        error(&errors.bad_length, end, "packet too short");
+        return;
+    }
+
+    for (i = 0; i < packet_len; i++)
+        checksum ^= packet[i];
+
+    if (checksum != 0)
+    {
+        error(&errors.bad_checksum, end, "bad checksum");
+        return;
+    }
+
+    synced = true;
+
+    if (print_packets)
+    {
+        for (i = 0; i < packet_len; i++)
+            printf("%02x ", packet[i]);
+        printf(" zero %llu-%llu ns  one %llu-%llu ns\n",
+               (unsigned long long)packet_half_min[0],
+               (unsigned long long)packet_half_max[0],
+               (unsigned long long)packet_half_min[1],
+               (unsigned long long)packet_half_max[1]);
+    }
+    else if (verbose)
+    {
+        printf("%12.6f ", packet_start / 1e9);
+        for (i = 0; i < packet_len; i++)
+            printf(" %02x", packet[i]);
+        printf("\n");
+    }
+
+    if (packet[0] == IDLE_ADDRESS)
+    {
+        n_idle++;
+        return;
+    }
+
+    n_packets++;
+    busy_time += end - packet_start;
+
+    preamble_bits += packet_preamble;
+    start_bits += packet_len;
+    data_bits += packet_len * 8;
+    if (packet_preamble < preamble_min)
+        preamble_min = packet_preamble;
+
+    if (packet[0] == 0)
+        n_broadcast++;
+    else if (packet[0] < 0x80)
+        record_address(packet[0], packet_start);
+    else if (packet[0] >= LONG_ADDRESS_FIRST && packet[0] <= LONG_ADDRESS_LAST)
+        record_address(((packet[0] & 0x3f) << 8) | packet[1], packet_start);
+    else
+        n_other++;
+}
+
+
+static void
+bit(bool value, uint64_t start, uint64_t end)
+{
+    if (value)
+        n_ones++;
+    else
+        n_zeros++;
+
+    switch (state)
+    {
+    case STATE_PREAMBLE:
+        if (value)
+        {
+            preamble_start[ones % PREAMBLE_MIN] = start;
+            ones++;
+            break;
+        }
+
+        /* A zero after enough ones is the packet start bit */
+        if (ones < DECODER_PREAMBLE_MIN)
+        {
+            ones = 0;
+            end_bit_counted = false;
+            break;
+        }
+
+        packet_preamble = end_bit_counted ? ones - 1 : ones;
+
+        if (ones < PREAMBLE_MIN)
+        {
+            error(&errors.short_preamble, start, "short preamble");
+            packet_start = preamble_start[0];
+        }
+        else
+        {
+            packet_start = preamble_start[ones % PREAMBLE_MIN];
+        }
+
+        packet_len = 0;
+        packet_bits = 0;
+        state = STATE_DATA;
+        break;
+
+    case STATE_DATA:
+        if (packet_bits == 0)
+            packet[packet_len] = 0;
+
+        packet[packet_len] = (packet[packet_len] << 1) | value;
+
+        if (++packet_bits == 8)
+        {
+            packet_len++;
+            state = STATE_SEPARATOR;
+        }
+        break;
+
+    case STATE_SEPARATOR:
+        ones = 0;
+        end_bit_counted = false;
+        state = STATE_PREAMBLE;
+
+        if (value)
+        {
+            end_packet(end);
+
+            /* The end bit can be the first preamble bit */
+            preamble_start[ones++] = start;
+            end_bit_counted = true;
+        }
+        else if (packet_len == PACKET_MAX)
+        {
+            error(&errors.bad_length, start, "packet too long");
+        }
+        else
+        {
+            packet_bits = 0;
+            state = STATE_DATA;
+        }
+        break;
+    }
+}
+
+
+/* Track the half bit lengths of a packet. Each preamble bit starts the
+ * packet again, so they run from the start bit. */
+static void
+time_halves(bool value, uint64_t first, uint64_t second)
+{
+    uint64_t shorter = first < second ? first : second;
+    uint64_t longer = first < second ? second : first;
+
+    if (state == STATE_PREAMBLE && value)
+    {
+        memset(packet_half_min, 0xff, sizeof(packet_half_min));
+        memset(packet_half_max, 0, sizeof(packet_half_max));
+        return;
+    }
+
+    if (shorter < packet_half_min[value])
+        packet_half_min[value] = shorter;
+    if (longer > packet_half_max[value])
+        packet_half_max[value] = longer;
+}
+
+
+static void
+half_bit(uint64_t start, uint64_t len)
+{
+    half_t half;
+
+    if (len >= ONE_HALF_MIN && len <= ONE_HALF_MAX)
+        half = HALF_ONE;
+    else if (len >= ZERO_HALF_MIN && len <= ZERO_HALF_MAX)
+        half = HALF_ZERO;
+    else
+        half = HALF_NONE;
+
+    if (half == HALF_NONE)
+    {
+        error(&errors.half_timing, start, "half bit out of range");
+        pending_half = HALF_NONE;
+        state = STATE_PREAMBLE;
+        ones = 0;
+        return;
+    }
+
+    if (pending_half == HALF_NONE)
+    {
+        pending_half = half;
+        pending_start = start;
+        pending_len = len;
+        return;
+    }
+
+    /* Both halves of a bit have to match. If they don't, we've paired up
+     * the wrong halves, so start again from this one. */
+    if (half != pending_half)
+    {
+        error(&errors.misaligned, start, "halves of a bit don't match");
+        pending_half = half;
+        pending_start = start;
+        pending_len = len;
+        return;
+    }
+
+    if (half == HALF_ONE &&
+        (len > pending_len ? len - pending_len : pending_len - len) >
+        ONE_HALF_DIFF_MAX)
+        error(&errors.one_mismatch, start, "one bit halves differ");
+
+    if (half == HALF_ZERO && pending_len + len > ZERO_BIT_MAX)
+        error(&errors.zero_too_long, start, "zero bit too long");
+
+    pending_half = HALF_NONE;
+    time_halves(half == HALF_ONE, pending_len, len);
+    bit(half == HALF_ONE, pending_start, start + len);
+}
+
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-v | -p] [trace]\n"
+            "\n"
+            "Checks a trace of \"<time ns> <pin 1> <pin 2>\" lines against\n"
+            "NMRA S-9.1 and S-9.2, reading stdin if no file is given.\n"
+            "\n"
+            "  -v  print every packet and error\n"
+            "  -p  only print every packet, with its shortest and longest\n"
+            "      half bits, to compare encoders\n",
+            name);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    FILE *in = stdin;
+    unsigned long long time;
+    uint64_t first = 0, last = 0, edge = 0;
+    int pin_1, pin_2, polarity, last_polarity = 0;
+    bool have_edge = false;
+    uint32_t total_errors;
+    double elapsed;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "vph")) != -1)
+    {
+        switch (opt)
+        {
+        case 'v':
+            verbose = true;
+            break;
+
+        case 'p':
+            print_packets = true;
+            break;
+
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    if (optind < argc)
+    {
+        in = fopen(argv[optind], "r");
+        if (in == NULL)
+        {
+            perror(argv[optind]);
+            return 2;
+        }
+    }
+
+    while (fscanf(in, "%llu %d %d", &time, &pin_1, &pin_2) == 3)
+    {
+        if (first == 0)
+            first = time;
+        last = time;
+
+        if (pin_1 && pin_2)
+        {
+            error(&errors.shoot_through, time, "both legs on");
+            continue;
+        }
+
+        /* Dead time, keep waiting for the next leg */
+        if (!pin_1 && !pin_2)
+            continue;
+
+        polarity = pin_1 ? 1 : -1;
+        if (polarity == last_polarity)
+            continue;
+
+        if (have_edge)
+            half_bit(edge, time - edge);
+
+        have_edge = true;
+        edge = time;
+        last_polarity = polarity;
+    }
+
+    if (in != stdin)
+        fclose(in);
+
+    elapsed = (last - first) / 1e9;
+    if (elapsed <= 0)
+    {
+        fprintf(stderr, "Not enough trace to check\n");
+        return 2;
+    }
+
+    total_errors = errors.half_timing + errors.one_mismatch +
+        errors.zero_too_long + errors.misaligned + errors.short_preamble +
+        errors.bad_length + errors.bad_checksum + errors.shoot_through;
+
+    if (print_packets)
+        return total_errors > 0 ? 1 : 0;
+
+    printf("trace:           %.3f s\n", elapsed);
+    printf("bits:            %llu ones, %llu zeros\n",
+           (unsigned long long)n_ones, (unsigned long long)n_zeros);
+    printf("packets:         %llu (%.1f/s), %llu broadcast, %llu other\n",
+           (unsigned long long)n_packets, n_packets / elapsed,
+           (unsigned long long)n_broadcast, (unsigned long long)n_other);
+    if (n_packets > 0)
+        printf("overhead:        %.1f bits/packet (%.1f preamble, min %d, "
+               "%.1f start, 1 end), %.1f%% of packet bits\n",
+               (double)(preamble_bits + start_bits + n_packets) / n_packets,
+               (double)preamble_bits / n_packets, preamble_min,
+               (double)start_bits / n_packets,
+               100.0 * (preamble_bits + start_bits + n_packets) /
+               (preamble_bits + start_bits + n_packets + data_bits));
+    printf("idle packets:    %llu\n", (unsigned long long)n_idle);
+    printf("idle share:      %.1f%%\n",
+           100.0 * (1.0 - busy_time / 1e9 / elapsed));
+
+    printf("\naddress  packets  refresh min/mean/max (ms)\n");
+    for (i = 1; i <= MAX_ADDRESS; i++)
+    {
+        if (addresses[i].packets == 0)
+            continue;
+
+        printf("%7d  %7u", i, addresses[i].packets);
+        if (addresses[i].packets > 1)
+            printf("  %.1f / %.1f / %.1f",
+                   addresses[i].min / 1e6,
+                   addresses[i].total / 1e6 / (addresses[i].packets - 1),
+                   addresses[i].max / 1e6);
+        printf("\n");
+    }
+
+    printf("\nerrors:          %u\n", total_errors);
+    if (total_errors > 0)
+    {
+        printf("  half bit timing:     %u\n", errors.half_timing);
+        printf("  one halves differ:   %u\n", errors.one_mismatch);
+        printf("  zero bit too long:   %u\n", errors.zero_too_long);
+        printf("  misaligned halves:   %u\n", errors.misaligned);
+        printf("  short preamble:      %u\n", errors.short_preamble);
+        printf("  bad length:          %u\n", errors.bad_length);
+        printf("  bad checksum:        %u\n", errors.bad_checksum);
+        printf("  both legs on:        %u\n", errors.shoot_through);
+    }
+
+    return total_errors > 0 ? 1 : 0;
+}
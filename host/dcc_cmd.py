@@ -0,0 +1,198 @@
+#!/usr/bin/env python3
+"""
+Drive the controller from a PC with the binary command protocol
+
+Each frame is a list of commands and a CRC-16, COBS encoded and ended with
+a zero. See src/driver/cmd.h. Speeds given one after another go out as one
+batch, and as many commands as fit go in each frame.
+
+usage: dcc_cmd.py [-p port [-b baud] | -o file] command...
+
+Commands:
+    speed <address> <speed> fwd|rev 28|128
+    function <address> <function> on|off
+    accessory <address> <subaddress> 0|1
+    stop
+    go
+
+Frames are sent to the serial port with pyserial, or written to the file,
+or to stdout if neither is given. For example
+
+    dcc_cmd.py -p /dev/ttyUSB0 speed 3 60 fwd 128 speed 4 20 rev 28
+
+Use Frame from a script to build frames directly.
+"""
+import struct
+import sys
+
+
+CMD_SPEED = 0x01
+CMD_FUNCTION = 0x02
+CMD_ACCESSORY = 0x03
+CMD_E_STOP = 0x04
+
+CMD_SPEED_FORWARD = 0x01
+CMD_SPEED_128 = 0x02
+
+CMD_MAX_PAYLOAD = 248
+
+
+def crc16(data, crc=0xffff):
+    """CRC-16/CCITT-FALSE"""
+    for byte in data:
+        crc ^= byte << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021 if crc & 0x8000 else crc << 1) & 0xffff
+    return crc
+
+
+def cobs_encode(data):
+    """COBS encode, without the zero at the end"""
+    out = bytearray([0])
+    code = 0
+
+    for byte in data:
+        if byte == 0:
+            out[code] = len(out) - code
+            code = len(out)
+            out.append(0)
+            continue
+
+        out.append(byte)
+        if len(out) - code == 0xff:
+            out[code] = 0xff
+            code = len(out)
+            out.append(0)
+
+    out[code] = len(out) - code
+    return bytes(out)
+
+
+class FrameFull(Exception):
+    pass
+
+
+class Frame(object):
+    """A list of commands to send in one frame"""
+
+    def __init__(self):
+        self.payload = bytearray()
+        self.count = None
+
+    def _add(self, data):
+        if len(self.payload) + len(data) > CMD_MAX_PAYLOAD:
+            raise FrameFull()
+        self.payload += data
+
+    def speed(self, address, speed, forward=True, steps=128):
+        entry = struct.pack("<HBB", address, speed,
+                            (CMD_SPEED_FORWARD if forward else 0) |
+                            (CMD_SPEED_128 if steps == 128 else 0))
+
+        if self.count is None or self.payload[self.count] == 0xff:
+            self._add(bytes([CMD_SPEED, 0]) + entry)
+            self.count = len(self.payload) - len(entry) - 1
+        else:
+            self._add(entry)
+        self.payload[self.count] += 1
+
+    def function(self, address, function, on):
+        self._add(struct.pack("<BHBB", CMD_FUNCTION, address, function,
+                              bool(on)))
+        self.count = None
+
+    def accessory(self, address, sub, activate):
+        self._add(struct.pack("<BHBB", CMD_ACCESSORY, address, sub,
+                              bool(activate)))
+        self.count = None
+
+    def e_stop(self, enabled):
+        self._add(bytes([CMD_E_STOP, bool(enabled)]))
+        self.count = None
+
+    def __len__(self):
+        return len(self.payload)
+
+    def encode(self):
+        """The frame ready to send, ending with the zero"""
+        data = bytes(self.payload) + struct.pack(">H", crc16(self.payload))
+        return cobs_encode(data) + b"\0"
+
+
+COMMANDS = {
+    "speed": (4, lambda f, a: f.speed(int(a[0]), int(a[1]),
+                                      a[2] == "fwd", int(a[3]))),
+    "function": (3, lambda f, a: f.function(int(a[0]), int(a[1]),
+                                            a[2] == "on")),
+    "accessory": (3, lambda f, a: f.accessory(int(a[0]), int(a[1]),
+                                              int(a[2]))),
+    "stop": (0, lambda f, a: f.e_stop(True)),
+    "go": (0, lambda f, a: f.e_stop(False)),
+}
+
+
+def encode_commands(args):
+    """Turn command line words into frames"""
+    frames = []
+    frame = Frame()
+
+    while args:
+        name = args.pop(0)
+        if name not in COMMANDS or len(args) < COMMANDS[name][0]:
+            raise ValueError("bad command: %s" % name)
+
+        nargs, add = COMMANDS[name]
+        words, args = args[:nargs], args[nargs:]
+
+        try:
+            add(frame, words)
+        except FrameFull:
+            frames.append(frame.encode())
+            frame = Frame()
+            add(frame, words)
+
+    if len(frame):
+        frames.append(frame.encode())
+
+    return b"".join(frames)
+
+
+def main(argv):
+    port = None
+    path = None
+    baud = 115200
+    args = argv[1:]
+
+    while args and args[0].startswith("-"):
+        if args[0] == "-p" and len(args) > 1:
+            port = args[1]
+        elif args[0] == "-b" and len(args) > 1:
+            baud = int(args[1])
+        elif args[0] == "-o" and len(args) > 1:
+            path = args[1]
+        else:
+            sys.stderr.write(__doc__)
+            return 1
+        args = args[2:]
+
+    try:
+        data = encode_commands(args)
+    except ValueError as e:
+        sys.stderr.write("%s\n%s" % (e, __doc__))
+        return 1
+
+    if port is not None:
+        import serial
+        with serial.Serial(port, baud) as s:
+            s.write(b"\0" + data)
+    elif path is not None:
+        with open(path, "wb") as f:
+            f.write(data)
+    else:
+        sys.stdout.buffer.write(data)
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+"""
+Compare the packets two encoders put on the wire
+
+Each file is the output of dcc_check -p for a trace of one encoder, from
+simulations run with the same options: a line per packet with its octets
+and the shortest and longest zero and one half bits in it. Packets go out
+in a slightly different order from each encoder, as the half bits aren't
+all the same length, so the sets of packets are compared. Then the half
+bit durations of each encoder are shown against the first, for the same
+packets.
+
+usage: dcc_compare.py <reference> <packets>
+
+Exits non-zero if either encoder sent a packet the other didn't.
+"""
+import re
+import sys
+
+
+LINE = re.compile(
+    r"(?P<octets>[0-9a-f ]+?)  zero (?P<zero>\d+-\d+) ns  one (?P<one>\d+-\d+) ns$")
+
+
+def read_packets(path):
+    """Get the half bit durations of each packet, by its octets"""
+    packets = {}
+
+    with open(path) as f:
+        for line in f:
+            m = LINE.match(line.rstrip("\n"))
+            if m is None:
+                raise ValueError("%s: can't read %r" % (path, line))
+
+            packets.setdefault(m.group("octets"), set()).add(
+                (m.group("zero"), m.group("one")))
+
+    return packets
+
+
+def durations(packets, octets):
+    return ", ".join("zero %s ns one %s ns" % t for t in sorted(packets[octets]))
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+
+    ref_path, path = sys.argv[1:]
+    ref = read_packets(ref_path)
+    packets = read_packets(path)
+
+    missing = sorted(set(ref) - set(packets))
+    extra = sorted(set(packets) - set(ref))
+    for octets in missing:
+        print("only in %s: %s" % (ref_path, octets))
+    for octets in extra:
+        print("only in %s: %s" % (path, octets))
+
+    # Group the packets by how their timing compares, so a difference that
+    # only some packets have stands out
+    timings = {}
+    for octets in sorted(set(ref) & set(packets)):
+        key = (durations(ref, octets), durations(packets, octets))
+        timings.setdefault(key, []).append(octets)
+
+    for (ref_timing, timing), same in sorted(timings.items()):
+        print("%d packets" % len(same))
+        print("  %s: %s" % (ref_path, ref_timing))
+        print("  %s: %s" % (path, timing))
+
+    return 1 if missing or extra else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
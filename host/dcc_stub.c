@@ -0,0 +1,103 @@
+/*
+ * DCC driver stand-ins
+ */
+#include "dcc_stub.h"
+
+#include <stdio.h>
+
+#include "dcc.h"
+#include "log.h"
+
+
+bool dcc_stub_verbose;
+uint32_t dcc_stub_calls;
+void (*dcc_stub_speed_hook)(uint16_t address, uint8_t speed);
+
+
+void
+dcc_set_speed(uint16_t address, uint8_t speed, bool is_forward)
+{
+    dcc_stub_calls++;
+
+    if (dcc_stub_speed_hook != NULL)
+        dcc_stub_speed_hook(address, speed);
+
+    if (dcc_stub_verbose)
+        printf("speed %u %u %s\n", address, speed,
+               is_forward ? "forward" : "reverse");
+}
+
+
+void
+dcc_stop_train(uint16_t address, bool is_forward)
+{
+    dcc_stub_calls++;
+
+    if (dcc_stub_verbose)
+        printf("stop %u %s\n", address, is_forward ? "forward" : "reverse");
+}
+
+
+void
+dcc_set_speed_steps(uint16_t address, dcc_speed_steps_t speed_steps)
+{
+    if (dcc_stub_verbose)
+        printf("steps %u %d\n", address,
+               speed_steps == DCC_SPEED_STEPS_128 ? 128 : 28);
+}
+
+
+void
+dcc_set_function(uint16_t address, uint8_t function, bool on)
+{
+    dcc_stub_calls++;
+
+    if (dcc_stub_verbose)
+        printf("function %u F%u %s\n", address, function, on ? "on" : "off");
+}
+
+
+void
+dcc_set_accessory(uint16_t address, uint8_t sub, bool activate)
+{
+    dcc_stub_calls++;
+
+    if (dcc_stub_verbose)
+        printf("accessory %u.%u %d\n", address, sub, activate);
+}
+
+
+static bool stopped;
+
+
+void
+dcc_e_stop(bool enabled)
+{
+    dcc_stub_calls++;
+    stopped = enabled;
+
+    if (dcc_stub_verbose)
+        printf("e-stop %s\n", enabled ? "on" : "off");
+}
+
+
+bool
+dcc_is_e_stopped(void)
+{
+    return stopped;
+}
+
+
+/* The format strings are in this program, so the records can be printed
+ * straight away */
+void
+log_record(uint32_t header, const uint32_t *args)
+{
+    if (!dcc_stub_verbose)
+        return;
+
+    printf("log: ");
+    printf(__start_log_fmt + (header & LOG_ID_MASK),
+           args[0], args[1], args[2], args[3]);
+    printf("\n");
+}
@@ -0,0 +1,24 @@
+/*
+ * Stand-ins for the DCC driver's setters and the log, for timing and
+ * checking the command parsers without the rest of the firmware
+ */
+#ifndef _DCC_STUB_H
+#define _DCC_STUB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/* Print each call, and each log record with its format string */
+extern bool dcc_stub_verbose;
+
+
+/* Number of speed, stop, function, accessory and emergency stop calls */
+extern uint32_t dcc_stub_calls;
+
+
+/* Called with each speed set, if not NULL */
+extern void (*dcc_stub_speed_hook)(uint16_t address, uint8_t speed);
+
+
+#endif /* _DCC_STUB_H */
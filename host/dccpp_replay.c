@@ -0,0 +1,141 @@
+/*
+ * DCC++ command replay
+ *
+ * Feeds a recorded session of DCC++ text commands through dccpp_poll(), a
+ * few bytes at a time, so commands are split across reads at random
+ * places. The driver is stubbed out, and each call it gets, each reply and
+ * each log record is printed, for comparing against the expected output.
+ *
+ * With -b, times the parser over the session instead.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "dccpp.h"
+#include "dcc_stub.h"
+
+
+#define RING_SIZE (1 << 16)
+
+/* Most bytes arriving in one read */
+#define MAX_CHUNK (16)
+
+#define ROUNDS (2000)
+
+#define BAUD (115200)
+
+
+static uint8_t ring_buf[RING_SIZE];
+static ringbuf_t ring;
+
+static uint8_t session[RING_SIZE];
+static size_t session_len;
+
+
+static void
+print_reply(const char *text, size_t len)
+{
+    printf("reply %.*s\n", (int)len, text);
+}
+
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+static void
+replay(void)
+{
+    dccpp_stats_t stats;
+    size_t pos = 0, n;
+
+    dcc_stub_verbose = true;
+    srand(1);
+
+    while (pos < session_len)
+    {
+        n = 1 + rand() % MAX_CHUNK;
+        if (n > session_len - pos)
+            n = session_len - pos;
+
+        pos += ringbuf_write(&ring, &session[pos], n);
+        dccpp_poll(&ring, print_reply);
+    }
+
+    dccpp_get_stats(&stats);
+    printf("%u commands, %u bad\n", stats.commands, stats.bad_commands);
+}
+
+
+static void
+bench(void)
+{
+    dccpp_stats_t stats;
+    double start, ns;
+    int r;
+
+    start = now_ns();
+
+    for (r = 0; r < ROUNDS; r++)
+    {
+        ringbuf_write(&ring, session, session_len);
+        dccpp_poll(&ring, NULL);
+    }
+
+    ns = now_ns() - start;
+
+    dccpp_get_stats(&stats);
+    ns /= stats.commands + stats.bad_commands;
+
+    printf("%u commands of %.1f bytes, %d rounds\n",
+           (stats.commands + stats.bad_commands) / ROUNDS,
+           (double)session_len * ROUNDS /
+           (stats.commands + stats.bad_commands), ROUNDS);
+    printf("DCC++: %5.1f ns/command, %6.2f M commands/s, "
+           "%5.0f commands/s at %d baud\n",
+           ns, 1e3 / ns,
+           BAUD / 10.0 * (stats.commands + stats.bad_commands) /
+           ((double)session_len * ROUNDS), BAUD);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    bool timed = argc == 3 && strcmp(argv[1], "-b") == 0;
+    FILE *f;
+
+    if (argc != 2 && !timed)
+    {
+        fprintf(stderr, "usage: %s [-b] session\n", argv[0]);
+        return 1;
+    }
+
+    f = fopen(argv[argc - 1], "rb");
+    if (f == NULL)
+    {
+        perror(argv[argc - 1]);
+        return 1;
+    }
+
+    session_len = fread(session, 1, sizeof(session), f);
+    fclose(f);
+
+    ringbuf_init(&ring, ring_buf, sizeof(ring_buf));
+
+    if (timed)
+        bench();
+    else
+        replay();
+
+    return 0;
+}
@@ -0,0 +1,63 @@
+/*
+ * Interface between the host stand-in peripherals and the simulator
+ */
+#ifndef _HOST_H
+#define _HOST_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stm32f10x.h"
+#include "dcc_hal.h"
+
+
+/* Timer kernel clock. APB1 runs at HCLK/4, and the timers on it are clocked
+ * at twice that when APB1 is divided down. */
+#define HOST_TIM_CLOCK (SystemCoreClock / 2)
+
+
+/* Reload value given to SysTick_Config(), or 0 if it hasn't been called */
+extern uint32_t host_systick_load;
+
+
+/* Interrupts that have been enabled in the NVIC, by IRQn */
+#define HOST_N_IRQS (64)
+extern bool host_irq_enabled[HOST_N_IRQS];
+
+
+/**
+ * Called by the GPIO stand-ins whenever an output register is written
+ * \param gpio the port that was written
+ */
+extern void
+host_gpio_written(GPIO_TypeDef *gpio);
+
+
+/* Backend that models the wire without running any encoder. Packets are
+ * timed from their bits, so a whole packet is one step. */
+extern const dcc_hal_backend_t host_model_backend;
+
+
+/**
+ * Put the next item on the modelled wire: one bit of preamble or idle, or
+ * a whole packet
+ * \return how long it takes to send, in microseconds
+ */
+extern uint32_t
+host_model_step(void);
+
+
+/* The packet put on the wire by the last step, or a length of 0 if it was
+ * a single bit */
+extern uint8_t host_model_packet[DCC_HAL_MAX_PACKET];
+extern uint8_t host_model_packet_len;
+
+
+/* Firmware interrupt handlers driven by the simulator */
+extern void TIM1_UP_IRQHandler(void);
+extern void TIM2_IRQHandler(void);
+extern void DMA1_Channel3_IRQHandler(void);
+extern void SysTick_Handler(void);
+
+
+#endif /* _HOST_H */
@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+"""
+Decode the binary log into text
+
+The log is a stream of little endian 32 bit words, as sent out of ITM
+stimulus port 1 by the firmware or written by dcc_sim -l. Each record is a
+header, the time in milliseconds and the arguments. The header has the top
+bit set, the number of arguments in bits 24-30 and the offset of the format
+string in the ELF's log_fmt section in the rest. See src/hal/log.h.
+
+usage: log_decode.py <elf> [log]
+
+The log is read from stdin if it isn't given. The ELF must be the build
+that made the log, either output/dcc_controller.elf or output/host/dcc_sim.
+"""
+import re
+import struct
+import sys
+
+
+LOG_VALID = 0x80000000
+LOG_NARGS_SHIFT = 24
+LOG_NARGS_MASK = 0x7f
+LOG_ID_MASK = 0x00ffffff
+
+SECTION = "log_fmt"
+
+CONVERSION = re.compile(
+    r"%(?P<spec>[-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|j|t)?(?P<conv>[diuxXoc%])")
+
+
+def read_section(path, name):
+    """Get the contents of a section from a little endian ELF file"""
+    with open(path, "rb") as f:
+        elf = f.read()
+
+    if elf[:4] != b"\x7fELF" or elf[5] != 1:
+        raise ValueError("%s is not a little endian ELF file" % path)
+
+    if elf[4] == 1:
+        shoff, = struct.unpack_from("<I", elf, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x2e)
+        header = "<IIIIII"
+    else:
+        shoff, = struct.unpack_from("<Q", elf, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", elf, 0x3a)
+        header = "<IIQQQQ"
+
+    sections = [struct.unpack_from(header, elf, shoff + i * shentsize)
+                for i in range(shnum)]
+    strtab = sections[shstrndx]
+
+    for sh_name, _, _, _, offset, size in sections:
+        start = strtab[4] + sh_name
+        if elf[start:elf.index(b"\0", start)].decode() == name:
+            return elf[offset:offset + size]
+
+    raise ValueError("%s has no %s section" % (path, name))
+
+
+def format_string(strings, offset):
+    end = strings.index(b"\0", offset)
+    return strings[offset:end].decode(errors="replace")
+
+
+def expand(fmt, args):
+    """printf the integer arguments into the format"""
+    args = list(args)
+
+    def convert(match):
+        conv = match.group("conv")
+        if conv == "%":
+            return "%"
+        if not args:
+            return "<missing>"
+
+        value = args.pop(0)
+        if conv in "di" and value & 0x80000000:
+            value -= 1 << 32
+        if conv in "ui":
+            conv = "d"
+
+        return ("%" + match.group("spec") + conv) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode(strings, data):
+    """Yield (time in ms, text) for each record"""
+    words = struct.unpack("<%dI" % (len(data) // 4), data[:len(data) & ~3])
+    i = 0
+
+    while i + 2 <= len(words):
+        header = words[i]
+        if not header & LOG_VALID:
+            yield None, "bad header 0x%08x, skipping a word" % header
+            i += 1
+            continue
+
+        nargs = (header >> LOG_NARGS_SHIFT) & LOG_NARGS_MASK
+        offset = header & LOG_ID_MASK
+        args = words[i + 2:i + 2 + nargs]
+
+        if offset >= len(strings):
+            text = "unknown format id 0x%06x %s" % (offset, list(args))
+        else:
+            text = expand(format_string(strings, offset), args)
+
+        yield words[i + 1], text
+        i += 2 + nargs
+
+
+def main(argv):
+    if len(argv) not in (2, 3):
+        sys.stderr.write(__doc__)
+        return 1
+
+    strings = read_section(argv[1], SECTION)
+
+    if len(argv) == 3:
+        with open(argv[2], "rb") as f:
+            data = f.read()
+    else:
+        data = sys.stdin.buffer.read()
+
+    for time, text in decode(strings, data):
+        if time is None:
+            print("%10s %s" % ("", text))
+        else:
+            print("%10.3f %s" % (time / 1000.0, text))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
@@ -0,0 +1,225 @@
+/*
+ * Wire model backend
+ *
+ * Queues packets like the on-chip backend and times them from their bits,
+ * with nominal 58us and 100us half bits. There's no waveform, so it's
+ * cheap enough to benchmark the scheduler over long runs and many trains.
+ */
+#include <string.h>
+
+#include "host.h"
+#include "systick.h"
+
+
+#define ONE_HALF_US (58)
+#define ZERO_HALF_US (100)
+
+
+#define N_SLOTS (32)
+
+
+/* Each slot is the length, the packet and its id */
+static uint8_t slots[N_SLOTS][2 + DCC_HAL_MAX_PACKET];
+static uint8_t urgent[2 + DCC_HAL_MAX_PACKET];
+static uint32_t head, tail;
+static uint8_t ones;
+static bool sending;
+static dcc_hal_stats_t stats;
+
+
+/* The packet on the wire, which finishes at the next step, and the packets
+ * that have finished */
+static dcc_hal_completion_t current;
+static dcc_hal_completion_t done[DCC_HAL_COMPLETIONS];
+static uint32_t done_head, done_tail;
+
+uint8_t host_model_packet[DCC_HAL_MAX_PACKET];
+uint8_t host_model_packet_len;
+
+
+static void
+model_init(void)
+{
+    head = tail = 0;
+    done_head = done_tail = 0;
+    ones = 0;
+    sending = false;
+    urgent[0] = 0;
+    memset(&stats, 0, sizeof(stats));
+}
+
+
+static uint8_t *
+model_reserve(void)
+{
+    if (tail - head == N_SLOTS)
+        return NULL;
+
+    return &slots[tail % N_SLOTS][1];
+}
+
+
+static void
+model_commit(uint8_t len, uint8_t id)
+{
+    if (len == 0 || len > DCC_HAL_MAX_PACKET || tail - head == N_SLOTS)
+        return;
+
+    slots[tail % N_SLOTS][0] = len;
+    slots[tail % N_SLOTS][1 + DCC_HAL_MAX_PACKET] = id;
+    tail++;
+}
+
+
+static uint8_t
+model_get_pending(void)
+{
+    return (uint8_t)(tail - head) + sending;
+}
+
+
+static bool
+model_replace(uint8_t id, const uint8_t *packet, uint8_t len)
+{
+    uint8_t *slot;
+    uint32_t i;
+
+    if (len == 0 || len > DCC_HAL_MAX_PACKET)
+        return false;
+
+    for (i = head; i != tail; i++)
+    {
+        slot = slots[i % N_SLOTS];
+        if (slot[1 + DCC_HAL_MAX_PACKET] != id)
+            continue;
+
+        slot[0] = len;
+        memcpy(&slot[1], packet, len);
+        return true;
+    }
+
+    return false;
+}
+
+
+static void
+model_flush(void)
+{
+    head = tail;
+}
+
+
+static void
+model_set_urgent(const uint8_t *packet, uint8_t len)
+{
+    if (len > DCC_HAL_MAX_PACKET)
+        return;
+
+    if (len > 0)
+    {
+        memcpy(&urgent[1], packet, len);
+        head = tail;
+    }
+
+    urgent[0] = len;
+}
+
+
+static bool
+model_get_completion(dcc_hal_completion_t *completion)
+{
+    if (done_head == done_tail)
+        return false;
+
+    *completion = done[done_head % DCC_HAL_COMPLETIONS];
+    done_head++;
+
+    return true;
+}
+
+
+static void
+model_get_stats(dcc_hal_stats_t *s)
+{
+    *s = stats;
+}
+
+
+const dcc_hal_backend_t host_model_backend =
+{
+    .name = "model",
+    .init = model_init,
+    .reserve = model_reserve,
+    .commit = model_commit,
+    .get_pending = model_get_pending,
+    .replace = model_replace,
+    .flush = model_flush,
+    .set_urgent = model_set_urgent,
+    .get_completion = model_get_completion,
+    .get_stats = model_get_stats,
+};
+
+
+uint32_t
+host_model_step(void)
+{
+    uint8_t *slot;
+    uint32_t bits, one_bits = 1;
+    int i;
+
+    /* The last step's packet ends as this one starts */
+    if (sending)
+    {
+        current.end_us = systick_get_us();
+
+        if (done_tail - done_head == DCC_HAL_COMPLETIONS)
+            stats.dropped++;
+        else
+            done[done_tail++ % DCC_HAL_COMPLETIONS] = current;
+    }
+
+    sending = false;
+    host_model_packet_len = 0;
+
+    if (ones < DCC_HAL_PREAMBLE_BITS || (head == tail && urgent[0] == 0))
+    {
+        if (ones < DCC_HAL_PREAMBLE_BITS)
+            ones++;
+        else
+            stats.idle_bits++;
+
+        stats.bits++;
+        return 2 * ONE_HALF_US;
+    }
+
+    /* Urgent packets go out back to back, ahead of the queue */
+    if (urgent[0] != 0)
+    {
+        slot = urgent;
+        current.id = DCC_HAL_URGENT_ID;
+        stats.urgent++;
+    }
+    else
+    {
+        slot = slots[head % N_SLOTS];
+        current.id = slot[1 + DCC_HAL_MAX_PACKET];
+        head++;
+    }
+
+    current.start_us = systick_get_us();
+
+    /* The start bits are zeros and the end bit is a one */
+    for (i = 1; i <= slot[0]; i++)
+        one_bits += __builtin_popcount(slot[i]);
+    bits = slot[0] * 9 + 1;
+
+    memcpy(host_model_packet, &slot[1], slot[0]);
+    host_model_packet_len = slot[0];
+
+    ones = 0;
+    sending = true;
+    stats.packets++;
+    stats.bits += bits;
+
+    return 2 * (one_bits * ONE_HALF_US + (bits - one_bits) * ZERO_HALF_US);
+}
@@ -0,0 +1,229 @@
+/*
+ * Ring buffer benchmark
+ *
+ * Times passing data through the lock-free ring in src/driver/ringbuf.c,
+ * and through the ring it replaced, which copied a byte at a time, wrapped
+ * its indices with a division and kept a shared length. Data is written
+ * and read back in chunks of a few sizes, as the UART and DCC queues do,
+ * and a byte at a time with pop. The rings are the same size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "ringbuf.h"
+
+
+#define RING_SIZE (1024)
+#define TOTAL_BYTES (64 << 20)
+
+
+/*
+ * The old ring, as it was before the lock-free rewrite. It's kept out of
+ * line, as the new ring is in its own file.
+ */
+typedef struct
+{
+    volatile uint8_t *buffer;
+    volatile size_t head;
+    volatile size_t tail;
+    volatile size_t length;
+    size_t capacity;
+} old_ringbuf_t;
+
+#define min(a, b) ((a) > (b) ? (b) : (a))
+
+#define OUT_OF_LINE __attribute__((noinline))
+
+
+static void
+old_init(old_ringbuf_t *ringbuf, volatile uint8_t *buf, size_t size)
+{
+    ringbuf->buffer = buf;
+    ringbuf->capacity = size;
+    ringbuf->length = 0;
+    ringbuf->head = 0;
+    ringbuf->tail = 0;
+}
+
+
+static OUT_OF_LINE size_t
+old_write(old_ringbuf_t *ringbuf, uint8_t *data, size_t len)
+{
+    size_t i;
+
+    len = min(len, ringbuf->capacity - ringbuf->length);
+
+    for (i = 0; i < len; i++)
+    {
+        ringbuf->buffer[ringbuf->head] = data[i];
+        ringbuf->head = (ringbuf->head + 1) % ringbuf->capacity;
+    }
+
+    ringbuf->length += len;
+
+    return len;
+}
+
+
+static OUT_OF_LINE size_t
+old_read(old_ringbuf_t *ringbuf, uint8_t *data, size_t len)
+{
+    size_t i;
+
+    if (!ringbuf->length)
+        return 0;
+
+    len = min(len, ringbuf->length);
+
+    for (i = 0; i < len; i++)
+    {
+        data[i] = ringbuf->buffer[ringbuf->tail];
+        ringbuf->tail = (ringbuf->tail + 1) % ringbuf->capacity;
+    }
+
+    ringbuf->length -= len;
+
+    return len;
+}
+
+
+static OUT_OF_LINE uint32_t
+old_pop(old_ringbuf_t *ringbuf, uint8_t *data)
+{
+    if (!ringbuf->length)
+        return 0;
+
+    *data = ringbuf->buffer[ringbuf->tail];
+    ringbuf->tail = (ringbuf->tail + 1) % ringbuf->capacity;
+    ringbuf->length--;
+
+    return 1;
+}
+
+
+/*
+ * Timing
+ */
+static uint8_t new_buf[RING_SIZE];
+static volatile uint8_t old_buf[RING_SIZE];
+static uint8_t in[RING_SIZE], out[RING_SIZE];
+
+/* Keeps the compiler from dropping the reads */
+static volatile uint32_t sink;
+
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* Returns MB/s through the new ring, in chunks or by pop */
+static double
+time_new(size_t chunk, bool pop)
+{
+    ringbuf_t rb;
+    size_t moved = 0, i;
+    double start;
+    uint8_t b = 0;
+
+    ringbuf_init(&rb, new_buf, sizeof(new_buf));
+
+    start = now_ns();
+    while (moved < TOTAL_BYTES)
+    {
+        ringbuf_write(&rb, in, chunk);
+
+        if (pop)
+        {
+            for (i = 0; i < chunk; i++)
+            {
+                ringbuf_pop(&rb, &b);
+                sink += b;
+            }
+        }
+        else
+        {
+            ringbuf_read(&rb, out, chunk);
+            sink += out[chunk - 1];
+        }
+
+        moved += chunk;
+    }
+
+    return moved / ((now_ns() - start) / 1e3);
+}
+
+
+static double
+time_old(size_t chunk, bool pop)
+{
+    old_ringbuf_t rb;
+    size_t moved = 0, i;
+    double start;
+    uint8_t b = 0;
+
+    old_init(&rb, old_buf, sizeof(old_buf));
+
+    start = now_ns();
+    while (moved < TOTAL_BYTES)
+    {
+        old_write(&rb, in, chunk);
+
+        if (pop)
+        {
+            for (i = 0; i < chunk; i++)
+            {
+                old_pop(&rb, &b);
+                sink += b;
+            }
+        }
+        else
+        {
+            old_read(&rb, out, chunk);
+            sink += out[chunk - 1];
+        }
+
+        moved += chunk;
+    }
+
+    return moved / ((now_ns() - start) / 1e3);
+}
+
+
+static void
+bench(size_t chunk, bool pop)
+{
+    double old_mbs = time_old(chunk, pop);
+    double new_mbs = time_new(chunk, pop);
+
+    printf("%4zu byte %-6s %8.1f MB/s old, %8.1f MB/s new, %5.1fx\n",
+           chunk, pop ? "pops:" : "reads:", old_mbs, new_mbs,
+           new_mbs / old_mbs);
+}
+
+
+int
+main(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(in); i++)
+        in[i] = i;
+
+    printf("%d MB through a %d byte ring\n", TOTAL_BYTES >> 20, RING_SIZE);
+    bench(1, false);
+    bench(16, false);
+    bench(256, false);
+    bench(16, true);
+
+    return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Ring buffer stress test
+ *
+ * A producer thread and a consumer thread pass a counting sequence through
+ * one ring as fast as they can, each using every call on its side of the
+ * ring in turn with chunks of varying size. The consumer checks every byte
+ * arrives once and in order.
+ *
+ * Build it with -fsanitize=thread, so ThreadSanitizer checks that the
+ * acquire and release ordering of the indices covers every access to the
+ * data. Any race it finds makes the program exit non-zero.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ringbuf.h"
+
+
+/* Small enough that the producer keeps finding the ring full, and the
+ * chunks wrap around its end often */
+#define RING_SIZE (256)
+#define MAX_CHUNK (100)
+
+#define DEFAULT_BYTES (4000000)
+
+
+static uint8_t ring_buf[RING_SIZE];
+static ringbuf_t ring;
+
+static size_t total;
+
+
+/* The byte at a position in the sequence. The period isn't a multiple of
+ * the ring size, so a byte read from the wrong lap doesn't match. */
+static uint8_t
+sequence(size_t pos)
+{
+    return pos % 251;
+}
+
+
+/* Cheap per-thread random numbers, so each thread has its own state */
+static uint32_t
+next_rand(uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 16;
+}
+
+
+static void *
+producer(void *arg)
+{
+    uint8_t chunk[MAX_CHUNK];
+    uint32_t seed = 1;
+    size_t pos = 0, len, i;
+    uint8_t *space;
+
+    while (pos < total)
+    {
+        len = 1 + next_rand(&seed) % MAX_CHUNK;
+        if (len > total - pos)
+            len = total - pos;
+
+        if (next_rand(&seed) % 2)
+        {
+            for (i = 0; i < len; i++)
+                chunk[i] = sequence(pos + i);
+
+            pos += ringbuf_write(&ring, chunk, len);
+        }
+        else
+        {
+            space = ringbuf_reserve(&ring, &len);
+            if (len > total - pos)
+                len = total - pos;
+
+            for (i = 0; i < len; i++)
+                space[i] = sequence(pos + i);
+
+            ringbuf_commit(&ring, len);
+            pos += len;
+        }
+
+        /* Let the consumer run if the ring is full, for hosts with one
+         * core */
+        if (ringbuf_get_space(&ring) == 0)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+
+/* Check a run of bytes against the sequence, exiting if it's wrong */
+static void
+check(const uint8_t *data, size_t len, size_t pos)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (data[i] != sequence(pos + i))
+        {
+            fprintf(stderr, "byte %zu is %u, should be %u\n", pos + i,
+                    data[i], sequence(pos + i));
+            exit(1);
+        }
+    }
+}
+
+
+static void *
+consumer(void *arg)
+{
+    uint8_t chunk[MAX_CHUNK];
+    uint32_t seed = 2;
+    size_t pos = 0, len, offset;
+    uint8_t *data;
+
+    while (pos < total)
+    {
+        switch (next_rand(&seed) % 4)
+        {
+        case 0:
+            len = ringbuf_read(&ring, chunk, 1 + next_rand(&seed) % MAX_CHUNK);
+            check(chunk, len, pos);
+            break;
+
+        case 1:
+            data = ringbuf_peek(&ring, &len);
+            check(data, len, pos);
+            ringbuf_consume(&ring, len);
+            break;
+
+        case 2:
+            len = ringbuf_pop(&ring, chunk);
+            check(chunk, len, pos);
+            break;
+
+        default:
+            /* Look through what's there without taking it, as the command
+             * parser does */
+            offset = 0;
+            ringbuf_find(&ring, &offset, sequence(pos + 10));
+            for (len = 0; len < offset; len++)
+            {
+                chunk[0] = ringbuf_get_byte(&ring, len);
+                check(chunk, 1, pos + len);
+            }
+            ringbuf_consume(&ring, len);
+            break;
+        }
+
+        pos += len;
+
+        if (len == 0)
+            sched_yield();
+    }
+
+    return NULL;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    pthread_t threads[2];
+
+    total = argc > 1 ? strtoul(argv[1], NULL, 0) : DEFAULT_BYTES;
+    if (argc > 2 || total == 0)
+    {
+        fprintf(stderr, "usage: %s [bytes]\n", argv[0]);
+        return 1;
+    }
+
+    /* A size that isn't a power of two is refused, leaving no room */
+    if (ringbuf_init(&ring, ring_buf, RING_SIZE - 1) ||
+        ringbuf_write(&ring, ring_buf, 1) != 0)
+    {
+        fprintf(stderr, "a %d byte ring was accepted\n", RING_SIZE - 1);
+        return 1;
+    }
+
+    ringbuf_init(&ring, ring_buf, sizeof(ring_buf));
+
+    pthread_create(&threads[0], NULL, producer, NULL);
+    pthread_create(&threads[1], NULL, consumer, NULL);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    if (ringbuf_get_len(&ring) != 0)
+    {
+        fprintf(stderr, "%zu bytes left over\n", ringbuf_get_len(&ring));
+        return 1;
+    }
+
+    printf("%zu bytes passed through a %d byte ring\n", total, RING_SIZE);
+
+    return 0;
+}
@@ -0,0 +1,1193 @@
+/*
+ * DCC host simulator
+ *
+ * Runs the DCC driver, HAL and ring buffer on the host in virtual time. The
+ * DCC and SysTick interrupts are raised when the stand-in peripherals say
+ * they're due, and every change to the DCC outputs is written to a trace.
+ *
+ * With the SPI encoder, the bytes the DMA would send are played out of MOSI
+ * one half buffer at a time. MOSI is traced as pin 1 and its inverse as
+ * pin 2, which is what a booster with a direction input puts on the track.
+ *
+ * With the DMA encoder, TIM3 and the three DMA channels it triggers are
+ * played one period at a time: the update latches the preloaded ARR and
+ * moves the next duration into it, and the two pin writes land at the
+ * start of the period and once the dead time is up. The CPU only sees the
+ * half and full transfer interrupts of the duration buffer.
+ *
+ * With the TIM1 encoder, channel 3 and its complementary output are played
+ * one bit at a time from the ARR and CCR3 latched at each update, with the
+ * dead time holding off each output as it turns on. CH3N on PB1 is traced
+ * as pin 1 and CH3 on PA10 as pin 2.
+ *
+ * With -b model, the driver sends through the wire model in model.c instead
+ * of the HAL, and there's no waveform to trace.
+ *
+ * With -s, the first train's throttle is swept up and down and read on
+ * every pass of the main loop, like a pot being swung back and forth. With
+ * the model backend, every speed packet that goes out for the train is
+ * checked against the last speed set.
+ *
+ * With -e, the emergency stop button is pressed at a random time in every
+ * period. The firmware sees the press at the next SysTick, which samples
+ * the buttons, and the time from the press to the stop packet starting on
+ * the rail is measured. That's the start time the backend reports for the
+ * first urgent packet it finishes after the press, which the encoders that
+ * work ahead of the pins put at the time on the wire. The stop is released
+ * half a period later.
+ *
+ * With -f, every train has a few functions on from the start, and every
+ * few speed changes also flip one of the train's functions, so function
+ * changes and refreshes compete with speed packets for the wire.
+ *
+ * With -l, the binary log is drained from the main loop into a file, as the
+ * firmware sends it out over ITM. host/log_decode.py turns it into text
+ * using this program's own format strings.
+ *
+ * The main loop only sees new state after an interrupt, so dcc_update() is
+ * called once after each one. That's what the firmware would see with a
+ * main loop that never stalls. Each pass of dcc_update() is timed on the
+ * host clock, and the longest is reported, as that's how long it holds up
+ * the rest of the main loop.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "dcc.h"
+#include "dcc_hal.h"
+#include "systick.h"
+#include "prof.h"
+#include "log.h"
+
+
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_TICK) || \
+    (DCC_HAL_ENCODER == DCC_HAL_ENCODER_VARIABLE)
+#define SIM_TIM2 (1)
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_SPI)
+#define SIM_SPI (1)
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_DMA)
+#define SIM_DMA (1)
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_TIM1)
+#define SIM_TIM1 (1)
+#endif
+
+
+/* Default run, overridden from the command line */
+#define DEFAULT_SECONDS (10)
+#define DEFAULT_TRAINS (10)
+#define DEFAULT_CHANGE_MS (100)
+
+
+/* Trains from this index up are given long addresses */
+#define LONG_ADDRESS_BASE (1000)
+
+
+/* Virtual time in core clock cycles */
+static uint64_t now;
+
+static FILE *trace;
+static int last_pins = -1;
+
+static FILE *log_file;
+static uint64_t log_records;
+
+static const dcc_hal_backend_t *backend = &dcc_hal_backend;
+
+/* The backend as the driver sees it, which passes everything on to backend
+ * but gets to look at the packets queued and the completions first */
+static dcc_hal_backend_t tap;
+static uint8_t *tap_slot;
+
+
+/* Counters for the summary */
+static uint64_t dcc_irqs;
+static uint64_t systick_irqs;
+static uint64_t transitions;
+
+/* Host time spent in dcc_update(), in core clock cycles */
+static uint64_t update_passes;
+static uint64_t update_total;
+static uint32_t update_max;
+
+
+/* Throttle sweep of the first train */
+static int sweep_ms;
+static uint8_t sweep_speed;
+static uint64_t sweep_sets;
+static uint64_t sweep_checked;
+static uint64_t sweep_stale;
+
+
+/* Emergency stop button. The target is for the stop to reach the rail
+ * within E_STOP_TARGET_MS of the press. */
+#define E_STOP_TARGET_MS (10)
+
+static int e_stop_ms;
+static uint64_t e_stop_press;       /* Time of the next press */
+static uint64_t e_stop_release;     /* Time of the next release */
+static bool e_stop_pressed;         /* Waiting for the stop to reach the rail */
+static bool e_stop_held;
+static uint32_t e_stop_us;          /* Time of the last press */
+static uint64_t e_stop_min = UINT64_MAX;
+static uint64_t e_stop_max;
+static uint64_t e_stop_total;
+static uint32_t e_stop_count;
+
+
+/* Names of the driver's classes of packet, for the latency from queueing a
+ * packet to the end of it on the wire and their share of the wire */
+static const char *class_names[DCC_N_CLASSES] =
+{
+    "e-stop",
+    "speed",
+    "function",
+    "accessory",
+    "refresh",
+    "func ref",
+};
+
+
+/* Functions turned on at the start, and how many speed changes there are
+ * to each function flipped */
+#define START_FUNCTIONS (3)
+#define FUNCTION_CHANGE_EVERY (4)
+
+static bool functions;
+static uint32_t function_changes;
+
+
+/* Speed change latency, from dcc_set_speed() to the end of the first
+ * speed packet queued for the train after it, or updated in the queue, on
+ * the wire. The first MAX_LATENCY_SAMPLES are kept for the percentiles. */
+#define MAX_LATENCY_SAMPLES (100000)
+
+typedef struct
+{
+    bool pending;
+    int16_t id;         /* Packet carrying the change, or -1 until queued */
+    uint32_t us;        /* Time of the change */
+} change_t;
+
+static change_t changes[DCC_N_TRAINS];
+static uint64_t latency_min = UINT64_MAX;
+static uint64_t latency_max;
+static uint64_t latency_total;
+static uint32_t latency_count;
+static uint64_t latency_samples[MAX_LATENCY_SAMPLES];
+
+
+static uint64_t
+cycles_to_ns(uint64_t cycles)
+{
+    return cycles * 1000 / (SystemCoreClock / 1000000);
+}
+
+
+/* Bring the SysTick counter up to now. If the next SysTick is due now, the
+ * counter has just reloaded and the interrupt is pending until it's
+ * taken. */
+static void
+sync_systick(uint64_t next_systick)
+{
+    SysTick->VAL = SysTick->LOAD - (uint32_t)(now % host_systick_load);
+
+    if (now == next_systick)
+        SCB->ICSR |= SCB_ICSR_PENDSTSET_Msk;
+    else
+        SCB->ICSR &= ~SCB_ICSR_PENDSTSET_Msk;
+}
+
+
+/* Log output, written out as the words would come over ITM */
+static void
+write_log(const uint32_t *words, uint8_t n)
+{
+    fwrite(words, sizeof(uint32_t), n, log_file);
+    log_records++;
+}
+
+
+static void
+record_pins(uint64_t time, bool pin_1, bool pin_2)
+{
+    int pins = pin_1 | pin_2 << 1;
+
+    if (pins == last_pins)
+        return;
+
+    last_pins = pins;
+    transitions++;
+
+    if (trace != NULL)
+        fprintf(trace, "%llu %d %d\n",
+                (unsigned long long)cycles_to_ns(time), pin_1, pin_2);
+}
+
+
+void
+host_gpio_written(GPIO_TypeDef *gpio)
+{
+    if (gpio != DCC_HAL_GPIO)
+        return;
+
+    record_pins(now, (gpio->ODR & DCC_HAL_GPIO_PIN_1) != 0,
+                (gpio->ODR & DCC_HAL_GPIO_PIN_2) != 0);
+}
+
+
+static uint16_t
+train_address(int i)
+{
+    return i % 2 ? LONG_ADDRESS_BASE + i : i + 1;
+}
+
+
+/* A packet has been queued with the given id, or has replaced the queued
+ * packet with it. If it's the first speed packet for a train since its
+ * speed was changed, the change is timed to the end of it on the wire. */
+static void
+change_queued(const uint8_t *packet, uint8_t len, uint8_t id)
+{
+    uint16_t address;
+    uint8_t instruction;
+    int train;
+
+    if (len < 3)
+        return;
+
+    if ((packet[0] & 0xc0) == 0xc0)
+    {
+        address = (packet[0] & 0x3f) << 8 | packet[1];
+        instruction = packet[2];
+        train = address - LONG_ADDRESS_BASE;
+    }
+    else
+    {
+        address = packet[0];
+        instruction = packet[1];
+        train = address - 1;
+    }
+
+    /* 128 step speeds, or 28 step speed and direction */
+    if (address == 0 || train < 0 || train >= DCC_N_TRAINS ||
+        train_address(train) != address ||
+        (instruction != 0x3f && (instruction & 0xc0) != 0x40))
+        return;
+
+    if (changes[train].pending && changes[train].id < 0)
+        changes[train].id = id;
+}
+
+
+static void
+change_done(const dcc_hal_completion_t *done)
+{
+    uint64_t latency;
+    int i;
+
+    for (i = 0; i < DCC_N_TRAINS; i++)
+    {
+        if (!changes[i].pending || changes[i].id != done->id)
+            continue;
+
+        changes[i].pending = false;
+        latency = (uint64_t)(done->end_us - changes[i].us) *
+            (SystemCoreClock / 1000000);
+
+        if (latency < latency_min)
+            latency_min = latency;
+        if (latency > latency_max)
+            latency_max = latency;
+        latency_total += latency;
+
+        if (latency_count < MAX_LATENCY_SAMPLES)
+            latency_samples[latency_count] = latency;
+        latency_count++;
+    }
+}
+
+
+/* Move the swept throttle along, from stop to full and back every
+ * sweep_ms, and set the speed whenever it changes */
+static void
+sweep(void)
+{
+    uint64_t period = (uint64_t)sweep_ms * (SystemCoreClock / 1000);
+    uint64_t phase = now % period;
+    uint8_t speed;
+
+    if (phase < period / 2)
+        speed = phase * 2 * DCC_MAX_SPEED / period;
+    else
+        speed = (period - phase) * 2 * DCC_MAX_SPEED / period;
+
+    if (speed == sweep_speed)
+        return;
+
+    sweep_speed = speed;
+    sweep_sets++;
+    dcc_set_speed(train_address(0), speed, true);
+}
+
+
+/* Check a packet that has just gone out on the wire. A speed packet for
+ * the swept train has to carry the last speed set. */
+static void
+sweep_check(const uint8_t *packet, uint8_t len)
+{
+    uint8_t speed;
+
+    if (len != 4 || packet[0] != train_address(0) || packet[1] != 0x3f)
+        return;
+
+    /* Speed step 1 is the emergency stop, so moving speeds start at 2 */
+    speed = packet[2] & 0x7f;
+    if (speed > 0)
+        speed--;
+
+    sweep_checked++;
+    if (speed != sweep_speed)
+        sweep_stale++;
+}
+
+
+static uint64_t
+ms_to_cycles(uint64_t ms)
+{
+    return ms * (SystemCoreClock / 1000);
+}
+
+
+/* Time the press to the start of the first stop packet on the wire. A
+ * stop packet that started before the press is left over from the last
+ * one. */
+static void
+e_stop_done(const dcc_hal_completion_t *done)
+{
+    uint64_t latency;
+
+    if (!e_stop_pressed || done->id != DCC_HAL_URGENT_ID ||
+        (int32_t)(done->start_us - e_stop_us) < 0)
+        return;
+
+    e_stop_pressed = false;
+    latency = (uint64_t)(done->start_us - e_stop_us) *
+        (SystemCoreClock / 1000000);
+
+    if (latency < e_stop_min)
+        e_stop_min = latency;
+    if (latency > e_stop_max)
+        e_stop_max = latency;
+    e_stop_total += latency;
+    e_stop_count++;
+}
+
+
+static uint8_t *
+tap_reserve(void)
+{
+    tap_slot = backend->reserve();
+    return tap_slot;
+}
+
+
+static void
+tap_commit(uint8_t len, uint8_t id)
+{
+    change_queued(tap_slot, len, id);
+    backend->commit(len, id);
+}
+
+
+static bool
+tap_replace(uint8_t id, const uint8_t *packet, uint8_t len)
+{
+    if (!backend->replace(id, packet, len))
+        return false;
+
+    change_queued(packet, len, id);
+    return true;
+}
+
+
+static bool
+tap_get_completion(dcc_hal_completion_t *completion)
+{
+    if (!backend->get_completion(completion))
+        return false;
+
+    change_done(completion);
+
+    if (e_stop_ms > 0)
+        e_stop_done(completion);
+
+    return true;
+}
+
+
+/* Press and release the emergency stop button. The press is timed by
+ * e_stop_done. */
+static void
+e_stop_button(void)
+{
+    /* SysTick n samples the buttons at time n * host_systick_load */
+    if (!e_stop_held && now >= e_stop_press &&
+        systicks > e_stop_press / host_systick_load)
+    {
+        e_stop_held = true;
+        e_stop_pressed = true;
+        e_stop_us = e_stop_press / (SystemCoreClock / 1000000);
+        e_stop_release = e_stop_press + ms_to_cycles(e_stop_ms) / 2;
+        e_stop_press += ms_to_cycles(e_stop_ms) +
+            rand() % ms_to_cycles(e_stop_ms / 2);
+
+        dcc_e_stop(true);
+    }
+
+    if (e_stop_held && !e_stop_pressed && now >= e_stop_release)
+    {
+        e_stop_held = false;
+        dcc_e_stop(false);
+    }
+}
+
+
+/* Flip one of a train's functions. The state of each is kept here, as the
+ * driver has no way to read it back. */
+static void
+flip_function(int train)
+{
+    static uint32_t on[DCC_N_TRAINS];
+    uint8_t f = rand() % (DCC_MAX_FUNCTION + 1);
+
+    on[train] ^= 1u << f;
+    dcc_set_function(train_address(train), f, (on[train] >> f) & 1);
+}
+
+
+/* Stand-in for the main loop, run after every interrupt */
+static void
+main_loop(int n_trains, int change_ms)
+{
+    static size_t last_change;
+    static int next_train;
+    uint32_t start, cycles;
+
+    if (e_stop_ms > 0)
+        e_stop_button();
+
+    if (sweep_ms > 0)
+        sweep();
+
+    if (systicks - last_change >= (size_t)change_ms)
+    {
+        last_change = systicks;
+
+        /* The swept train is left to the sweep */
+        if (sweep_ms > 0 && next_train == 0)
+            next_train = 1;
+
+        if (next_train < n_trains)
+        {
+            changes[next_train].pending = true;
+            changes[next_train].id = -1;
+            changes[next_train].us = systick_get_us();
+
+            dcc_set_speed(train_address(next_train),
+                          rand() % (DCC_MAX_SPEED + 1), rand() % 2);
+
+            if (functions && ++function_changes % FUNCTION_CHANGE_EVERY == 0)
+                flip_function(next_train);
+            next_train = (next_train + 1) % n_trains;
+        }
+    }
+
+    start = DWT_CYCCNT;
+    dcc_update();
+    cycles = DWT_CYCCNT - start;
+
+    update_passes++;
+    update_total += cycles;
+    if (cycles > update_max)
+        update_max = cycles;
+
+    log_drain();
+}
+
+
+static int
+compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+
+/* The latency that percent of the kept samples are at or under, in us.
+ * The samples must be sorted. */
+static uint64_t
+latency_percentile(uint32_t n, int percent)
+{
+    uint32_t i = ((uint64_t)n * percent + 99) / 100;
+
+    return cycles_to_ns(latency_samples[i > 0 ? i - 1 : 0]) / 1000;
+}
+
+
+#if SIM_TIM2
+
+/* Without preload, a new ARR applies to the period that's running. With it,
+ * the value is latched at the next update. */
+static uint16_t tim2_arr;
+
+
+static uint64_t
+tim2_period(uint16_t arr)
+{
+    return (uint64_t)(arr + 1) * (TIM2->PSC + 1) *
+        (SystemCoreClock / HOST_TIM_CLOCK);
+}
+
+
+static bool
+wave_started(void)
+{
+    return (TIM2->CR1 & TIM_CR1_CEN) && (TIM2->DIER & TIM_IT_Update) &&
+        host_irq_enabled[TIM2_IRQn];
+}
+
+
+/* Time of the first interrupt */
+static uint64_t
+wave_first(void)
+{
+    tim2_arr = TIM2->ARR;
+    return tim2_period(tim2_arr);
+}
+
+
+/* Raises the interrupt that's due now, and returns the time of the next */
+static uint64_t
+wave_event(void)
+{
+    if (TIM2->CR1 & TIM_CR1_ARPE)
+        tim2_arr = TIM2->ARR;
+
+    TIM2->SR |= TIM_IT_Update;
+    TIM2_IRQHandler();
+
+    if (!(TIM2->CR1 & TIM_CR1_ARPE))
+        tim2_arr = TIM2->ARR;
+
+    return now + tim2_period(tim2_arr);
+}
+
+#elif SIM_SPI
+
+/* Next byte of the DMA buffer to go out */
+static uint32_t spi_pos;
+
+
+/* SPI1 runs from APB2, which is the core clock */
+static uint64_t
+spi_byte_cycles(void)
+{
+    return 8 * (2u << ((SPI1->CR1 & SPI_CR1_BR) >> 3));
+}
+
+
+static uint64_t
+spi_half_cycles(void)
+{
+    return DMA1_Channel3->CNDTR / 2 * spi_byte_cycles();
+}
+
+
+static bool
+wave_started(void)
+{
+    return (SPI1->CR1 & SPI_CR1_SPE) && (SPI1->CR2 & SPI_CR2_TXDMAEN) &&
+        (DMA1_Channel3->CCR & DMA_CCR_EN) &&
+        (DMA1_Channel3->CCR & (DMA_IT_HT | DMA_IT_TC)) ==
+        (DMA_IT_HT | DMA_IT_TC) &&
+        (DMA1_Channel3->CCR & DMA_Mode_Circular) &&
+        host_irq_enabled[DMA1_Channel3_IRQn];
+}
+
+
+static uint64_t
+wave_first(void)
+{
+    return spi_half_cycles();
+}
+
+
+/* Plays the half buffer that has just finished, MSB first, then raises the
+ * half or full transfer interrupt for it */
+static uint64_t
+wave_event(void)
+{
+    const uint8_t *buf = (const uint8_t *)DMA1_Channel3->CMAR;
+    uint32_t half = DMA1_Channel3->CNDTR / 2;
+    uint64_t cell = spi_byte_cycles() / 8;
+    uint64_t time = now - spi_half_cycles();
+    uint32_t i;
+    int b;
+    bool mosi;
+
+    for (i = 0; i < half; i++)
+    {
+        for (b = 7; b >= 0; b--)
+        {
+            mosi = (buf[spi_pos + i] >> b) & 1;
+            record_pins(time, mosi, !mosi);
+            time += cell;
+        }
+    }
+
+    spi_pos += half;
+    if (spi_pos == DMA1_Channel3->CNDTR)
+    {
+        spi_pos = 0;
+        host_dma1_isr |= DMA1_IT_GL3 | DMA1_IT_TC3;
+    }
+    else
+    {
+        host_dma1_isr |= DMA1_IT_GL3 | DMA1_IT_HT3;
+    }
+
+    DMA1_Channel3_IRQHandler();
+
+    return now + spi_half_cycles();
+}
+
+#elif SIM_DMA
+
+/* The ARR value latched at the last update, which sets the length of the
+ * period running */
+static uint16_t tim3_arr;
+
+/* Next transfer of each circular channel */
+static uint32_t reload_pos;
+static uint32_t pins_pos;
+
+
+static uint64_t
+tim3_ticks(uint32_t ticks)
+{
+    return (uint64_t)ticks * (TIM3->PSC + 1) *
+        (SystemCoreClock / HOST_TIM_CLOCK);
+}
+
+
+static bool
+channel_started(DMA_Channel_TypeDef *channel, volatile void *periph)
+{
+    return (channel->CCR & (DMA_CCR_EN | DMA_Mode_Circular)) ==
+        (DMA_CCR_EN | DMA_Mode_Circular) &&
+        channel->CPAR == (uintptr_t)periph;
+}
+
+
+static bool
+wave_started(void)
+{
+    uint16_t requests = TIM_DMA_Update | TIM_DMA_CC1 | TIM_DMA_CC3;
+
+    return (TIM3->CR1 & TIM_CR1_CEN) && (TIM3->CR1 & TIM_CR1_ARPE) &&
+        (TIM3->DIER & requests) == requests &&
+        channel_started(DMA1_Channel3, &TIM3->ARR) &&
+        channel_started(DMA1_Channel2, &DCC_HAL_GPIO->BSRR) &&
+        channel_started(DMA1_Channel6, &DCC_HAL_GPIO->BSRR) &&
+        (DMA1_Channel3->CCR & (DMA_IT_HT | DMA_IT_TC)) ==
+        (DMA_IT_HT | DMA_IT_TC) &&
+        host_irq_enabled[DMA1_Channel3_IRQn];
+}
+
+
+/* A channel writing the next word of its buffer to the bit set/reset
+ * register */
+static void
+write_bsrr(DMA_Channel_TypeDef *channel, uint32_t pos, uint64_t time)
+{
+    uint32_t bsrr = ((const uint32_t *)channel->CMAR)[pos];
+    GPIO_TypeDef *gpio = DCC_HAL_GPIO;
+
+    gpio->ODR = (gpio->ODR | (bsrr & 0xffff)) & ~(bsrr >> 16);
+    record_pins(time, (gpio->ODR & DCC_HAL_GPIO_PIN_1) != 0,
+                (gpio->ODR & DCC_HAL_GPIO_PIN_2) != 0);
+}
+
+
+/* CC3 matches at the start of every period and CC1 when the dead time is
+ * up, each moving a pin write */
+static void
+period_start(uint64_t time)
+{
+    write_bsrr(DMA1_Channel2, 0, time);
+    write_bsrr(DMA1_Channel6, pins_pos, time + tim3_ticks(TIM3->CCR1));
+    pins_pos = (pins_pos + 1) % DMA1_Channel6->CNDTR;
+}
+
+
+/* The update at the end of a period. The preloaded ARR is latched, then
+ * replaced with the next duration from the buffer. Returns true if the
+ * transfer raises the half or full transfer interrupt. */
+static bool
+tim3_update(uint64_t time)
+{
+    const uint16_t *reload = (const uint16_t *)DMA1_Channel3->CMAR;
+
+    tim3_arr = TIM3->ARR;
+    TIM3->ARR = reload[reload_pos++];
+    period_start(time);
+
+    if (reload_pos == DMA1_Channel3->CNDTR / 2)
+    {
+        host_dma1_isr |= DMA1_IT_GL3 | DMA1_IT_HT3;
+        return true;
+    }
+
+    if (reload_pos == DMA1_Channel3->CNDTR)
+    {
+        reload_pos = 0;
+        host_dma1_isr |= DMA1_IT_GL3 | DMA1_IT_TC3;
+        return true;
+    }
+
+    return false;
+}
+
+
+/* Play the periods from one that starts at the given time up to the next
+ * update that interrupts, and return its time. The durations they use were
+ * all written by earlier interrupts. */
+static uint64_t
+next_interrupt(uint64_t time)
+{
+    do
+    {
+        time += tim3_ticks(tim3_arr + 1);
+    } while (!tim3_update(time));
+
+    return time;
+}
+
+
+static uint64_t
+wave_first(void)
+{
+    tim3_arr = TIM3->ARR;
+    period_start(0);
+
+    return next_interrupt(0);
+}
+
+
+static uint64_t
+wave_event(void)
+{
+    DMA1_Channel3_IRQHandler();
+
+    return next_interrupt(now);
+}
+
+#elif SIM_TIM1
+
+/* ARR and CCR3 latched at the last update, which set the bit running */
+static uint16_t tim1_arr;
+static uint16_t tim1_ccr3;
+
+
+/* TIM1 is on APB2, so it counts the core clock */
+static uint64_t
+tim1_ticks(uint32_t ticks)
+{
+    return (uint64_t)ticks * (TIM1->PSC + 1);
+}
+
+
+/* Dead time from the DTG field of BDTR, in core clock cycles as CKD is 0 */
+static uint64_t
+tim1_dead_time(void)
+{
+    uint8_t dtg = TIM1->BDTR & TIM_BDTR_DTG;
+
+    if ((dtg & 0x80) == 0)
+        return dtg;
+    if ((dtg & 0xc0) == 0x80)
+        return (64 + (dtg & 0x3f)) * 2;
+    if ((dtg & 0xe0) == 0xc0)
+        return (32 + (dtg & 0x1f)) * 8;
+    return (32 + (dtg & 0x1f)) * 16;
+}
+
+
+static bool
+wave_started(void)
+{
+    uint16_t outputs = TIM_CCER_CC3E | TIM_CCER_CC3NE;
+
+    return (TIM1->CR1 & TIM_CR1_CEN) && (TIM1->CR1 & TIM_CR1_ARPE) &&
+        (TIM1->CCMR2 & TIM_CCMR2_OC3PE) &&
+        (TIM1->CCMR2 & TIM_CCMR2_OC3M) == TIM_OCMode_PWM1 &&
+        (TIM1->CCER & outputs) == outputs &&
+        (TIM1->BDTR & TIM_BDTR_MOE) && (TIM1->DIER & TIM_IT_Update) &&
+        host_irq_enabled[TIM1_UP_IRQn];
+}
+
+
+/* Latch the preloaded values and play the bit starting at the given time.
+ * CH3 is active below the compare value and CH3N from it to the end of the
+ * period, and each waits out the dead time as it turns on. */
+static void
+tim1_update(uint64_t time)
+{
+    uint64_t dead = tim1_dead_time();
+    uint64_t compare;
+
+    tim1_arr = TIM1->ARR;
+    tim1_ccr3 = TIM1->CCR3;
+    compare = time + tim1_ticks(tim1_ccr3);
+
+    record_pins(time, false, false);
+    record_pins(time + dead, false, true);
+    record_pins(compare, false, false);
+    record_pins(compare + dead, true, false);
+}
+
+
+static uint64_t
+wave_first(void)
+{
+    tim1_update(0);
+
+    return tim1_ticks(tim1_arr + 1);
+}
+
+
+static uint64_t
+wave_event(void)
+{
+    tim1_update(now);
+
+    TIM1->SR |= TIM_IT_Update;
+    TIM1_UP_IRQHandler();
+
+    return now + tim1_ticks(tim1_arr + 1);
+}
+
+#endif
+
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr,
+            "usage: %s [-t seconds] [-n trains] [-c change_ms] [-o trace]\n"
+            "       [-l log] [-b hal|model] [-s sweep_ms] [-e e_stop_ms] [-f]\n"
+            "\n"
+            "  -t  virtual time to run for (default %d)\n"
+            "  -n  number of trains to drive (default %d)\n"
+            "  -c  milliseconds between speed changes (default %d)\n"
+            "  -o  write each change of the DCC outputs to a file, one line\n"
+            "      of \"<time ns> <pin 1> <pin 2>\" per change\n"
+            "  -l  write the binary log to a file, for log_decode.py\n"
+            "  -b  send through the HAL and its encoder (default), or a model\n"
+            "      of the wire that doesn't generate a waveform\n"
+            "  -s  sweep the first train's throttle from stop to full and\n"
+            "      back every sweep_ms, setting it on every pass of the main\n"
+            "      loop. The model backend checks no stale speed goes out.\n"
+            "  -e  press the emergency stop at a random time every\n"
+            "      e_stop_ms, release it half way through, and time the\n"
+            "      press to the stop going out. Fails if that's %dms or more.\n"
+            "  -f  turn on %d functions of every train, and flip one with\n"
+            "      every %d speed changes\n",
+            name, DEFAULT_SECONDS, DEFAULT_TRAINS, DEFAULT_CHANGE_MS,
+            E_STOP_TARGET_MS, START_FUNCTIONS, FUNCTION_CHANGE_EVERY);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    double seconds = DEFAULT_SECONDS;
+    int n_trains = DEFAULT_TRAINS;
+    int change_ms = DEFAULT_CHANGE_MS;
+    uint64_t end, next_wave, next_systick;
+    uint64_t cycles_per_us = SystemCoreClock / 1000000;
+    dcc_stats_t stats[DCC_N_CLASSES];
+    dcc_hal_stats_t wire;
+    uint64_t packets = 0, bits = 0;
+    double elapsed;
+    char label[20];
+    uint32_t n;
+    int opt, i, j;
+
+    while ((opt = getopt(argc, argv, "t:n:c:o:l:b:s:e:fh")) != -1)
+    {
+        switch (opt)
+        {
+        case 't':
+            seconds = atof(optarg);
+            break;
+
+        case 'n':
+            n_trains = atoi(optarg);
+            break;
+
+        case 'c':
+            change_ms = atoi(optarg);
+            break;
+
+        case 'o':
+            trace = fopen(optarg, "w");
+            if (trace == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+
+        case 'l':
+            log_file = fopen(optarg, "wb");
+            if (log_file == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+
+        case 's':
+            sweep_ms = atoi(optarg);
+            break;
+
+        case 'e':
+            e_stop_ms = atoi(optarg);
+            break;
+
+        case 'f':
+            functions = true;
+            break;
+
+        case 'b':
+            if (strcmp(optarg, "model") == 0)
+            {
+                backend = &host_model_backend;
+            }
+            else if (strcmp(optarg, "hal") != 0)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (n_trains < 1 || n_trains > DCC_N_TRAINS || change_ms < 1 ||
+        sweep_ms < 0 || (e_stop_ms != 0 && e_stop_ms < 2 * E_STOP_TARGET_MS) ||
+        (trace != NULL && backend == &host_model_backend))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    srand(1);
+
+    systick_init(NULL);
+    log_init(log_file != NULL ? write_log : NULL);
+    PROF_INIT();
+    tap = *backend;
+    tap.reserve = tap_reserve;
+    tap.commit = tap_commit;
+    tap.replace = tap_replace;
+    tap.get_completion = tap_get_completion;
+    dcc_init_backend(&tap);
+
+    for (i = 0; i < n_trains; i++)
+    {
+        dcc_set_speed(train_address(i), 0, true);
+
+        for (j = 0; functions && j < START_FUNCTIONS; j++)
+            flip_function(i);
+    }
+
+    if (sweep_ms > 0)
+        dcc_set_speed_steps(train_address(0), DCC_SPEED_STEPS_128);
+
+    if (host_systick_load == 0 ||
+        (backend == &dcc_hal_backend && !wave_started()))
+    {
+        fprintf(stderr, "The DCC encoder or SysTick wasn't started\n");
+        return 1;
+    }
+
+    end = (uint64_t)(seconds * SystemCoreClock);
+    next_systick = host_systick_load;
+    sync_systick(next_systick);
+
+    if (e_stop_ms > 0)
+        e_stop_press = ms_to_cycles(e_stop_ms) +
+            rand() % ms_to_cycles(e_stop_ms / 2);
+
+    if (backend == &dcc_hal_backend)
+        next_wave = wave_first();
+    else
+        next_wave = host_model_step() * cycles_per_us;
+
+    while (now < end)
+    {
+        if (next_wave <= next_systick)
+        {
+            now = next_wave;
+            sync_systick(next_systick);
+
+            if (backend == &dcc_hal_backend)
+                next_wave = wave_event();
+            else
+            {
+                next_wave = now + host_model_step() * cycles_per_us;
+
+                if (sweep_ms > 0)
+                    sweep_check(host_model_packet, host_model_packet_len);
+            }
+
+            dcc_irqs++;
+        }
+        else
+        {
+            now = next_systick;
+            sync_systick(next_systick);
+
+            /* Taking the interrupt clears its pending bit */
+            SCB->ICSR &= ~SCB_ICSR_PENDSTSET_Msk;
+            SysTick_Handler();
+            systick_irqs++;
+
+            next_systick = now + host_systick_load;
+        }
+
+        main_loop(n_trains, change_ms);
+    }
+
+    if (trace != NULL)
+        fclose(trace);
+
+    if (log_file != NULL)
+        fclose(log_file);
+
+#if PROF_ENABLE
+    prof_dump();
+    printf("\n");
+#endif
+
+    dcc_get_stats(stats);
+    for (i = 0; i < DCC_N_CLASSES; i++)
+    {
+        packets += stats[i].packets;
+        bits += stats[i].bits;
+    }
+
+    backend->get_stats(&wire);
+
+    elapsed = (double)now / SystemCoreClock;
+
+    printf("simulated:       %.3f s, %d trains\n", elapsed, n_trains);
+    printf("backend:         %s\n", backend->name);
+    printf("DCC interrupts:  %llu (%.0f/s)\n",
+           (unsigned long long)dcc_irqs, dcc_irqs / elapsed);
+    printf("SysTicks:        %llu\n", (unsigned long long)systick_irqs);
+    printf("pin changes:     %llu\n", (unsigned long long)transitions);
+    if (update_passes > 0)
+        printf("dcc_update():    %llu passes, mean %.2f us, max %.2f us on "
+               "this host\n", (unsigned long long)update_passes,
+               cycles_to_ns(update_total / update_passes) / 1e3,
+               cycles_to_ns(update_max) / 1e3);
+    printf("packets queued:  %llu (%.1f/s, %.0f bits/s)\n",
+           (unsigned long long)packets, packets / elapsed, bits / elapsed);
+    printf("packets sent:    %u (%.1f/s, %.0f bits/s, %.1f%% idle)\n",
+           wire.packets, wire.packets / elapsed, wire.bits / elapsed,
+           wire.bits ? 100.0 * wire.idle_bits / wire.bits : 0.0);
+
+    /* Idle bits between packets take interrupts too, so this is the cost
+     * of each packet at this load */
+    if (backend == &dcc_hal_backend && wire.packets > 0)
+        printf("irqs/packet:     %.1f\n", (double)dcc_irqs / wire.packets);
+
+    if (log_file != NULL)
+        printf("log records:     %llu\n", (unsigned long long)log_records);
+
+    if (sweep_ms > 0)
+    {
+        dcc_get_stats(stats);
+        printf("throttle sweep:  %llu speeds set, %u updated in the queue\n",
+               (unsigned long long)sweep_sets,
+               stats[DCC_CLASS_SPEED].replaced);
+
+        if (backend == &host_model_backend)
+            printf("stale speeds:    %llu of %llu checked\n",
+                   (unsigned long long)sweep_stale,
+                   (unsigned long long)sweep_checked);
+    }
+
+    if (e_stop_count > 0)
+        printf("e-stop latency:  %u stops, min %llu us, mean %llu us, "
+               "max %llu us\n", e_stop_count,
+               (unsigned long long)(cycles_to_ns(e_stop_min) / 1000),
+               (unsigned long long)(cycles_to_ns(e_stop_total /
+                                                 e_stop_count) / 1000),
+               (unsigned long long)(cycles_to_ns(e_stop_max) / 1000));
+
+    /* Each class's share of the bits on the wire, as idle is above */
+    printf("wire share:     ");
+    for (i = 0; i < DCC_N_CLASSES; i++)
+        printf(" %s %.1f%%%s", class_names[i],
+               wire.bits ? 100.0 * stats[i].bits / wire.bits : 0.0,
+               i < DCC_N_CLASSES - 1 ? "," : "\n");
+
+    for (i = 0; i < DCC_N_CLASSES; i++)
+    {
+        if (stats[i].completed == 0)
+            continue;
+
+        snprintf(label, sizeof(label), "%s wire:", class_names[i]);
+        printf("%-16s %u on the wire, mean %llu us, max %u us\n",
+               label, stats[i].completed,
+               (unsigned long long)(stats[i].latency_total_us /
+                                    stats[i].completed),
+               stats[i].latency_max_us);
+    }
+
+    if (latency_count > 0)
+    {
+        n = latency_count < MAX_LATENCY_SAMPLES ? latency_count :
+            MAX_LATENCY_SAMPLES;
+        qsort(latency_samples, n, sizeof(latency_samples[0]), compare_u64);
+
+        printf("change latency:  %u changes, min %llu us, mean %llu us, "
+               "max %llu us\n", latency_count,
+               (unsigned long long)(cycles_to_ns(latency_min) / 1000),
+               (unsigned long long)(cycles_to_ns(latency_total /
+                                                 latency_count) / 1000),
+               (unsigned long long)(cycles_to_ns(latency_max) / 1000));
+        printf("                 p50 %llu us, p99 %llu us\n",
+               (unsigned long long)latency_percentile(n, 50),
+               (unsigned long long)latency_percentile(n, 99));
+    }
+
+    if (sweep_stale > 0 ||
+        (e_stop_ms > 0 && (e_stop_count == 0 ||
+                           e_stop_max >= ms_to_cycles(E_STOP_TARGET_MS))))
+        return 1;
+
+    return 0;
+}
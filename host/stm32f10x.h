@@ -0,0 +1,424 @@
+/*
+ * Host stand-in for the parts of the STM32F10x headers used by the DCC
+ * sources. Names and types follow the StdPeriph library so the firmware
+ * compiles unchanged. The peripherals are plain structs, updated by the
+ * functions in stm32f10x_host.c.
+ */
+#ifndef _HOST_STM32F10X_H
+#define _HOST_STM32F10X_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, ITStatus;
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+
+extern uint32_t SystemCoreClock;
+
+#define __NOP() do { } while (0)
+
+void __disable_irq(void);
+void __enable_irq(void);
+
+
+/*
+ * Core debug. The cycle counter is read from the host clock, scaled to the
+ * core clock, so profiling reports what the code costs on the host.
+ */
+extern uint32_t host_demcr;
+extern uint32_t host_dwt_ctrl;
+uint32_t host_cyccnt(void);
+
+#define DEMCR      (host_demcr)
+#define DWT_CTRL   (host_dwt_ctrl)
+#define DWT_CYCCNT (host_cyccnt())
+
+
+/*
+ * GPIO
+ */
+typedef struct
+{
+    volatile uint32_t CRL;
+    volatile uint32_t CRH;
+    volatile uint32_t IDR;
+    volatile uint32_t ODR;
+    volatile uint32_t BSRR;
+    volatile uint32_t BRR;
+    volatile uint32_t LCKR;
+} GPIO_TypeDef;
+
+extern GPIO_TypeDef host_gpioa, host_gpiob, host_gpioc;
+#define GPIOA (&host_gpioa)
+#define GPIOB (&host_gpiob)
+#define GPIOC (&host_gpioc)
+
+#define GPIO_Pin_0  ((uint16_t)0x0001)
+#define GPIO_Pin_1  ((uint16_t)0x0002)
+#define GPIO_Pin_2  ((uint16_t)0x0004)
+#define GPIO_Pin_3  ((uint16_t)0x0008)
+#define GPIO_Pin_4  ((uint16_t)0x0010)
+#define GPIO_Pin_5  ((uint16_t)0x0020)
+#define GPIO_Pin_6  ((uint16_t)0x0040)
+#define GPIO_Pin_7  ((uint16_t)0x0080)
+#define GPIO_Pin_8  ((uint16_t)0x0100)
+#define GPIO_Pin_9  ((uint16_t)0x0200)
+#define GPIO_Pin_10 ((uint16_t)0x0400)
+#define GPIO_Pin_11 ((uint16_t)0x0800)
+#define GPIO_Pin_12 ((uint16_t)0x1000)
+#define GPIO_Pin_13 ((uint16_t)0x2000)
+#define GPIO_Pin_14 ((uint16_t)0x4000)
+#define GPIO_Pin_15 ((uint16_t)0x8000)
+
+typedef enum
+{
+    GPIO_Speed_10MHz = 1,
+    GPIO_Speed_2MHz,
+    GPIO_Speed_50MHz
+} GPIOSpeed_TypeDef;
+
+typedef enum
+{
+    GPIO_Mode_AIN = 0x0,
+    GPIO_Mode_IN_FLOATING = 0x04,
+    GPIO_Mode_IPD = 0x28,
+    GPIO_Mode_IPU = 0x48,
+    GPIO_Mode_Out_OD = 0x14,
+    GPIO_Mode_Out_PP = 0x10,
+    GPIO_Mode_AF_OD = 0x1C,
+    GPIO_Mode_AF_PP = 0x18
+} GPIOMode_TypeDef;
+
+typedef struct
+{
+    uint16_t GPIO_Pin;
+    GPIOSpeed_TypeDef GPIO_Speed;
+    GPIOMode_TypeDef GPIO_Mode;
+} GPIO_InitTypeDef;
+
+typedef enum
+{
+    Bit_RESET = 0,
+    Bit_SET
+} BitAction;
+
+void GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_InitStruct);
+void GPIO_SetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+void GPIO_ResetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin);
+void GPIO_WriteBit(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, BitAction BitVal);
+void GPIO_Write(GPIO_TypeDef *GPIOx, uint16_t PortVal);
+uint16_t GPIO_ReadInputData(GPIO_TypeDef *GPIOx);
+
+#define GPIO_Remap_SPI1        ((uint32_t)0x00000001)
+#define GPIO_PartialRemap_TIM1 ((uint32_t)0x00160040)
+
+void GPIO_PinRemapConfig(uint32_t GPIO_Remap, FunctionalState NewState);
+
+
+/*
+ * RCC
+ */
+#define RCC_HCLK_Div1 ((uint32_t)0x00000000)
+#define RCC_HCLK_Div2 ((uint32_t)0x00000400)
+#define RCC_HCLK_Div4 ((uint32_t)0x00000500)
+
+#define RCC_APB2Periph_AFIO  ((uint32_t)0x00000001)
+#define RCC_APB2Periph_GPIOA ((uint32_t)0x00000004)
+#define RCC_APB2Periph_GPIOB ((uint32_t)0x00000008)
+#define RCC_APB2Periph_GPIOC ((uint32_t)0x00000010)
+#define RCC_APB2Periph_TIM1  ((uint32_t)0x00000800)
+#define RCC_APB2Periph_SPI1  ((uint32_t)0x00001000)
+#define RCC_APB1Periph_TIM2  ((uint32_t)0x00000001)
+#define RCC_APB1Periph_TIM3  ((uint32_t)0x00000002)
+#define RCC_AHBPeriph_DMA1   ((uint32_t)0x00000001)
+
+void RCC_PCLK1Config(uint32_t RCC_HCLK);
+void RCC_AHBPeriphClockCmd(uint32_t RCC_AHBPeriph, FunctionalState NewState);
+void RCC_APB1PeriphClockCmd(uint32_t RCC_APB1Periph, FunctionalState NewState);
+void RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState);
+
+
+/*
+ * Timers
+ */
+typedef struct
+{
+    volatile uint16_t CR1;
+    volatile uint16_t CR2;
+    volatile uint16_t SMCR;
+    volatile uint16_t DIER;
+    volatile uint16_t SR;
+    volatile uint16_t EGR;
+    volatile uint16_t CCMR1;
+    volatile uint16_t CCMR2;
+    volatile uint16_t CCER;
+    volatile uint16_t CNT;
+    volatile uint16_t PSC;
+    volatile uint16_t ARR;
+    volatile uint16_t RCR;
+    volatile uint16_t CCR1;
+    volatile uint16_t CCR2;
+    volatile uint16_t CCR3;
+    volatile uint16_t CCR4;
+    volatile uint16_t BDTR;
+    volatile uint16_t DCR;
+    volatile uint16_t DMAR;
+} TIM_TypeDef;
+
+extern TIM_TypeDef host_tim1, host_tim2, host_tim3;
+#define TIM1 (&host_tim1)
+#define TIM2 (&host_tim2)
+#define TIM3 (&host_tim3)
+
+#define TIM_CR1_CEN     ((uint16_t)0x0001)
+#define TIM_CR1_ARPE    ((uint16_t)0x0080)
+#define TIM_CCMR2_OC3M  ((uint16_t)0x0070)
+#define TIM_CCMR2_OC3PE ((uint16_t)0x0008)
+#define TIM_CCER_CC3E   ((uint16_t)0x0100)
+#define TIM_CCER_CC3NE  ((uint16_t)0x0400)
+#define TIM_BDTR_DTG    ((uint16_t)0x00FF)
+#define TIM_BDTR_MOE    ((uint16_t)0x8000)
+
+typedef struct
+{
+    uint16_t TIM_Prescaler;
+    uint16_t TIM_CounterMode;
+    uint16_t TIM_Period;
+    uint16_t TIM_ClockDivision;
+    uint8_t TIM_RepetitionCounter;
+} TIM_TimeBaseInitTypeDef;
+
+#define TIM_CounterMode_Up ((uint16_t)0x0000)
+#define TIM_IT_Update      ((uint16_t)0x0001)
+
+/* DMA requests, as in DIER */
+#define TIM_DMA_Update ((uint16_t)0x0100)
+#define TIM_DMA_CC1    ((uint16_t)0x0200)
+#define TIM_DMA_CC3    ((uint16_t)0x0800)
+
+typedef struct
+{
+    uint16_t TIM_OCMode;
+    uint16_t TIM_OutputState;
+    uint16_t TIM_OutputNState;
+    uint16_t TIM_Pulse;
+    uint16_t TIM_OCPolarity;
+    uint16_t TIM_OCNPolarity;
+    uint16_t TIM_OCIdleState;
+    uint16_t TIM_OCNIdleState;
+} TIM_OCInitTypeDef;
+
+#define TIM_OCMode_Timing        ((uint16_t)0x0000)
+#define TIM_OCMode_PWM1          ((uint16_t)0x0060)
+#define TIM_OutputState_Disable  ((uint16_t)0x0000)
+#define TIM_OutputState_Enable   ((uint16_t)0x0001)
+#define TIM_OutputNState_Disable ((uint16_t)0x0000)
+#define TIM_OutputNState_Enable  ((uint16_t)0x0004)
+#define TIM_OCPolarity_High      ((uint16_t)0x0000)
+#define TIM_OCNPolarity_High     ((uint16_t)0x0000)
+#define TIM_OCIdleState_Reset    ((uint16_t)0x0000)
+#define TIM_OCNIdleState_Reset   ((uint16_t)0x0000)
+#define TIM_OCPreload_Enable     ((uint16_t)0x0008)
+
+typedef struct
+{
+    uint16_t TIM_OSSRState;
+    uint16_t TIM_OSSIState;
+    uint16_t TIM_LOCKLevel;
+    uint16_t TIM_DeadTime;
+    uint16_t TIM_Break;
+    uint16_t TIM_BreakPolarity;
+    uint16_t TIM_AutomaticOutput;
+} TIM_BDTRInitTypeDef;
+
+#define TIM_OSSRState_Enable        ((uint16_t)0x0800)
+#define TIM_OSSIState_Enable        ((uint16_t)0x0400)
+#define TIM_LOCKLevel_OFF           ((uint16_t)0x0000)
+#define TIM_Break_Disable           ((uint16_t)0x0000)
+#define TIM_BreakPolarity_High      ((uint16_t)0x2000)
+#define TIM_AutomaticOutput_Disable ((uint16_t)0x0000)
+
+void TIM_TimeBaseInit(TIM_TypeDef *TIMx,
+                      TIM_TimeBaseInitTypeDef *TIM_TimeBaseInitStruct);
+void TIM_ITConfig(TIM_TypeDef *TIMx, uint16_t TIM_IT,
+                  FunctionalState NewState);
+void TIM_Cmd(TIM_TypeDef *TIMx, FunctionalState NewState);
+void TIM_ClearITPendingBit(TIM_TypeDef *TIMx, uint16_t TIM_IT);
+ITStatus TIM_GetITStatus(TIM_TypeDef *TIMx, uint16_t TIM_IT);
+void TIM_SetAutoreload(TIM_TypeDef *TIMx, uint16_t Autoreload);
+uint16_t TIM_GetCounter(TIM_TypeDef *TIMx);
+void TIM_ARRPreloadConfig(TIM_TypeDef *TIMx, FunctionalState NewState);
+void TIM_OC1Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct);
+void TIM_OC3Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct);
+void TIM_DMACmd(TIM_TypeDef *TIMx, uint16_t TIM_DMASource,
+                FunctionalState NewState);
+void TIM_SetCompare3(TIM_TypeDef *TIMx, uint16_t Compare3);
+void TIM_OC3PreloadConfig(TIM_TypeDef *TIMx, uint16_t TIM_OCPreload);
+void TIM_BDTRConfig(TIM_TypeDef *TIMx, TIM_BDTRInitTypeDef *TIM_BDTRInitStruct);
+void TIM_CtrlPWMOutputs(TIM_TypeDef *TIMx, FunctionalState NewState);
+
+
+/*
+ * DMA. The address registers are wide enough for a host pointer.
+ */
+typedef struct
+{
+    volatile uint32_t CCR;
+    volatile uint32_t CNDTR;
+    volatile uintptr_t CPAR;
+    volatile uintptr_t CMAR;
+} DMA_Channel_TypeDef;
+
+extern DMA_Channel_TypeDef host_dma1_channel2, host_dma1_channel3,
+    host_dma1_channel6;
+#define DMA1_Channel2 (&host_dma1_channel2)
+#define DMA1_Channel3 (&host_dma1_channel3)
+#define DMA1_Channel6 (&host_dma1_channel6)
+
+/* Interrupt flags of DMA1, as in its ISR register */
+extern uint32_t host_dma1_isr;
+
+typedef struct
+{
+    uintptr_t DMA_PeripheralBaseAddr;
+    uintptr_t DMA_MemoryBaseAddr;
+    uint32_t DMA_DIR;
+    uint32_t DMA_BufferSize;
+    uint32_t DMA_PeripheralInc;
+    uint32_t DMA_MemoryInc;
+    uint32_t DMA_PeripheralDataSize;
+    uint32_t DMA_MemoryDataSize;
+    uint32_t DMA_Mode;
+    uint32_t DMA_Priority;
+    uint32_t DMA_M2M;
+} DMA_InitTypeDef;
+
+#define DMA_CCR_EN   ((uint32_t)0x00000001)
+
+#define DMA_DIR_PeripheralDST           ((uint32_t)0x00000010)
+#define DMA_PeripheralInc_Disable       ((uint32_t)0x00000000)
+#define DMA_MemoryInc_Enable            ((uint32_t)0x00000080)
+#define DMA_MemoryInc_Disable           ((uint32_t)0x00000000)
+#define DMA_PeripheralDataSize_Byte     ((uint32_t)0x00000000)
+#define DMA_PeripheralDataSize_HalfWord ((uint32_t)0x00000100)
+#define DMA_PeripheralDataSize_Word     ((uint32_t)0x00000200)
+#define DMA_MemoryDataSize_Byte         ((uint32_t)0x00000000)
+#define DMA_MemoryDataSize_HalfWord     ((uint32_t)0x00000400)
+#define DMA_MemoryDataSize_Word         ((uint32_t)0x00000800)
+#define DMA_Mode_Circular               ((uint32_t)0x00000020)
+#define DMA_Priority_VeryHigh           ((uint32_t)0x00003000)
+#define DMA_M2M_Disable                 ((uint32_t)0x00000000)
+
+#define DMA_IT_TC    ((uint32_t)0x00000002)
+#define DMA_IT_HT    ((uint32_t)0x00000004)
+#define DMA1_IT_GL3  ((uint32_t)0x00000100)
+#define DMA1_IT_TC3  ((uint32_t)0x00000200)
+#define DMA1_IT_HT3  ((uint32_t)0x00000400)
+
+void DMA_DeInit(DMA_Channel_TypeDef *DMAy_Channelx);
+void DMA_Init(DMA_Channel_TypeDef *DMAy_Channelx,
+              DMA_InitTypeDef *DMA_InitStruct);
+void DMA_Cmd(DMA_Channel_TypeDef *DMAy_Channelx, FunctionalState NewState);
+void DMA_ITConfig(DMA_Channel_TypeDef *DMAy_Channelx, uint32_t DMA_IT,
+                  FunctionalState NewState);
+ITStatus DMA_GetITStatus(uint32_t DMAy_IT);
+void DMA_ClearITPendingBit(uint32_t DMAy_IT);
+
+
+/*
+ * SPI
+ */
+typedef struct
+{
+    volatile uint16_t CR1;
+    volatile uint16_t CR2;
+    volatile uint16_t SR;
+    volatile uint16_t DR;
+} SPI_TypeDef;
+
+extern SPI_TypeDef host_spi1;
+#define SPI1 (&host_spi1)
+
+#define SPI_CR1_SPE     ((uint16_t)0x0040)
+#define SPI_CR1_BR      ((uint16_t)0x0038)
+#define SPI_CR2_TXDMAEN ((uint16_t)0x0002)
+
+typedef struct
+{
+    uint16_t SPI_Direction;
+    uint16_t SPI_Mode;
+    uint16_t SPI_DataSize;
+    uint16_t SPI_CPOL;
+    uint16_t SPI_CPHA;
+    uint16_t SPI_NSS;
+    uint16_t SPI_BaudRatePrescaler;
+    uint16_t SPI_FirstBit;
+    uint16_t SPI_CRCPolynomial;
+} SPI_InitTypeDef;
+
+#define SPI_Direction_1Line_Tx    ((uint16_t)0xC000)
+#define SPI_Mode_Master           ((uint16_t)0x0104)
+#define SPI_DataSize_8b           ((uint16_t)0x0000)
+#define SPI_CPOL_Low              ((uint16_t)0x0000)
+#define SPI_CPHA_1Edge            ((uint16_t)0x0000)
+#define SPI_NSS_Soft              ((uint16_t)0x0200)
+#define SPI_BaudRatePrescaler_256 ((uint16_t)0x0038)
+#define SPI_FirstBit_MSB          ((uint16_t)0x0000)
+#define SPI_NSSInternalSoft_Set   ((uint16_t)0x0100)
+#define SPI_I2S_DMAReq_Tx         ((uint16_t)0x0002)
+
+void SPI_Init(SPI_TypeDef *SPIx, SPI_InitTypeDef *SPI_InitStruct);
+void SPI_NSSInternalSoftwareConfig(SPI_TypeDef *SPIx,
+                                   uint16_t SPI_NSSInternalSoft);
+void SPI_I2S_DMACmd(SPI_TypeDef *SPIx, uint16_t SPI_I2S_DMAReq,
+                    FunctionalState NewState);
+void SPI_Cmd(SPI_TypeDef *SPIx, FunctionalState NewState);
+
+
+/*
+ * NVIC and SysTick
+ */
+typedef enum
+{
+    DMA1_Channel3_IRQn = 13,
+    TIM1_UP_IRQn = 25,
+    TIM2_IRQn = 28,
+} IRQn_Type;
+
+typedef struct
+{
+    uint8_t NVIC_IRQChannel;
+    uint8_t NVIC_IRQChannelPreemptionPriority;
+    uint8_t NVIC_IRQChannelSubPriority;
+    FunctionalState NVIC_IRQChannelCmd;
+} NVIC_InitTypeDef;
+
+void NVIC_Init(NVIC_InitTypeDef *NVIC_InitStruct);
+
+/* The simulator sets VAL and the SysTick pending bit from its clock before
+ * it runs any firmware code */
+typedef struct
+{
+    volatile uint32_t CTRL;
+    volatile uint32_t LOAD;
+    volatile uint32_t VAL;
+    volatile uint32_t CALIB;
+} SysTick_Type;
+
+typedef struct
+{
+    volatile uint32_t ICSR;
+} SCB_Type;
+
+extern SysTick_Type host_systick;
+extern SCB_Type host_scb;
+#define SysTick (&host_systick)
+#define SCB     (&host_scb)
+
+#define SCB_ICSR_PENDSTSET_Msk (1UL << 26)
+
+uint32_t SysTick_Config(uint32_t ticks);
+
+
+#endif /* _HOST_STM32F10X_H */
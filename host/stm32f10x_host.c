@@ -0,0 +1,396 @@
+/*
+ * Host stand-ins for the StdPeriph functions used by the DCC sources. They
+ * only keep the register state the simulator needs.
+ */
+#include <time.h>
+
+#include "stm32f10x.h"
+
+#include "host.h"
+
+
+uint32_t SystemCoreClock = 72000000;
+
+GPIO_TypeDef host_gpioa, host_gpiob, host_gpioc;
+TIM_TypeDef host_tim1, host_tim2, host_tim3;
+DMA_Channel_TypeDef host_dma1_channel2, host_dma1_channel3, host_dma1_channel6;
+uint32_t host_dma1_isr;
+SPI_TypeDef host_spi1;
+
+uint32_t host_systick_load;
+SysTick_Type host_systick;
+SCB_Type host_scb;
+bool host_irq_enabled[HOST_N_IRQS];
+
+uint32_t host_demcr;
+uint32_t host_dwt_ctrl;
+
+
+void
+__disable_irq(void)
+{
+}
+
+
+void
+__enable_irq(void)
+{
+}
+
+
+/*
+ * Core debug
+ */
+uint32_t
+host_cyccnt(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint32_t)(((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) *
+                      (SystemCoreClock / 1000000) / 1000);
+}
+
+
+/*
+ * GPIO
+ */
+void
+GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_InitStruct)
+{
+}
+
+
+void
+GPIO_SetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    GPIOx->ODR |= GPIO_Pin;
+    host_gpio_written(GPIOx);
+}
+
+
+void
+GPIO_ResetBits(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin)
+{
+    GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+    host_gpio_written(GPIOx);
+}
+
+
+void
+GPIO_WriteBit(GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, BitAction BitVal)
+{
+    if (BitVal != Bit_RESET)
+        GPIO_SetBits(GPIOx, GPIO_Pin);
+    else
+        GPIO_ResetBits(GPIOx, GPIO_Pin);
+}
+
+
+void
+GPIO_Write(GPIO_TypeDef *GPIOx, uint16_t PortVal)
+{
+    GPIOx->ODR = PortVal;
+    host_gpio_written(GPIOx);
+}
+
+
+uint16_t
+GPIO_ReadInputData(GPIO_TypeDef *GPIOx)
+{
+    return (uint16_t)GPIOx->IDR;
+}
+
+
+void
+GPIO_PinRemapConfig(uint32_t GPIO_Remap, FunctionalState NewState)
+{
+}
+
+
+/*
+ * RCC
+ */
+void
+RCC_PCLK1Config(uint32_t RCC_HCLK)
+{
+}
+
+
+void
+RCC_AHBPeriphClockCmd(uint32_t RCC_AHBPeriph, FunctionalState NewState)
+{
+}
+
+
+void
+RCC_APB1PeriphClockCmd(uint32_t RCC_APB1Periph, FunctionalState NewState)
+{
+}
+
+
+void
+RCC_APB2PeriphClockCmd(uint32_t RCC_APB2Periph, FunctionalState NewState)
+{
+}
+
+
+/*
+ * Timers
+ */
+void
+TIM_TimeBaseInit(TIM_TypeDef *TIMx,
+                 TIM_TimeBaseInitTypeDef *TIM_TimeBaseInitStruct)
+{
+    TIMx->ARR = TIM_TimeBaseInitStruct->TIM_Period;
+    TIMx->PSC = TIM_TimeBaseInitStruct->TIM_Prescaler;
+    TIMx->CNT = 0;
+}
+
+
+void
+TIM_ITConfig(TIM_TypeDef *TIMx, uint16_t TIM_IT, FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        TIMx->DIER |= TIM_IT;
+    else
+        TIMx->DIER &= ~TIM_IT;
+}
+
+
+void
+TIM_Cmd(TIM_TypeDef *TIMx, FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        TIMx->CR1 |= TIM_CR1_CEN;
+    else
+        TIMx->CR1 &= ~TIM_CR1_CEN;
+}
+
+
+void
+TIM_ClearITPendingBit(TIM_TypeDef *TIMx, uint16_t TIM_IT)
+{
+    TIMx->SR &= ~TIM_IT;
+}
+
+
+ITStatus
+TIM_GetITStatus(TIM_TypeDef *TIMx, uint16_t TIM_IT)
+{
+    return (TIMx->SR & TIM_IT) && (TIMx->DIER & TIM_IT) ? SET : RESET;
+}
+
+
+void
+TIM_SetAutoreload(TIM_TypeDef *TIMx, uint16_t Autoreload)
+{
+    TIMx->ARR = Autoreload;
+}
+
+
+uint16_t
+TIM_GetCounter(TIM_TypeDef *TIMx)
+{
+    return TIMx->CNT;
+}
+
+
+void
+TIM_ARRPreloadConfig(TIM_TypeDef *TIMx, FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        TIMx->CR1 |= TIM_CR1_ARPE;
+    else
+        TIMx->CR1 &= ~TIM_CR1_ARPE;
+}
+
+
+void
+TIM_OC1Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct)
+{
+    TIMx->CCR1 = TIM_OCInitStruct->TIM_Pulse;
+}
+
+
+void
+TIM_OC3Init(TIM_TypeDef *TIMx, TIM_OCInitTypeDef *TIM_OCInitStruct)
+{
+    TIMx->CCMR2 = (TIMx->CCMR2 & ~TIM_CCMR2_OC3M) |
+        TIM_OCInitStruct->TIM_OCMode;
+    TIMx->CCER = (TIMx->CCER & ~(TIM_CCER_CC3E | TIM_CCER_CC3NE)) |
+        (TIM_OCInitStruct->TIM_OutputState << 8) |
+        (TIM_OCInitStruct->TIM_OutputNState << 8);
+    TIMx->CCR3 = TIM_OCInitStruct->TIM_Pulse;
+}
+
+
+void
+TIM_DMACmd(TIM_TypeDef *TIMx, uint16_t TIM_DMASource, FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        TIMx->DIER |= TIM_DMASource;
+    else
+        TIMx->DIER &= ~TIM_DMASource;
+}
+
+
+void
+TIM_SetCompare3(TIM_TypeDef *TIMx, uint16_t Compare3)
+{
+    TIMx->CCR3 = Compare3;
+}
+
+
+void
+TIM_OC3PreloadConfig(TIM_TypeDef *TIMx, uint16_t TIM_OCPreload)
+{
+    TIMx->CCMR2 = (TIMx->CCMR2 & ~TIM_CCMR2_OC3PE) | TIM_OCPreload;
+}
+
+
+void
+TIM_BDTRConfig(TIM_TypeDef *TIMx, TIM_BDTRInitTypeDef *TIM_BDTRInitStruct)
+{
+    TIMx->BDTR = TIM_BDTRInitStruct->TIM_OSSRState |
+        TIM_BDTRInitStruct->TIM_OSSIState | TIM_BDTRInitStruct->TIM_LOCKLevel |
+        TIM_BDTRInitStruct->TIM_DeadTime | TIM_BDTRInitStruct->TIM_Break |
+        TIM_BDTRInitStruct->TIM_BreakPolarity |
+        TIM_BDTRInitStruct->TIM_AutomaticOutput;
+}
+
+
+void
+TIM_CtrlPWMOutputs(TIM_TypeDef *TIMx, FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        TIMx->BDTR |= TIM_BDTR_MOE;
+    else
+        TIMx->BDTR &= ~TIM_BDTR_MOE;
+}
+
+
+/*
+ * DMA
+ */
+void
+DMA_DeInit(DMA_Channel_TypeDef *DMAy_Channelx)
+{
+    DMAy_Channelx->CCR = 0;
+    DMAy_Channelx->CNDTR = 0;
+    DMAy_Channelx->CPAR = 0;
+    DMAy_Channelx->CMAR = 0;
+}
+
+
+void
+DMA_Init(DMA_Channel_TypeDef *DMAy_Channelx, DMA_InitTypeDef *DMA_InitStruct)
+{
+    DMAy_Channelx->CCR = DMA_InitStruct->DMA_DIR | DMA_InitStruct->DMA_Mode |
+        DMA_InitStruct->DMA_PeripheralInc | DMA_InitStruct->DMA_MemoryInc |
+        DMA_InitStruct->DMA_PeripheralDataSize |
+        DMA_InitStruct->DMA_MemoryDataSize | DMA_InitStruct->DMA_Priority |
+        DMA_InitStruct->DMA_M2M;
+    DMAy_Channelx->CNDTR = DMA_InitStruct->DMA_BufferSize;
+    DMAy_Channelx->CPAR = DMA_InitStruct->DMA_PeripheralBaseAddr;
+    DMAy_Channelx->CMAR = DMA_InitStruct->DMA_MemoryBaseAddr;
+}
+
+
+void
+DMA_Cmd(DMA_Channel_TypeDef *DMAy_Channelx, FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        DMAy_Channelx->CCR |= DMA_CCR_EN;
+    else
+        DMAy_Channelx->CCR &= ~DMA_CCR_EN;
+}
+
+
+void
+DMA_ITConfig(DMA_Channel_TypeDef *DMAy_Channelx, uint32_t DMA_IT,
+             FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        DMAy_Channelx->CCR |= DMA_IT;
+    else
+        DMAy_Channelx->CCR &= ~DMA_IT;
+}
+
+
+ITStatus
+DMA_GetITStatus(uint32_t DMAy_IT)
+{
+    return (host_dma1_isr & DMAy_IT) ? SET : RESET;
+}
+
+
+void
+DMA_ClearITPendingBit(uint32_t DMAy_IT)
+{
+    host_dma1_isr &= ~DMAy_IT;
+}
+
+
+/*
+ * SPI
+ */
+void
+SPI_Init(SPI_TypeDef *SPIx, SPI_InitTypeDef *SPI_InitStruct)
+{
+    SPIx->CR1 = SPI_InitStruct->SPI_Direction | SPI_InitStruct->SPI_Mode |
+        SPI_InitStruct->SPI_DataSize | SPI_InitStruct->SPI_CPOL |
+        SPI_InitStruct->SPI_CPHA | SPI_InitStruct->SPI_NSS |
+        SPI_InitStruct->SPI_BaudRatePrescaler | SPI_InitStruct->SPI_FirstBit;
+}
+
+
+void
+SPI_NSSInternalSoftwareConfig(SPI_TypeDef *SPIx, uint16_t SPI_NSSInternalSoft)
+{
+    SPIx->CR1 |= SPI_NSSInternalSoft;
+}
+
+
+void
+SPI_I2S_DMACmd(SPI_TypeDef *SPIx, uint16_t SPI_I2S_DMAReq,
+               FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        SPIx->CR2 |= SPI_I2S_DMAReq;
+    else
+        SPIx->CR2 &= ~SPI_I2S_DMAReq;
+}
+
+
+void
+SPI_Cmd(SPI_TypeDef *SPIx, FunctionalState NewState)
+{
+    if (NewState != DISABLE)
+        SPIx->CR1 |= SPI_CR1_SPE;
+    else
+        SPIx->CR1 &= ~SPI_CR1_SPE;
+}
+
+
+/*
+ * NVIC and SysTick
+ */
+void
+NVIC_Init(NVIC_InitTypeDef *NVIC_InitStruct)
+{
+    if (NVIC_InitStruct->NVIC_IRQChannel < HOST_N_IRQS)
+        host_irq_enabled[NVIC_InitStruct->NVIC_IRQChannel] =
+            NVIC_InitStruct->NVIC_IRQChannelCmd != DISABLE;
+}
+
+
+uint32_t
+SysTick_Config(uint32_t ticks)
+{
+    host_systick_load = ticks;
+    SysTick->LOAD = ticks - 1;
+    SysTick->VAL = 0;
+    return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Train table benchmark
+ *
+ * Times find_train() looking trains up by address as the table fills, for
+ * addresses that are in it and ones that aren't, against a plain scan of
+ * the table. The probe sequences in the open addressed index are measured
+ * alongside. Then the memory the table and its index take per train is
+ * shown. The sizes are for the host: size_t is twice as wide here as on the
+ * Cortex-M3.
+ *
+ * dcc.c is built into this program, so its static lookup can be timed
+ * directly.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dcc.c"
+
+
+#define LOOKUPS (4000000)
+
+
+/* Trains in the table for each run */
+static const int sizes[] = { 1, 10, 50, 100, DCC_N_TRAINS };
+
+#define N_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+
+static uint16_t present[DCC_N_TRAINS];
+static uint16_t absent[DCC_N_TRAINS];
+
+/* Keeps the compiler from dropping the lookups */
+static volatile uintptr_t sink;
+
+
+/* The GPIO stand-ins report writes, but nothing is traced here */
+void
+host_gpio_written(GPIO_TypeDef *gpio)
+{
+}
+
+
+static double
+now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+/* Number of index entries looked at to find an address, or to find it
+ * isn't there */
+static int
+probes(uint16_t address)
+{
+    uint16_t i = hash_address(address);
+    int n = 1;
+
+    while (train_index[i] != 0 &&
+           trains[train_index[i] - 1].address != address)
+    {
+        i = (i + 1) & (INDEX_SIZE - 1);
+        n++;
+    }
+
+    return n;
+}
+
+
+/* Look up by searching the table in order, as without the index */
+static dcc_train_t *
+scan_train(uint16_t address)
+{
+    int i;
+
+    for (i = 0; i < n_trains; i++)
+    {
+        if (trains[i].address == address)
+            return &trains[i];
+    }
+
+    return NULL;
+}
+
+
+/* Empty the table, then fill it with n trains at random addresses. As many
+ * other addresses are kept to miss with. */
+static void
+fill(int n)
+{
+    uint16_t address;
+    int i;
+
+    memset(train_index, 0, sizeof(train_index));
+    n_trains = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        do
+        {
+            address = 1 + rand() % DCC_MAX_ADDRESS;
+        } while (find_train(address, false) != NULL);
+
+        present[i] = address;
+        find_train(address, true);
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        do
+        {
+            address = 1 + rand() % DCC_MAX_ADDRESS;
+        } while (find_train(address, false) != NULL);
+
+        absent[i] = address;
+    }
+}
+
+
+/* Returns the mean time per lookup in ns */
+static double
+time_lookup(dcc_train_t *(*lookup)(uint16_t), const uint16_t *addresses,
+            int n)
+{
+    double start = now_ns();
+    int i;
+
+    for (i = 0; i < LOOKUPS; i++)
+        sink += (uintptr_t)lookup(addresses[i % n]);
+
+    return (now_ns() - start) / LOOKUPS;
+}
+
+
+static dcc_train_t *
+find_only(uint16_t address)
+{
+    return find_train(address, false);
+}
+
+
+static void
+probe_stats(const uint16_t *addresses, int n, double *mean, int *max)
+{
+    int i, p, total = 0;
+
+    *max = 0;
+    for (i = 0; i < n; i++)
+    {
+        p = probes(addresses[i]);
+        total += p;
+        if (p > *max)
+            *max = p;
+    }
+
+    *mean = (double)total / n;
+}
+
+
+static void
+bench(int n)
+{
+    double hit_probes, miss_probes;
+    int hit_max, miss_max;
+
+    fill(n);
+    probe_stats(present, n, &hit_probes, &hit_max);
+    probe_stats(absent, n, &miss_probes, &miss_max);
+
+    printf("%3d trains: hit %5.1f ns (%.2f probes, max %d), "
+           "miss %5.1f ns (%.2f probes, max %d), scan %6.1f ns\n",
+           n, time_lookup(find_only, present, n), hit_probes, hit_max,
+           time_lookup(find_only, absent, n), miss_probes, miss_max,
+           time_lookup(scan_train, present, n));
+}
+
+
+int
+main(void)
+{
+    size_t i;
+
+    srand(1);
+
+    printf("%d lookups, %d entry index\n", LOOKUPS, INDEX_SIZE);
+    for (i = 0; i < N_SIZES; i++)
+        bench(sizes[i]);
+
+    printf("memory: %zu bytes per train, %zu bytes of index (%zu per train), "
+           "%zu bytes for %d trains\n", sizeof(dcc_train_t),
+           sizeof(train_index), sizeof(train_index) / DCC_N_TRAINS,
+           sizeof(trains) + sizeof(train_index), DCC_N_TRAINS);
+
+    return 0;
+}
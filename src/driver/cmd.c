@@ -0,0 +1,357 @@
+#include "cmd.h"
+
+#include <string.h>
+
+#include "dcc.h"
+#include "log.h"
+
+
+/* CRC-16/CCITT-FALSE a nibble at a time */
+static const uint16_t crc_table[16] =
+{
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef
+};
+
+
+/* Bytes of arguments after each opcode, or 0 for opcodes that don't
+ * exist. CMD_SPEED has a count, then that many trains of SPEED_ENTRY
+ * bytes. */
+#define N_OPCODES (CMD_E_STOP + 1)
+static const uint8_t arg_len[N_OPCODES] =
+{
+    [CMD_SPEED] = 1,
+    [CMD_FUNCTION] = 4,
+    [CMD_ACCESSORY] = 4,
+    [CMD_E_STOP] = 1,
+};
+
+#define SPEED_ENTRY (4)
+
+
+/**
+ * Reads a frame a byte at a time, undoing the COBS encoding as it goes, so
+ * it's only decoded into the commands. Pos and end are offsets into the
+ * frame. Run is the number of bytes left in the current COBS block, and
+ * zero is set if a zero follows the block. Left limits how many decoded
+ * bytes are read.
+ */
+typedef struct
+{
+    const uint8_t *data;
+    size_t pos;
+    size_t end;
+    uint8_t run;
+    bool zero;
+    size_t left;
+    bool error;
+} cmd_reader_t;
+
+
+/* Where the search for the end of the next frame carries on from, as an
+ * offset from the tail of the ring when it was last seen. If anything else
+ * consumes from the ring, e.g. the UART dropping bytes it had no room for,
+ * the offset is stale and the search starts again. */
+static size_t scanned = 0;
+static size_t scanned_tail = 0;
+
+
+/* The frame being run, copied out of the ring. The UART's DMA writes into
+ * the ring whatever the reader is doing, so the frame is read once, then
+ * checked and carried out from here. */
+static uint8_t frame[CMD_MAX_FRAME];
+
+static cmd_stats_t stats;
+
+
+static uint16_t
+crc_byte(uint16_t crc, uint8_t byte)
+{
+    crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (byte >> 4)];
+    crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (byte & 0x0f)];
+
+    return crc;
+}
+
+
+uint16_t
+cmd_crc16(uint16_t crc, const uint8_t *data, size_t len)
+{
+    while (len-- > 0)
+        crc = crc_byte(crc, *data++);
+
+    return crc;
+}
+
+
+static void
+reader_start(cmd_reader_t *r, size_t end, size_t left)
+{
+    r->data = frame;
+    r->pos = 0;
+    r->end = end;
+    r->run = 0;
+    r->zero = false;
+    r->left = left;
+    r->error = false;
+}
+
+
+/* Decode the next byte of the frame. Returns false at the end, or if the
+ * frame is malformed, when error is set too. */
+static bool
+read_byte(cmd_reader_t *r, uint8_t *byte)
+{
+    uint8_t code;
+
+    if (r->left == 0)
+        return false;
+
+    while (r->run == 0)
+    {
+        /* The zero after the last block is only the end of the frame */
+        if (r->pos == r->end)
+            return false;
+
+        if (r->zero)
+        {
+            r->zero = false;
+            r->left--;
+            *byte = 0;
+            return true;
+        }
+
+        code = r->data[r->pos++];
+        r->run = code - 1;
+        r->zero = code != 0xff;
+
+        if (r->pos + r->run > r->end)
+        {
+            r->error = true;
+            return false;
+        }
+    }
+
+    r->run--;
+    r->left--;
+    *byte = r->data[r->pos++];
+
+    return true;
+}
+
+
+static bool
+read_bytes(cmd_reader_t *r, uint8_t *buf, uint8_t len)
+{
+    while (len-- > 0)
+    {
+        if (!read_byte(r, buf++))
+            return false;
+    }
+
+    return true;
+}
+
+
+#define ADDRESS(b) ((uint16_t)((b)[0] | (b)[1] << 8))
+
+
+/* Go through the commands in a frame, carrying them out if apply is set or
+ * only checking them if not. Returns the number of commands, or -1 if one
+ * is malformed. */
+static int
+run_commands(cmd_reader_t *r, bool apply)
+{
+    uint8_t op, args[SPEED_ENTRY];
+    uint8_t count;
+    int n = 0;
+
+    while (read_byte(r, &op))
+    {
+        if (op >= N_OPCODES || arg_len[op] == 0 ||
+            !read_bytes(r, args, arg_len[op]))
+            return -1;
+
+        if (op == CMD_SPEED)
+        {
+            /* Each train in the batch is a command of its own */
+            for (count = args[0]; count > 0; count--)
+            {
+                if (!read_bytes(r, args, SPEED_ENTRY))
+                    return -1;
+
+                if (apply)
+                {
+                    dcc_set_speed_steps(ADDRESS(args),
+                                        (args[3] & CMD_SPEED_128) ?
+                                        DCC_SPEED_STEPS_128 :
+                                        DCC_SPEED_STEPS_28);
+                    dcc_set_speed(ADDRESS(args), args[2],
+                                  (args[3] & CMD_SPEED_FORWARD) != 0);
+                }
+
+                n++;
+            }
+
+            continue;
+        }
+
+        if (apply)
+        {
+            switch (op)
+            {
+            case CMD_FUNCTION:
+                dcc_set_function(ADDRESS(args), args[2], args[3] != 0);
+                break;
+
+            case CMD_ACCESSORY:
+                dcc_set_accessory(ADDRESS(args), args[2], args[3] != 0);
+                break;
+
+            default:
+                dcc_e_stop(args[0] != 0);
+                break;
+            }
+        }
+
+        n++;
+    }
+
+    return r->error ? -1 : n;
+}
+
+
+/* Copy the frame at the front of the ring out of it, len bytes long
+ * without its zero. Returns false if the ring has been written past its
+ * capacity, which means the frame may have been written over before or
+ * while it was copied. */
+static bool
+copy_frame(ringbuf_t *rx, size_t len)
+{
+    uint8_t *data;
+    size_t run;
+
+    data = ringbuf_peek(rx, &run);
+    if (run > len)
+        run = len;
+
+    /* The rest wraps around to the start of the buffer */
+    memcpy(frame, data, run);
+    memcpy(&frame[run], rx->buffer, len - run);
+
+    return ringbuf_get_len(rx) <= rx->mask + 1;
+}
+
+
+/* Check and carry out the frame copied out of the ring, len bytes long */
+static void
+run_frame(size_t len)
+{
+    cmd_reader_t r;
+    uint16_t crc = CMD_CRC_INIT;
+    size_t n = 0;
+    uint8_t byte;
+    int commands;
+
+    /* The CRC over the commands and the CRC itself comes to zero */
+    reader_start(&r, len, SIZE_MAX);
+    while (read_byte(&r, &byte))
+    {
+        crc = crc_byte(crc, byte);
+        n++;
+    }
+
+    if (r.error || n < 3)
+    {
+        stats.bad_frames++;
+        LOG("cmd: malformed frame of %u bytes", len);
+        return;
+    }
+
+    if (crc != 0)
+    {
+        stats.bad_crc++;
+        LOG("cmd: bad CRC on a frame of %u bytes", len);
+        return;
+    }
+
+    /* Check every command before doing any of them, so a bad frame does
+     * nothing at all */
+    reader_start(&r, len, n - 2);
+    if (run_commands(&r, false) < 0)
+    {
+        stats.bad_frames++;
+        LOG("cmd: malformed commands in a frame of %u bytes", len);
+        return;
+    }
+
+    reader_start(&r, len, n - 2);
+    commands = run_commands(&r, true);
+
+    stats.frames++;
+    stats.commands += commands;
+}
+
+
+void
+cmd_poll(ringbuf_t *rx)
+{
+    size_t end;
+
+    if (rx->tail != scanned_tail)
+        scanned = 0;
+
+    for (;;)
+    {
+        end = scanned;
+        if (!ringbuf_find(rx, &end, 0))
+        {
+            /* Too long for a frame, so drop it and start again at the next
+             * zero */
+            if (end > CMD_MAX_FRAME)
+            {
+                ringbuf_consume(rx, end);
+                stats.bad_frames++;
+                LOG("cmd: dropped %u bytes without a frame end", end);
+                end = 0;
+            }
+
+            scanned = end;
+            scanned_tail = rx->tail;
+            return;
+        }
+
+        /* Zeros on their own are only there to resync, so there's nothing
+         * to do for an empty frame */
+        if (end > CMD_MAX_FRAME)
+        {
+            stats.bad_frames++;
+            LOG("cmd: dropped a frame of %u bytes", end);
+        }
+        else if (end > 0)
+        {
+            if (!copy_frame(rx, end))
+            {
+                /* Drop what has been written over, and look for the next
+                 * frame from what's left */
+                ringbuf_consume(rx, ringbuf_get_len(rx) - (rx->mask + 1));
+                stats.bad_frames++;
+                LOG("cmd: dropped a frame written over by new data");
+                scanned = 0;
+                continue;
+            }
+
+            run_frame(end);
+        }
+
+        ringbuf_consume(rx, end + 1);
+        scanned = 0;
+    }
+}
+
+
+void
+cmd_get_stats(cmd_stats_t *out)
+{
+    *out = stats;
+}
@@ -0,0 +1,105 @@
+#ifndef _CMD_H
+#define _CMD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ringbuf.h"
+
+
+/*
+ * Binary command protocol, for a PC to drive the trains over USART1.
+ *
+ * A frame is a list of commands followed by a CRC-16 of them. It's COBS
+ * encoded, so it holds no zero bytes, and ended with a zero. A zero can be
+ * sent ahead of a frame to make sure the controller starts afresh. Frames
+ * with a bad CRC or a malformed command are dropped whole, so nothing in
+ * them is done.
+ *
+ * The CRC is CRC-16/CCITT-FALSE (polynomial 0x1021, starting at 0xffff),
+ * sent high byte first. Addresses are two bytes, low byte first. Each
+ * command is an opcode, then:
+ *
+ *   CMD_SPEED      a count, then that many of: address, speed, flags
+ *   CMD_FUNCTION   address, function, on
+ *   CMD_ACCESSORY  address, subaddress, activate
+ *   CMD_E_STOP     enabled
+ *
+ * host/dcc_cmd.py builds frames on a PC.
+ */
+
+
+typedef enum
+{
+    CMD_SPEED = 0x01,
+    CMD_FUNCTION = 0x02,
+    CMD_ACCESSORY = 0x03,
+    CMD_E_STOP = 0x04,
+} cmd_opcode_t;
+
+
+/* Flags for each train in CMD_SPEED */
+#define CMD_SPEED_FORWARD (0x01)
+#define CMD_SPEED_128 (0x02)     /* 128 speed steps rather than 28 */
+
+
+/* Longest frame accepted, COBS encoded and without the zero at the end.
+ * Anything longer is dropped. */
+#define CMD_MAX_FRAME (256)
+
+
+/* Longest list of commands in a frame. Along with the CRC and the COBS
+ * overhead, this fits in CMD_MAX_FRAME. */
+#define CMD_MAX_PAYLOAD (248)
+
+
+/* Starting value for cmd_crc16 */
+#define CMD_CRC_INIT (0xffff)
+
+
+/**
+ * Frames and commands carried out, and frames dropped
+ */
+typedef struct
+{
+    uint32_t frames;
+    uint32_t commands;
+    uint32_t bad_crc;
+    uint32_t bad_frames;    /* Malformed, or too long */
+} cmd_stats_t;
+
+
+/**
+ * Carry out every complete frame in the receive ring. Each frame is copied
+ * out of the ring before it's decoded, so new data can't change it part way
+ * through, and consumed once done. If the ring has been written past its
+ * capacity, as the UART's DMA does when the main loop falls behind, the
+ * oldest data is dropped along with any frame in it. Call from the main
+ * loop.
+ * \param rx the ring the commands arrive in
+ */
+extern void
+cmd_poll(ringbuf_t *rx);
+
+
+/**
+ * Get the number of frames and commands handled so far
+ * \param stats filled with the counts
+ */
+extern void
+cmd_get_stats(cmd_stats_t *stats);
+
+
+/**
+ * Add bytes to a CRC-16/CCITT-FALSE
+ * \param crc CMD_CRC_INIT, or the CRC so far
+ * \param data the bytes to add
+ * \param len the number of bytes
+ * \return the CRC
+ */
+extern uint16_t
+cmd_crc16(uint16_t crc, const uint8_t *data, size_t len);
+
+
+#endif /* _CMD_H */
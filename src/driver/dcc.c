@@ -4,6 +4,7 @@
 
 #include "dcc_hal.h"
 #include "systick.h"
+#include "log.h"
 
 
 /**
@@ -14,32 +15,249 @@ typedef enum
 {
     DCC_INST_TYPE_SPEED_FORWARD = 0x40,
     DCC_INST_TYPE_SPEED_REVERSE = 0x60,
+    DCC_INST_TYPE_ADVANCED = 0x20,
+    DCC_INST_TYPE_FUNCTION_1 = 0x80,
+    DCC_INST_TYPE_FUNCTION_2 = 0xa0,
+    DCC_INST_TYPE_FEATURE = 0xc0,
 } dcc_inst_type_t;
 
 
+/* Advanced operations instruction for 128 speed steps. The next byte holds
+ * the direction in the MSB and the speed below it. */
+#define ADVANCED_SPEED_128 (0x1f)
+#define SPEED_128_FORWARD (0x80)
+
+
+/* Speed value of an emergency stop for one train, in either speed step
+ * mode */
+#define SPEED_E_STOP (0x01)
+
+
+/* Function group two selects F5-F8 with this bit set, F9-F12 without. The
+ * feature expansion instructions carry F13-F20 and F21-F28 in the next
+ * byte. */
+#define FUNCTION_2_F5 (0x10)
+#define FEATURE_F13_F20 (0x1e)
+#define FEATURE_F21_F28 (0x1f)
+
+
+/* Functions are sent in groups, each in its own packet. This is the highest
+ * function in each group. */
+#define N_FUNCTION_GROUPS (5)
+static const uint8_t function_group_last[N_FUNCTION_GROUPS] =
+{
+    4, 8, 12, 20, 28
+};
+
+
+/* Time between refreshes of each function group, in milliseconds. Decoders
+ * hold their function state, so this can be much slower than the speed
+ * refresh. Each refresh sends one group. */
+#define FUNCTION_REFRESH (5000)
+
+
+/* First byte of a long address. The top six bits of the address follow. */
+#define LONG_ADDRESS_PREFIX (0xc0)
+
+
+/* Basic accessory packets start with 10 and the low six bits of the
+ * address. The second byte has the top three address bits inverted, then
+ * the activate bit (always set here), the subaddress and which output of
+ * the pair. */
+#define ACCESSORY_PREFIX (0x80)
+#define ACCESSORY_INST (0xf8)
+
+
 /**
- * Completed frame ready to pack and write to the wire
+ * Completed frame ready to write to the wire, including the address and
+ * checksum bytes
  */
 typedef struct
 {
-    uint8_t address;
-    uint8_t n_data_bytes;
-    uint8_t data[3];
-    uint8_t checksum;
+    uint8_t len;
+    uint8_t data[DCC_HAL_MAX_PACKET];
 } dcc_frame_t;
 
 
+/**
+ * A train being refreshed, with when its last packet was on the wire and the
+ * refresh interval that achieved. On wire is set from when a packet for the
+ * train is queued until the backend reports it finished, and nothing else
+ * is sent to the train in between. Repeats counts how many more times a
+ * changed packet goes out ahead of the background refresh. The frame is
+ * only built when the speed or speed step mode changes.
+ *
+ * Function state is held as a bit per function, with masks of the function
+ * groups. Changed groups are sent in turn until each has gone out
+ * CHANGE_REPEATS times, then every group that has been set is refreshed one
+ * at a time.
+ *
+ * The byte fields are kept together ahead of the words, so there's no
+ * padding between them. This is 40 bytes on the Cortex-M3.
+ */
+typedef struct
+{
+    uint16_t address;
+    dcc_frame_t frame;
+    uint8_t repeats;
+    uint8_t speed;
+    bool is_forward;
+    bool is_stopped;        /* Sending the emergency stop */
+    bool on_wire;
+    uint8_t speed_steps;    /* A dcc_speed_steps_t */
+
+    uint8_t func_used;      /* Groups that have been set */
+    uint8_t func_dirty;     /* Groups that have changed */
+    uint8_t func_pending;   /* Changed groups still to send this round */
+    uint8_t func_repeats;
+    uint8_t func_refresh;   /* Next group to refresh */
+
+    uint32_t last_start_us;
+    uint32_t last_end_us;
+    size_t interval;
+    uint32_t functions;
+    size_t func_refreshed;
+} dcc_train_t;
+
+
 /**
  * We hold the latest packets for each of the trains, and transmit them in
- * sequence in the update function.
+ * sequence in the update function. Trains are added in the order they're
+ * first used, and only removed all at once by the emergency stop.
  */
-static dcc_frame_t trains[DCC_N_TRAINS];
+static dcc_train_t trains[DCC_N_TRAINS];
+static uint16_t n_trains = 0;
+
+
+/**
+ * Open addressed hash index from a train address to its slot in trains[].
+ * Each entry holds the slot + 1, or 0 if unused. Keeping the index at least
+ * twice the size of the table keeps the probe sequences short.
+ */
+#define INDEX_BITS (8)
+#define INDEX_SIZE (1 << INDEX_BITS)
+static uint16_t train_index[INDEX_SIZE];
+
+#if (INDEX_SIZE < 2 * DCC_N_TRAINS)
+#error "The train index must be at least twice DCC_N_TRAINS"
+#endif
+
+
+/* RAM the train table and its index may take on the target. The rest of
+ * the 20 KB is left for the UART, log and HAL rings and the stack, which
+ * the linker script checks. size_t is wider on the host, so it's only
+ * checked on the target. */
+#define TRAINS_RAM (6 * 1024)
+
+#ifdef __arm__
+_Static_assert(sizeof(trains) + sizeof(train_index) <= TRAINS_RAM,
+               "The train table doesn't fit in TRAINS_RAM");
+#endif
+
+
+/** The trains the round robin refresh and changed searches look at first */
+static uint16_t next_train = 0;
+static uint16_t next_changed = 0;
+
+
+/* Number of times a changed packet is sent before it drops back to the
+ * background refresh */
+#define CHANGE_REPEATS (3)
+
+
+/* Minimum time between packets to the same address, from the end of one to
+ * the start of the next, as per NMRA standard S-9.2. A packet queued on an
+ * idle wire can start straight away, so this is counted from the end of the
+ * last packet to the time it's queued. */
+#define ADDRESS_SPACING_US (5000)
+
+
+/* Number of packets to keep queued in the HAL, including the one being sent.
+ * Keeping this low means the scheduler picks each packet as late as
+ * possible. */
+#define QUEUE_DEPTH (1)
+
+
+/**
+ * Accessory changes waiting to go out. Each is sent CHANGE_REPEATS times,
+ * with the same gap between repeats as for a train, and then the entry is
+ * free again.
+ */
+#define N_ACCESSORIES (8)
+
+typedef struct
+{
+    dcc_frame_t frame;
+    uint8_t repeats;
+    bool on_wire;
+    uint32_t last_end_us;
+} dcc_accessory_t;
+
+static dcc_accessory_t accessories[N_ACCESSORIES];
+
+
+/**
+ * Packets given to the backend that it hasn't reported finished, by packet
+ * id modulo N_IN_FLIGHT. Only QUEUE_DEPTH packets are outstanding when the
+ * next one is queued, plus any that finished since the completions were
+ * last read, so a few entries are plenty. An entry for neither a train nor
+ * an accessory is free.
+ *
+ * Ids run through N_IDS values, many more than there are entries, so a
+ * completion that turns up after its entry has been let go and used again
+ * carries an id that no longer matches, and is dropped.
+ */
+#define N_IN_FLIGHT (8)
+#define N_IDS (DCC_HAL_URGENT_ID - DCC_HAL_URGENT_ID % N_IN_FLIGHT)
+
+typedef struct
+{
+    dcc_train_t *train;
+    dcc_accessory_t *accessory;
+    dcc_class_t class;
+    uint8_t id;
+    uint32_t queued_us;
+} dcc_in_flight_t;
+
+static dcc_in_flight_t in_flight[N_IN_FLIGHT];
+static uint8_t next_id = 0;
+
+/* A packet not reported finished this long after it was queued has had its
+ * completion dropped by the backend, e.g. because they weren't read often
+ * enough. Its train or accessory is let go rather than kept off the wire
+ * for good. Two of the longest packets take under 20 ms. */
+#define IN_FLIGHT_TIMEOUT_US (50000)
+
+#if (N_IDS <= N_IN_FLIGHT)
+#error "Packet ids must stay below DCC_HAL_URGENT_ID"
+#endif
+
+
+/* The train whose speed packet was queued last, and the packet's id. Until
+ * it goes out on the wire, a new speed for the train overwrites it. */
+static dcc_train_t *queued_speed = NULL;
+static uint8_t queued_speed_id;
 
 
 /** True when the emergency stop is called */
 static bool stopped = false;
 
 
+/* When the emergency stop was called, until the first stop packet
+ * finishes */
+static bool e_stop_waiting = false;
+static uint32_t e_stop_us;
+
+
+/* Broadcast emergency stop, repeated by the HAL for as long as we're
+ * stopped */
+static const dcc_frame_t e_stop =
+{
+    .len = 3,
+    .data = { 0x00, 0x41, 0x41 }
+};
+
+
 /* Look up table for the speed values */
 static uint8_t speed_lut[] =
 {
@@ -51,125 +269,793 @@ static uint8_t speed_lut[] =
 };
 
 
+/* Round up when scaling to 28 steps so a moving train never stops */
+#define SCALE_28(speed) (((speed) * 28 + DCC_MAX_SPEED - 1) / DCC_MAX_SPEED)
+
+
+/** Packets and bits sent in each class, for working out track usage */
+static dcc_stats_t stats[DCC_N_CLASSES];
+
+
 static bool initialised = false;
 
+
+/* Where the packets go */
+static const dcc_hal_backend_t *hal = &dcc_hal_backend;
+
+
+static void
+clear_trains(void)
+{
+    n_trains = 0;
+    next_train = 0;
+    next_changed = 0;
+    queued_speed = NULL;
+    memset(train_index, 0, sizeof(train_index));
+
+    /* Anything still on the wire was for a train that's gone. Accessory
+     * changes not yet sent are dropped with them. */
+    memset(in_flight, 0, sizeof(in_flight));
+    memset(accessories, 0, sizeof(accessories));
+}
+
+
 void
 dcc_init(void)
 {
-    dcc_hal_init();
+    dcc_init_backend(&dcc_hal_backend);
+}
+
+
+void
+dcc_init_backend(const dcc_hal_backend_t *backend)
+{
+    hal = backend;
+    hal->init();
 
-    memset(trains, 0, DCC_N_TRAINS * sizeof(dcc_frame_t));
+    clear_trains();
 
     initialised = true;
 }
 
 
-static uint8_t
-send_frame(dcc_frame_t *frame)
+/* Fibonacci hash of the address, giving the first index entry to probe */
+static uint16_t
+hash_address(uint16_t address)
 {
-    uint8_t data[5];
-    uint8_t len = 0;
-    int i;
+    return (uint16_t)(address * 40503u) >> (16 - INDEX_BITS);
+}
 
-    if (!initialised)
-        dcc_init();
 
-    /* Address */
-    data[len++] = frame->address;
+/* Look up a train by address. If it isn't in the table and create is set,
+ * it's added. Returns NULL if the train isn't found or the table is full. */
+static dcc_train_t *
+find_train(uint16_t address, bool create)
+{
+    uint16_t i = hash_address(address);
+    dcc_train_t *train;
 
-    /* Data */
-    for (i = 0; i < frame->n_data_bytes; i++)
+    /* Linear probe until we find the train or an unused entry */
+    while (train_index[i] != 0)
     {
-        data[len++] = frame->data[i];
+        if (trains[train_index[i] - 1].address == address)
+            return &trains[train_index[i] - 1];
+
+        i = (i + 1) & (INDEX_SIZE - 1);
     }
 
-    /* Checksum */
-    data[len++] = frame->checksum;
+    if (!create || n_trains == DCC_N_TRAINS)
+        return NULL;
+
+    train = &trains[n_trains];
+    memset(train, 0, sizeof(dcc_train_t));
+    train->address = address;
+    train->speed_steps = DCC_SPEED_STEPS_28;
+
+    train_index[i] = ++n_trains;
+
+    return train;
+}
+
+
+/* Let go of a packet whose completion never came, treating it as having
+ * just finished so the address spacing is kept */
+static void
+release_in_flight(dcc_in_flight_t *f, uint32_t now_us)
+{
+    LOG("dcc: packet %u never finished", f->id);
+
+    if (f->accessory != NULL)
+    {
+        f->accessory->last_end_us = now_us;
+        f->accessory->on_wire = false;
+    }
+    else
+    {
+        f->train->last_end_us = now_us;
+        f->train->on_wire = false;
+
+        if (queued_speed == f->train)
+            queued_speed = NULL;
+    }
+
+    f->train = NULL;
+    f->accessory = NULL;
+}
+
+
+static void
+expire_in_flight(void)
+{
+    uint32_t now_us = systick_get_us();
+    dcc_in_flight_t *f;
+
+    for (f = in_flight; f < &in_flight[N_IN_FLIGHT]; f++)
+    {
+        if ((f->train != NULL || f->accessory != NULL) &&
+            now_us - f->queued_us >= IN_FLIGHT_TIMEOUT_US)
+            release_in_flight(f, now_us);
+    }
+}
+
+
+/* Give a frame to the backend. Returns its in flight entry for the caller
+ * to say who it's for, or NULL if the backend is full. */
+static dcc_in_flight_t *
+queue_frame(const dcc_frame_t *frame, dcc_class_t class)
+{
+    dcc_in_flight_t *f;
+    uint8_t *data;
+
+    if (!initialised)
+        dcc_init();
+
+    /* Build the packet straight into the transmit queue */
+    data = hal->reserve();
+    if (data == NULL)
+        return NULL;
+
+    memcpy(data, frame->data, frame->len);
 
     /* The sender will then take all the bytes and add an extra 0 bit between
      * each one */
-    return dcc_hal_write(data, len);
+    hal->commit(frame->len, next_id);
+
+    /* The entry has come round again without the last packet in it being
+     * reported finished */
+    f = &in_flight[next_id % N_IN_FLIGHT];
+    if (f->train != NULL || f->accessory != NULL)
+        release_in_flight(f, systick_get_us());
+
+    f->train = NULL;
+    f->accessory = NULL;
+    f->class = class;
+    f->id = next_id;
+    f->queued_us = systick_get_us();
+    next_id = (next_id + 1) % N_IDS;
+
+    stats[class].packets++;
+    stats[class].bits += DCC_HAL_PACKET_BITS(frame->len);
+
+    return f;
+}
+
+
+static dcc_in_flight_t *
+send_frame(dcc_train_t *train, dcc_frame_t *frame, dcc_class_t class)
+{
+    dcc_in_flight_t *f = queue_frame(frame, class);
+
+    if (f == NULL)
+        return NULL;
+
+    f->train = train;
+    train->on_wire = true;
+
+    return f;
+}
+
+
+/* Send a train's speed packet, keeping track of it so a new speed can
+ * overwrite it until it goes out */
+static bool
+send_speed(dcc_train_t *train, dcc_class_t class)
+{
+    dcc_in_flight_t *f = send_frame(train, &train->frame, class);
+
+    if (f == NULL)
+        return false;
+
+    queued_speed = train;
+    queued_speed_id = f->id;
+
+    return true;
+}
+
+
+/* Write the address bytes for a train, returning the number of bytes. Short
+ * addresses take one byte, long addresses two. */
+static uint8_t
+encode_address(uint8_t *data, uint16_t address)
+{
+    if (address <= DCC_MAX_SHORT_ADDRESS)
+    {
+        data[0] = (uint8_t)address;
+        return 1;
+    }
+
+    data[0] = LONG_ADDRESS_PREFIX | (uint8_t)(address >> 8);
+    data[1] = (uint8_t)address;
+    return 2;
 }
 
 
 static void
 calculate_checksum(dcc_frame_t *frame)
 {
-	frame->checksum = frame->address ^ frame->data[0];
+    uint8_t checksum = 0;
+    int i;
+
+    for (i = 0; i < frame->len; i++)
+        checksum ^= frame->data[i];
+
+    frame->data[frame->len++] = checksum;
 }
 
 
-void
-dcc_update(void)
+/* True if it's time to refresh one of the train's function groups */
+static bool
+function_refresh_due(dcc_train_t *train)
+{
+    return train->func_used != 0 &&
+        systick_test_duration(train->func_refreshed, FUNCTION_REFRESH);
+}
+
+
+/* Find the next train that is due a packet, starting from the cursor. When
+ * changed is set, only trains with changes left to repeat are
+ * considered. */
+static dcc_train_t *
+find_due(uint16_t *cursor, bool changed, uint32_t now_us)
 {
+    dcc_train_t *train;
     int i;
 
-    static dcc_frame_t e_stop =
+    for (i = 0; i < n_trains; i++)
+    {
+        if (*cursor >= n_trains)
+            *cursor = 0;
+
+        train = &trains[(*cursor)++];
+
+        if (changed)
+        {
+            if (train->repeats == 0 && train->func_dirty == 0)
+                continue;
+        }
+        else
+        {
+            /* Nothing to refresh until the speed has been set, unless
+             * functions are due */
+            if (train->frame.len == 0 && !function_refresh_due(train))
+                continue;
+        }
+
+        /* Leave a gap between packets to the same train */
+        if (train->on_wire ||
+            now_us - train->last_end_us < ADDRESS_SPACING_US)
+            continue;
+
+        return train;
+    }
+
+    return NULL;
+}
+
+
+/* Find an accessory change that is due to be sent */
+static dcc_accessory_t *
+find_accessory(uint32_t now_us)
+{
+    dcc_accessory_t *a;
+
+    for (a = accessories; a < &accessories[N_ACCESSORIES]; a++)
+    {
+        if (a->repeats > 0 && !a->on_wire &&
+            now_us - a->last_end_us >= ADDRESS_SPACING_US)
+            return a;
+    }
+
+    return NULL;
+}
+
+
+static bool
+send_accessory(dcc_accessory_t *a)
+{
+    dcc_in_flight_t *f = queue_frame(&a->frame, DCC_CLASS_ACCESSORY);
+
+    if (f == NULL)
+        return false;
+
+    f->accessory = a;
+    a->on_wire = true;
+    a->repeats--;
+
+    return true;
+}
+
+
+/* Build the packet for one of a train's function groups */
+static void
+encode_functions(dcc_train_t *train, uint8_t group, dcc_frame_t *f)
+{
+    uint32_t fn = train->functions;
+
+    f->len = encode_address(f->data, train->address);
+
+    switch (group)
+    {
+    case 0:
+        /* F0 goes in bit 4, above F1-F4 */
+        f->data[f->len++] = DCC_INST_TYPE_FUNCTION_1 | ((fn & 0x01) << 4) |
+            ((fn >> 1) & 0x0f);
+        break;
+
+    case 1:
+        f->data[f->len++] = DCC_INST_TYPE_FUNCTION_2 | FUNCTION_2_F5 |
+            ((fn >> 5) & 0x0f);
+        break;
+
+    case 2:
+        f->data[f->len++] = DCC_INST_TYPE_FUNCTION_2 | ((fn >> 9) & 0x0f);
+        break;
+
+    case 3:
+        f->data[f->len++] = DCC_INST_TYPE_FEATURE | FEATURE_F13_F20;
+        f->data[f->len++] = (uint8_t)(fn >> 13);
+        break;
+
+    default:
+        f->data[f->len++] = DCC_INST_TYPE_FEATURE | FEATURE_F21_F28;
+        f->data[f->len++] = (uint8_t)(fn >> 21);
+        break;
+    }
+
+    calculate_checksum(f);
+}
+
+
+/* Send the next changed packet for a train. Speed changes go first, then
+ * each changed function group in turn. */
+static bool
+send_changed(dcc_train_t *train)
+{
+    dcc_frame_t f;
+    uint8_t group;
+
+    if (train->repeats > 0)
+    {
+        if (!send_speed(train, DCC_CLASS_SPEED))
+            return false;
+
+        train->repeats--;
+        return true;
+    }
+
+    /* Start another round of the changed groups */
+    if (train->func_pending == 0)
+        train->func_pending = train->func_dirty;
+
+    for (group = 0; !(train->func_pending & (1 << group)); group++)
+        ;
+
+    encode_functions(train, group, &f);
+    if (send_frame(train, &f, DCC_CLASS_FUNCTION) == NULL)
+        return false;
+
+    train->func_pending &= ~(1 << group);
+    if (train->func_pending == 0 && --train->func_repeats == 0)
+        train->func_dirty = 0;
+
+    train->func_refreshed = systicks;
+
+    return true;
+}
+
+
+/* Send the background refresh for a train. This is the speed packet, unless
+ * one of the function groups is due. */
+static bool
+send_refresh(dcc_train_t *train)
+{
+    dcc_frame_t f;
+    uint8_t group;
+
+    if (!function_refresh_due(train))
     {
-        .address = 0x00,
-        .n_data_bytes = 1,
-        .data[0] = 0x41,
-        .checksum = 0x41
-    };
+        return send_speed(train, DCC_CLASS_SPEED_REFRESH);
+    }
+
+    /* Next group in use, carrying on from the last one refreshed */
+    group = train->func_refresh;
+    while (!(train->func_used & (1 << group)))
+        group = (group + 1) % N_FUNCTION_GROUPS;
+
+    encode_functions(train, group, &f);
+    if (send_frame(train, &f, DCC_CLASS_FUNCTION_REFRESH) == NULL)
+        return false;
+
+    train->func_refresh = (group + 1) % N_FUNCTION_GROUPS;
+    train->func_refreshed = systicks;
+
+    return true;
+}
+
+
+static void
+record_latency(dcc_class_t class, uint32_t latency_us)
+{
+    stats[class].completed++;
+    stats[class].latency_total_us += latency_us;
+    if (latency_us > stats[class].latency_max_us)
+        stats[class].latency_max_us = latency_us;
+}
 
-    if (!stopped)
+
+/* Take the packets the backend has finished sending, freeing their trains
+ * for the next packet */
+static void
+check_completions(void)
+{
+    dcc_hal_completion_t done;
+    dcc_in_flight_t *f;
+    dcc_train_t *train;
+
+    while (hal->get_completion(&done))
     {
-        for (i = 0; i < DCC_N_TRAINS; i++)
+        if (done.id == DCC_HAL_URGENT_ID)
         {
-            if (trains[i].address != 0)
-            {
-                send_frame(&trains[i]);
-                /* We delay 10 ms (5ms required) to be safe */
-                systick_delay(10);
-            }
+            if (e_stop_waiting)
+                record_latency(DCC_CLASS_URGENT, done.end_us - e_stop_us);
+
+            e_stop_waiting = false;
+            continue;
         }
+
+        /* Drop completions for packets that have been let go */
+        f = &in_flight[done.id % N_IN_FLIGHT];
+        if ((f->train == NULL && f->accessory == NULL) || f->id != done.id)
+            continue;
+
+        record_latency(f->class, done.end_us - f->queued_us);
+
+        if (f->accessory != NULL)
+        {
+            f->accessory->last_end_us = done.end_us;
+            f->accessory->on_wire = false;
+            f->accessory = NULL;
+            continue;
+        }
+
+        train = f->train;
+        f->train = NULL;
+
+        /* A train has one packet on the wire at a time, so if its speed
+         * packet was queued, this was it */
+        if (queued_speed == train)
+            queued_speed = NULL;
+
+        if (train->last_end_us != 0)
+            train->interval = (done.start_us - train->last_start_us) / 1000;
+
+        train->last_start_us = done.start_us;
+        train->last_end_us = done.end_us;
+        train->on_wire = false;
+    }
+
+    expire_in_flight();
+}
+
+
+void
+dcc_update(void)
+{
+    dcc_train_t *train;
+    dcc_accessory_t *accessory;
+    uint32_t now_us;
+    bool sent;
+
+    check_completions();
+
+    /* The HAL sends the emergency stop by itself */
+    if (stopped)
+        return;
+
+    now_us = systick_get_us();
+
+    /* Top up the queue without waiting on it, highest priority first:
+     * train changes, accessory changes, then the background refresh. Only
+     * one packet is queued ahead of the wire, so a higher priority packet
+     * always goes out at the next packet boundary. Anything not due yet is
+     * picked up on a later call. */
+    while (hal->get_pending() < QUEUE_DEPTH)
+    {
+        if ((train = find_due(&next_changed, true, now_us)) != NULL)
+        {
+            sent = send_changed(train);
+        }
+        else if ((accessory = find_accessory(now_us)) != NULL)
+        {
+            sent = send_accessory(accessory);
+        }
+        else if ((train = find_due(&next_train, false, now_us)) != NULL)
+        {
+            sent = send_refresh(train);
+        }
+        else
+        {
+            break;
+        }
+
+        if (!sent)
+            break;
+    }
+}
+
+
+/* Build the speed packet for a train from its current state */
+static void
+encode_speed(dcc_train_t *train)
+{
+    dcc_frame_t *f = &train->frame;
+
+    f->len = encode_address(f->data, train->address);
+
+    if (train->speed_steps == DCC_SPEED_STEPS_128)
+    {
+        f->data[f->len++] = DCC_INST_TYPE_ADVANCED | ADVANCED_SPEED_128;
+
+        /* Speed step 1 is the emergency stop, so moving speeds start at 2 */
+        f->data[f->len] = train->is_forward ? SPEED_128_FORWARD : 0;
+        if (train->is_stopped)
+            f->data[f->len] |= SPEED_E_STOP;
+        else if (train->speed > 0)
+            f->data[f->len] |= train->speed + 1;
+        f->len++;
     }
     else
     {
-        send_frame(&e_stop);
+        f->data[f->len] = train->is_forward ? DCC_INST_TYPE_SPEED_FORWARD :
+                                              DCC_INST_TYPE_SPEED_REVERSE;
+        f->data[f->len++] |= train->is_stopped ? SPEED_E_STOP :
+            speed_lut[SCALE_28(train->speed)];
+    }
+
+    calculate_checksum(f);
+
+    /* Get the change out ahead of the refresh */
+    train->repeats = CHANGE_REPEATS;
+
+    /* If the last speed packet for the train hasn't gone out yet, update it
+     * where it is. It then counts as the first repeat. */
+    if (queued_speed == train &&
+        hal->replace(queued_speed_id, f->data, f->len))
+    {
+        train->repeats--;
+        stats[DCC_CLASS_SPEED].replaced++;
     }
 }
 
 
-void
-dcc_set_speed(uint8_t address, uint8_t speed, bool is_forward)
+/* Look up a train for the setters, checking the address is valid */
+static dcc_train_t *
+get_train(uint16_t address)
 {
-    dcc_frame_t f;
+    dcc_train_t *train;
 
     /* Make sure the address is valid */
-    if (address > DCC_N_TRAINS || address == 0)
+    if (address > DCC_MAX_ADDRESS || address == 0)
     {
-        printf("Invalid train address: %02x\n", address);
-        return;
+        LOG("dcc: invalid train address %u", address);
+        return NULL;
     }
 
-    /* Configure the frame */
-    f.address = address & 0x7f;
-    f.n_data_bytes = 1;
-    f.data[0] = is_forward ? DCC_INST_TYPE_SPEED_FORWARD :
-                             DCC_INST_TYPE_SPEED_REVERSE;
+    train = find_train(address, true);
+    if (train == NULL)
+        LOG("dcc: too many trains for address %u", address);
+
+    return train;
+}
+
+
+void
+dcc_set_speed(uint16_t address, uint8_t speed, bool is_forward)
+{
+    dcc_train_t *train = get_train(address);
+
+    if (train == NULL)
+        return;
 
     /* Make sure the speed is a valid value */
-    if (speed > 28)
-        speed = 28;
-    f.data[0] |= speed_lut[speed];
+    if (speed > DCC_MAX_SPEED)
+        speed = DCC_MAX_SPEED;
+
+    train->speed = speed;
+    train->is_forward = is_forward;
+    train->is_stopped = false;
+
+    encode_speed(train);
+}
+
+
+void
+dcc_stop_train(uint16_t address, bool is_forward)
+{
+    dcc_train_t *train = get_train(address);
+
+    if (train == NULL)
+        return;
+
+    train->speed = 0;
+    train->is_forward = is_forward;
+    train->is_stopped = true;
+
+    encode_speed(train);
+}
+
+
+void
+dcc_set_speed_steps(uint16_t address, dcc_speed_steps_t speed_steps)
+{
+    dcc_train_t *train = get_train(address);
+
+    if (train == NULL || train->speed_steps == speed_steps)
+        return;
+
+    train->speed_steps = speed_steps;
+
+    /* Resend the current speed in the new format, if there is one */
+    if (train->frame.len != 0)
+        encode_speed(train);
+}
+
+
+void
+dcc_set_function(uint16_t address, uint8_t function, bool on)
+{
+    dcc_train_t *train;
+    uint32_t old;
+    uint8_t group;
+
+    if (function > DCC_MAX_FUNCTION)
+    {
+        LOG("dcc: invalid function %u", function);
+        return;
+    }
+
+    train = get_train(address);
+    if (train == NULL)
+        return;
+
+    old = train->functions;
+    if (on)
+        train->functions |= (uint32_t)1 << function;
+    else
+        train->functions &= ~((uint32_t)1 << function);
+
+    for (group = 0; function > function_group_last[group]; group++)
+        ;
+
+    /* Only send groups that have actually changed, or are set for the first
+     * time */
+    if (train->functions == old && (train->func_used & (1 << group)))
+        return;
 
-    /* Calculate the checksum */
+    train->func_used |= 1 << group;
+    train->func_dirty |= 1 << group;
+    train->func_pending |= 1 << group;
+    train->func_repeats = CHANGE_REPEATS;
+}
+
+
+void
+dcc_set_accessory(uint16_t address, uint8_t sub, bool activate)
+{
+    dcc_frame_t f;
+    dcc_accessory_t *a, *slot = NULL;
+
+    if (address > DCC_MAX_ACCESSORY || sub > DCC_MAX_ACCESSORY_SUB)
+    {
+        LOG("dcc: invalid accessory %u.%u", address, sub);
+        return;
+    }
+
+    f.len = 0;
+    f.data[f.len++] = ACCESSORY_PREFIX | (address & 0x3f);
+    f.data[f.len++] = ACCESSORY_INST ^
+        ((((address >> 6) & 0x07) << 4) | (sub << 1) | activate);
     calculate_checksum(&f);
 
-    /* Store the speed */
-    memcpy(&trains[address-1], &f, sizeof(dcc_frame_t));
+    /* A newer setting for the same output replaces one still waiting, so
+     * the output ends up as last asked */
+    for (a = accessories; a < &accessories[N_ACCESSORIES]; a++)
+    {
+        if (a->repeats > 0 && a->frame.data[0] == f.data[0] &&
+            (a->frame.data[1] & ~0x01) == (f.data[1] & ~0x01))
+        {
+            slot = a;
+            break;
+        }
+
+        if (slot == NULL && a->repeats == 0 && !a->on_wire)
+            slot = a;
+    }
+
+    if (slot == NULL)
+    {
+        LOG("dcc: too many accessory changes for %u.%u", address, sub);
+        return;
+    }
+
+    slot->frame = f;
+    slot->repeats = CHANGE_REPEATS;
+}
+
+
+size_t
+dcc_get_refresh_interval(uint16_t address)
+{
+    dcc_train_t *train = find_train(address, false);
+
+    if (train == NULL)
+        return 0;
+
+    return train->interval;
 }
 
 
 void
 dcc_e_stop(bool enable)
 {
-    stopped = enable;
+    if (!initialised)
+        dcc_init();
 
-    if (stopped)
+    if (enable && !stopped)
     {
+        /* Drop whatever is queued and send the stop from the next packet
+         * boundary, back to back until we're started again */
+        hal->set_urgent(e_stop.data, e_stop.len);
+        LOG("dcc: emergency stop");
+
+        e_stop_us = systick_get_us();
+        e_stop_waiting = true;
+
+        stats[DCC_CLASS_URGENT].packets++;
+        stats[DCC_CLASS_URGENT].bits += DCC_HAL_PACKET_BITS(e_stop.len);
+
         /* Make sure trains don't boost off again when we start back up */
-        memset(trains, 0, DCC_N_TRAINS * sizeof(dcc_frame_t));
+        clear_trains();
+    }
+    else if (!enable && stopped)
+    {
+        hal->set_urgent(NULL, 0);
+        LOG("dcc: emergency stop released");
     }
+
+    stopped = enable;
+}
+
+
+bool
+dcc_is_e_stopped(void)
+{
+    return stopped;
+}
+
+
+void
+dcc_get_stats(dcc_stats_t *out)
+{
+    memcpy(out, stats, sizeof(stats));
 }
@@ -3,13 +3,79 @@
 
 
 #include <stdint.h>
+#include <stddef.h>
 
 #include "stm32f10x.h"
 
 #include "dcc_hal.h"
 
 
-#define DCC_N_TRAINS (10)
+/* Number of trains that can be driven at once. Each takes 40 bytes of RAM
+ * and 4 bytes of index, see dcc.c. */
+#define DCC_N_TRAINS (128)
+
+
+/* Short addresses are sent in one byte, anything above in two */
+#define DCC_MAX_SHORT_ADDRESS (127)
+#define DCC_MAX_ADDRESS (10239)
+
+
+/* Highest speed accepted by dcc_set_speed, whatever the speed step mode */
+#define DCC_MAX_SPEED (126)
+
+
+/**
+ * Speed step modes a train can be driven in
+ */
+typedef enum
+{
+    DCC_SPEED_STEPS_28,     /* Baseline speed and direction packet */
+    DCC_SPEED_STEPS_128,    /* Advanced operations speed packet */
+} dcc_speed_steps_t;
+
+
+/* Highest function number that can be set */
+#define DCC_MAX_FUNCTION (28)
+
+
+/* Highest accessory decoder address and subaddress, as used by DCC++ */
+#define DCC_MAX_ACCESSORY (511)
+#define DCC_MAX_ACCESSORY_SUB (3)
+
+
+/**
+ * Classes of packet sent by the scheduler, for bandwidth accounting
+ */
+typedef enum
+{
+    DCC_CLASS_URGENT,           /* Emergency stops started */
+    DCC_CLASS_SPEED,            /* Repeats of a changed speed */
+    DCC_CLASS_FUNCTION,         /* Repeats of changed function groups */
+    DCC_CLASS_ACCESSORY,        /* Repeats of accessory changes */
+    DCC_CLASS_SPEED_REFRESH,
+    DCC_CLASS_FUNCTION_REFRESH,
+    DCC_N_CLASSES
+} dcc_class_t;
+
+
+/**
+ * Number of packets and bits sent in a class, including the preamble, and
+ * the number of times a queued packet was brought up to date in place
+ * rather than sent again.
+ *
+ * Latency is counted for each packet the backend reports finished on the
+ * wire, from when it was queued to the end of its end bit. For the
+ * emergency stop, it's from dcc_e_stop to the end of the first stop packet.
+ */
+typedef struct
+{
+    uint32_t packets;
+    uint32_t bits;
+    uint32_t replaced;
+    uint32_t completed;
+    uint32_t latency_max_us;
+    uint64_t latency_total_us;
+} dcc_stats_t;
 
 
 /**
@@ -20,8 +86,18 @@ dcc_init(void);
 
 
 /**
- * This needs to be called periodically to write the train speeds to the
- * rail
+ * As dcc_init, but send packets through the given backend rather than the
+ * on-chip one
+ * \param backend the backend to use, which must stay valid
+ */
+extern void
+dcc_init_backend(const dcc_hal_backend_t *backend);
+
+
+/**
+ * This needs to be called as often as possible to write the train speeds to
+ * the rail. It never blocks: packets are queued when the driver has room and
+ * the train is due.
  */
 extern void
 dcc_update(void);
@@ -29,14 +105,88 @@ dcc_update(void);
 
 /**
  * Update the speed value for the given train. No signal is sent for a train
- * unless the speed has been set here
+ * unless the speed has been set here. Addresses above DCC_MAX_SHORT_ADDRESS
+ * are sent as long addresses.
+ * \param speed 0 to stop, up to DCC_MAX_SPEED. This is scaled down for
+ * trains in 28 step mode.
  */
 extern void
-dcc_set_speed(uint8_t address, uint8_t speed, bool is_forward);
+dcc_set_speed(uint16_t address, uint8_t speed, bool is_forward);
 
 
+/**
+ * Emergency stop one train. The stop goes out as a speed change, and the
+ * train is kept stopped by its refresh until its speed is next set.
+ */
+extern void
+dcc_stop_train(uint16_t address, bool is_forward);
+
+
+/**
+ * Choose how speeds are sent to the given train. Trains start in 28 step
+ * mode.
+ */
+extern void
+dcc_set_speed_steps(uint16_t address, dcc_speed_steps_t speed_steps);
+
+
+/**
+ * Turn one of a train's functions on or off. The change is sent straight
+ * away, then refreshed far less often than the speed.
+ * \param function 0 for the headlight (F0), up to DCC_MAX_FUNCTION
+ */
+extern void
+dcc_set_function(uint16_t address, uint8_t function, bool on);
+
+
+/**
+ * Set one of the outputs of a basic accessory decoder, e.g. to throw a
+ * turnout. The packet is sent a few times and then forgotten, as accessory
+ * decoders aren't refreshed.
+ * \param address the decoder address, up to DCC_MAX_ACCESSORY
+ * \param sub the output pair on the decoder, up to DCC_MAX_ACCESSORY_SUB
+ * \param activate which output of the pair to turn on
+ */
+extern void
+dcc_set_accessory(uint16_t address, uint8_t sub, bool activate);
+
+
+/**
+ * Start or end the emergency stop. Starting it drops anything queued, and
+ * a broadcast stop goes out at the next packet boundary and then back to
+ * back until it's ended. Every train is forgotten, so nothing moves off
+ * again until its speed is set.
+ * \param enabled true to stop, false to carry on
+ */
 extern void
 dcc_e_stop(bool enabled);
 
 
+/**
+ * Find out whether the emergency stop is on, from whoever started it
+ * \return true while stopped
+ */
+extern bool
+dcc_is_e_stopped(void);
+
+
+/**
+ * Get the time between the starts of the last two packets to a train on the
+ * wire
+ * \param address the train address
+ * \return the refresh interval in milliseconds, or 0 if it isn't known
+ */
+extern size_t
+dcc_get_refresh_interval(uint16_t address);
+
+
+
+/**
+ * Get the number of packets and bits sent so far in each class
+ * \param stats array of DCC_N_CLASSES entries to fill
+ */
+extern void
+dcc_get_stats(dcc_stats_t *stats);
+
+
 #endif /* _DCC_H */
@@ -0,0 +1,458 @@
+#include "dccpp.h"
+
+#include "dcc.h"
+#include "log.h"
+
+
+/* Largest number accepted in a command, either way from 0 */
+#define MAX_NUMBER (65535)
+
+
+/* Longest reply */
+#define MAX_REPLY (48)
+
+
+/**
+ * Classes of character. Anything not listed is CHAR_OTHER, which is only
+ * allowed as the opcode.
+ */
+typedef enum
+{
+    CHAR_OTHER,
+    CHAR_START,
+    CHAR_END,
+    CHAR_DIGIT,
+    CHAR_MINUS,
+    CHAR_SPACE,
+    N_CHAR_CLASSES
+} dccpp_char_t;
+
+static const uint8_t char_class[128] =
+{
+    ['<'] = CHAR_START,
+    ['>'] = CHAR_END,
+    ['0' ... '9'] = CHAR_DIGIT,
+    ['-'] = CHAR_MINUS,
+    [' '] = CHAR_SPACE,
+    ['\t'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,
+    ['\n'] = CHAR_SPACE,
+};
+
+
+typedef enum
+{
+    STATE_IDLE,         /* Waiting for a < */
+    STATE_OPCODE,       /* Waiting for the opcode after the < */
+    STATE_ARGS,         /* Between numbers */
+    STATE_SIGN,         /* After the - of a number */
+    STATE_NUMBER,       /* In the digits of a number */
+    STATE_SKIP,         /* In a bad command, waiting for the > */
+    N_STATES
+} dccpp_state_t;
+
+
+typedef enum
+{
+    ACT_NONE,
+    ACT_BEGIN,          /* Start a new command */
+    ACT_OPCODE,         /* Keep the opcode */
+    ACT_SIGN,           /* Start a negative number */
+    ACT_DIGIT,          /* Add a digit, starting a number if need be */
+    ACT_RUN,            /* Carry out the command */
+    ACT_BAD,            /* Drop the command */
+} dccpp_action_t;
+
+
+typedef struct
+{
+    uint8_t next;
+    uint8_t action;
+} dccpp_transition_t;
+
+
+#define T(state, action) { STATE_##state, ACT_##action }
+
+/* What each class of character does in each state. A < always starts a
+ * new command, dropping any that wasn't finished. */
+static const dccpp_transition_t transitions[N_STATES][N_CHAR_CLASSES] =
+{
+    /*                  OTHER             START             END
+     *                  DIGIT             MINUS             SPACE */
+    [STATE_IDLE] =    { T(IDLE, NONE),    T(OPCODE, BEGIN), T(IDLE, NONE),
+                        T(IDLE, NONE),    T(IDLE, NONE),    T(IDLE, NONE) },
+    [STATE_OPCODE] =  { T(ARGS, OPCODE),  T(OPCODE, BEGIN), T(IDLE, NONE),
+                        T(ARGS, OPCODE),  T(ARGS, OPCODE),  T(OPCODE, NONE) },
+    [STATE_ARGS] =    { T(SKIP, BAD),     T(OPCODE, BEGIN), T(IDLE, RUN),
+                        T(NUMBER, DIGIT), T(SIGN, SIGN),    T(ARGS, NONE) },
+    [STATE_SIGN] =    { T(SKIP, BAD),     T(OPCODE, BEGIN), T(IDLE, BAD),
+                        T(NUMBER, DIGIT), T(SKIP, BAD),     T(SKIP, BAD) },
+    [STATE_NUMBER] =  { T(SKIP, BAD),     T(OPCODE, BEGIN), T(IDLE, RUN),
+                        T(NUMBER, DIGIT), T(SKIP, BAD),     T(ARGS, NONE) },
+    [STATE_SKIP] =    { T(SKIP, NONE),    T(OPCODE, BEGIN), T(IDLE, NONE),
+                        T(SKIP, NONE),    T(SKIP, NONE),    T(SKIP, NONE) },
+};
+
+#undef T
+
+
+/**
+ * The commands, with how many numbers each takes. The handler returns
+ * false if the numbers are out of range.
+ */
+typedef struct
+{
+    char opcode;
+    uint8_t min_args;
+    uint8_t max_args;
+    bool (*run)(const int32_t *args, uint8_t nargs);
+} dccpp_command_t;
+
+
+/**
+ * Function groups for <f>, picked by the top bits of the first byte as in
+ * the DCC function instructions. The state of the functions is in the low
+ * bits of the last byte. F0 is in bit 4 of the first group.
+ */
+typedef struct
+{
+    uint8_t mask;
+    uint8_t value;
+    uint8_t first;
+    uint8_t count;
+    uint8_t nargs;
+} dccpp_function_group_t;
+
+static const dccpp_function_group_t function_groups[] =
+{
+    { 0xe0, 0x80, 1, 4, 2 },
+    { 0xf0, 0xb0, 5, 4, 2 },
+    { 0xf0, 0xa0, 9, 4, 2 },
+    { 0xff, 0xde, 13, 8, 3 },
+    { 0xff, 0xdf, 21, 8, 3 },
+};
+
+#define N_FUNCTION_GROUPS \
+    (sizeof(function_groups) / sizeof(function_groups[0]))
+
+
+/* The command being parsed */
+static struct
+{
+    dccpp_state_t state;
+    char opcode;
+    int32_t args[DCCPP_MAX_ARGS];
+    uint8_t nargs;
+    int8_t sign;
+} parser;
+
+
+static dccpp_reply_t reply_to;
+static char reply_buf[MAX_REPLY];
+static uint8_t reply_len;
+
+static dccpp_stats_t stats;
+
+
+static void
+reply_str(const char *s)
+{
+    while (*s != '\0' && reply_len < MAX_REPLY)
+        reply_buf[reply_len++] = *s++;
+}
+
+
+static void
+reply_int(int32_t value)
+{
+    char digits[10];
+    uint32_t v = value < 0 ? -value : value;
+    uint8_t n = 0;
+
+    if (value < 0)
+        reply_str("-");
+
+    do
+    {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v > 0);
+
+    while (n > 0 && reply_len < MAX_REPLY)
+        reply_buf[reply_len++] = digits[--n];
+}
+
+
+static void
+reply_send(void)
+{
+    if (reply_to != NULL)
+        reply_to(reply_buf, reply_len);
+
+    reply_len = 0;
+}
+
+
+static bool
+valid_cab(int32_t cab)
+{
+    return cab > 0 && cab <= DCC_MAX_ADDRESS;
+}
+
+
+/* <t REGISTER CAB SPEED DIRECTION>, replying <T REGISTER SPEED DIRECTION>.
+ * The register is only echoed back. Trains are driven with 128 speed steps,
+ * and a speed of -1 sends the train an emergency stop. */
+static bool
+run_throttle(const int32_t *args, uint8_t nargs)
+{
+    if (!valid_cab(args[1]) || args[2] < -1 || args[2] > DCC_MAX_SPEED ||
+        args[3] < 0 || args[3] > 1)
+        return false;
+
+    dcc_set_speed_steps(args[1], DCC_SPEED_STEPS_128);
+    if (args[2] < 0)
+        dcc_stop_train(args[1], args[3]);
+    else
+        dcc_set_speed(args[1], args[2], args[3]);
+
+    reply_str("<T ");
+    reply_int(args[0]);
+    reply_str(" ");
+    reply_int(args[2]);
+    reply_str(" ");
+    reply_int(args[3]);
+    reply_str(">");
+    reply_send();
+
+    return true;
+}
+
+
+/* <f CAB BYTE1 [BYTE2]> */
+static bool
+run_function(const int32_t *args, uint8_t nargs)
+{
+    const dccpp_function_group_t *g;
+    uint8_t bits, i;
+
+    if (!valid_cab(args[0]) || args[1] < 0 || args[1] > 0xff ||
+        args[nargs - 1] < 0 || args[nargs - 1] > 0xff)
+        return false;
+
+    for (g = function_groups; g < &function_groups[N_FUNCTION_GROUPS]; g++)
+    {
+        if ((args[1] & g->mask) != g->value || nargs != g->nargs)
+            continue;
+
+        bits = args[nargs - 1];
+        for (i = 0; i < g->count; i++)
+            dcc_set_function(args[0], g->first + i, (bits >> i) & 1);
+
+        if (g->first == 1)
+            dcc_set_function(args[0], 0, (bits >> 4) & 1);
+
+        return true;
+    }
+
+    return false;
+}
+
+
+/* <a ADDRESS SUBADDRESS ACTIVATE> */
+static bool
+run_accessory(const int32_t *args, uint8_t nargs)
+{
+    if (args[0] < 0 || args[0] > DCC_MAX_ACCESSORY || args[1] < 0 ||
+        args[1] > DCC_MAX_ACCESSORY_SUB || args[2] < 0 || args[2] > 1)
+        return false;
+
+    dcc_set_accessory(args[0], args[1], args[2]);
+
+    return true;
+}
+
+
+static void
+reply_power(void)
+{
+    reply_str(dcc_is_e_stopped() ? "<p0>" : "<p1>");
+    reply_send();
+}
+
+
+/* <0> and <1>. The track stays powered, but the emergency stop goes out
+ * until it's turned back on. */
+static bool
+run_power_off(const int32_t *args, uint8_t nargs)
+{
+    dcc_e_stop(true);
+    reply_power();
+
+    return true;
+}
+
+
+static bool
+run_power_on(const int32_t *args, uint8_t nargs)
+{
+    dcc_e_stop(false);
+    reply_power();
+
+    return true;
+}
+
+
+/* <s> */
+static bool
+run_status(const int32_t *args, uint8_t nargs)
+{
+    reply_power();
+    reply_str("<iDCC++ DCC CONTROLLER / STM32F103RB>");
+    reply_send();
+
+    return true;
+}
+
+
+static const dccpp_command_t commands[] =
+{
+    { 't', 4, 4, run_throttle },
+    { 'f', 2, 3, run_function },
+    { 'a', 3, 3, run_accessory },
+    { '0', 0, 0, run_power_off },
+    { '1', 0, 0, run_power_on },
+    { 's', 0, 0, run_status },
+};
+
+#define N_COMMANDS (sizeof(commands) / sizeof(commands[0]))
+
+
+static bool
+run_command(void)
+{
+    const dccpp_command_t *c;
+
+    for (c = commands; c < &commands[N_COMMANDS]; c++)
+    {
+        if (c->opcode == parser.opcode)
+        {
+            return parser.nargs >= c->min_args &&
+                parser.nargs <= c->max_args &&
+                c->run(parser.args, parser.nargs);
+        }
+    }
+
+    return false;
+}
+
+
+static bool
+start_number(int8_t sign)
+{
+    if (parser.nargs == DCCPP_MAX_ARGS)
+        return false;
+
+    parser.args[parser.nargs++] = 0;
+    parser.sign = sign;
+
+    return true;
+}
+
+
+static bool
+add_digit(uint8_t digit)
+{
+    int32_t *arg;
+
+    if (parser.state == STATE_ARGS && !start_number(1))
+        return false;
+
+    arg = &parser.args[parser.nargs - 1];
+    *arg = *arg * 10 + parser.sign * digit;
+
+    return *arg <= MAX_NUMBER && *arg >= -MAX_NUMBER;
+}
+
+
+static void
+parse_char(uint8_t c)
+{
+    const dccpp_transition_t *t;
+    bool ok = true;
+
+    t = &transitions[parser.state][c < 0x80 ? char_class[c] : CHAR_OTHER];
+
+    switch (t->action)
+    {
+    case ACT_BEGIN:
+        parser.nargs = 0;
+        break;
+
+    case ACT_OPCODE:
+        parser.opcode = c;
+        break;
+
+    case ACT_SIGN:
+        ok = start_number(-1);
+        break;
+
+    case ACT_DIGIT:
+        ok = add_digit(c - '0');
+        break;
+
+    case ACT_RUN:
+        ok = run_command();
+        if (ok)
+            stats.commands++;
+        break;
+
+    case ACT_BAD:
+        ok = false;
+        break;
+
+    default:
+        break;
+    }
+
+    if (ok)
+    {
+        parser.state = t->next;
+        return;
+    }
+
+    stats.bad_commands++;
+    LOG("dccpp: bad command <%c>", parser.opcode);
+
+    parser.state = t->next == STATE_IDLE ? STATE_IDLE : STATE_SKIP;
+}
+
+
+void
+dccpp_poll(ringbuf_t *rx, dccpp_reply_t reply)
+{
+    uint8_t *data;
+    size_t len, i;
+
+    reply_to = reply;
+
+    /* Parse in place, a run of the ring at a time */
+    for (;;)
+    {
+        data = ringbuf_peek(rx, &len);
+        if (len == 0)
+            break;
+
+        for (i = 0; i < len; i++)
+            parse_char(data[i]);
+
+        ringbuf_consume(rx, len);
+    }
+}
+
+
+void
+dccpp_get_stats(dccpp_stats_t *out)
+{
+    *out = stats;
+}
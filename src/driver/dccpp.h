@@ -0,0 +1,75 @@
+#ifndef _DCCPP_H
+#define _DCCPP_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ringbuf.h"
+
+
+/*
+ * DCC++ text commands, as sent by JMRI and other PC programs, in place of
+ * the binary protocol in cmd.h. Build with CMD_DCCPP=1 to take them on
+ * USART1. These commands are understood:
+ *
+ *   <t REGISTER CAB SPEED DIRECTION>   speed 0-126, or -1 for an e-stop
+ *   <f CAB BYTE1 [BYTE2]>              a function group, as in DCC++
+ *   <a ADDRESS SUBADDRESS ACTIVATE>    an accessory decoder output
+ *   <0>, <1>                           emergency stop on and off
+ *   <s>                                report the state
+ *
+ * Commands are parsed a character at a time straight out of the receive
+ * ring, so one can arrive over any number of reads. Anything outside
+ * < and > is ignored, and a < part way through a command starts again.
+ */
+
+
+/* Take DCC++ text commands rather than the binary protocol, e.g. make
+ * CMD_DCCPP=1 */
+#ifndef CMD_DCCPP
+#define CMD_DCCPP (0)
+#endif
+
+
+/* Most numbers a command can carry */
+#define DCCPP_MAX_ARGS (4)
+
+
+/**
+ * Where replies to the PC go, e.g. <T 1 60 1> for a speed
+ */
+typedef void (*dccpp_reply_t)(const char *text, size_t len);
+
+
+/**
+ * Commands carried out, and commands dropped for being malformed or
+ * unknown
+ */
+typedef struct
+{
+    uint32_t commands;
+    uint32_t bad_commands;
+} dccpp_stats_t;
+
+
+/**
+ * Carry out the commands in the receive ring, consuming everything read.
+ * A command that isn't complete yet is kept for the next call. Call from
+ * the main loop.
+ * \param rx the ring the commands arrive in
+ * \param reply where replies are sent, or NULL to drop them
+ */
+extern void
+dccpp_poll(ringbuf_t *rx, dccpp_reply_t reply);
+
+
+/**
+ * Get the number of commands handled so far
+ * \param stats filled with the counts
+ */
+extern void
+dccpp_get_stats(dccpp_stats_t *stats);
+
+
+#endif /* _DCCPP_H */
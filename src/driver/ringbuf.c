@@ -1,78 +1,166 @@
 #include "ringbuf.h"
 
-#define min(a, b) a > b ? b : a
+#include <string.h>
 
-void ringbuf_init(ringbuf_t *ringbuf, volatile uint8_t *buf, size_t size) {
+#define min(a, b) ((a) > (b) ? (b) : (a))
+
+/* Each index is only ever written by one side: head by the producer and
+ * tail by the consumer. A side publishes its index with a release store once
+ * it has finished with the data, and reads the other side's index with an
+ * acquire load before touching the data. The indices run freely and are
+ * masked when used, so head - tail is always the number of bytes held. */
+#define load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define load_relaxed(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+bool ringbuf_init(ringbuf_t *ringbuf, uint8_t *buf, size_t size) {
+  bool ok = size != 0 && (size & (size - 1)) == 0;
+
+  /* A ring of the wrong size is left with no room at all, as the mask of
+   * zero capacity, rather than quietly losing part of the buffer */
   ringbuf->buffer = buf;
-  ringbuf->capacity = size;
-  ringbuf->length = 0;
+  ringbuf->mask = ok ? size - 1 : (size_t)-1;
   ringbuf->head = 0;
   ringbuf->tail = 0;
+
+  return ok;
 }
 
 size_t ringbuf_write(ringbuf_t *ringbuf, uint8_t *data, size_t len) {
-  uint16_t freespace;
-
-  /* Calculate how much space there is in the buffer */
-  freespace = ringbuf->capacity - ringbuf->length;
+  size_t head = load_relaxed(&ringbuf->head);
+  size_t tail = load_acquire(&ringbuf->tail);
+  size_t capacity = ringbuf->mask + 1;
+  size_t offset = head & ringbuf->mask;
+  size_t first;
 
   /* Constrain length to the space in the buffer */
-  len = min(len, freespace);
-
-  /* Copy the data into the buffer */
-  for (int i = 0; i < len; i++) {
-    ringbuf->buffer[ringbuf->head] = data[i];
-    ringbuf->head = (ringbuf->head + 1) % ringbuf->capacity;
+  len = min(len, capacity - (head - tail));
+
+  /* A single byte, as written by the UART interrupts, can't wrap.
+   * Otherwise copy up to the end of the buffer, then wrap around to the
+   * start. */
+  if (len == 1) {
+    ringbuf->buffer[offset] = *data;
+  } else {
+    first = min(len, capacity - offset);
+    memcpy(&ringbuf->buffer[offset], data, first);
+    memcpy(ringbuf->buffer, &data[first], len - first);
   }
 
-  /* Update the buffer length */
-  ringbuf->length += len;
-  
+  /* Publish the data */
+  store_release(&ringbuf->head, head + len);
+
   return len;
 }
 
 size_t ringbuf_read(ringbuf_t *ringbuf, uint8_t *data, size_t len) {
-  /* Can't read from an empty buffer */
-  if (!ringbuf_has_data(ringbuf))
-    return 0;
+  size_t tail = load_relaxed(&ringbuf->tail);
+  size_t head = load_acquire(&ringbuf->head);
+  size_t capacity = ringbuf->mask + 1;
+  size_t offset = tail & ringbuf->mask;
+  size_t first;
 
   /* Calculate how many bytes we can read */
-  len = min(len, ringbuf->length);
-
-  /* Copy data from the buffer */
-  for (int i = 0; i < len; i++) {
-    data[i] = ringbuf->buffer[ringbuf->tail];
-    ringbuf->tail = (ringbuf->tail + 1) % ringbuf->capacity;
+  len = min(len, head - tail);
+
+  /* As for writes, a single byte is copied on its own */
+  if (len == 1) {
+    *data = ringbuf->buffer[offset];
+  } else {
+    first = min(len, capacity - offset);
+    memcpy(data, &ringbuf->buffer[offset], first);
+    memcpy(&data[first], ringbuf->buffer, len - first);
   }
 
-  /* Update the buffer length */
-  ringbuf->length -= len;
+  /* Hand the space back to the producer */
+  store_release(&ringbuf->tail, tail + len);
 
   return len;
 }
 
+uint8_t *ringbuf_reserve(ringbuf_t *ringbuf, size_t *len) {
+  size_t head = load_relaxed(&ringbuf->head);
+  size_t tail = load_acquire(&ringbuf->tail);
+  size_t capacity = ringbuf->mask + 1;
+  size_t offset = head & ringbuf->mask;
+
+  /* Free space up to the end of the buffer */
+  *len = min(capacity - (head - tail), capacity - offset);
+
+  return &ringbuf->buffer[offset];
+}
+
+void ringbuf_commit(ringbuf_t *ringbuf, size_t len) {
+  store_release(&ringbuf->head, load_relaxed(&ringbuf->head) + len);
+}
+
+uint8_t *ringbuf_peek(ringbuf_t *ringbuf, size_t *len) {
+  size_t tail = load_relaxed(&ringbuf->tail);
+  size_t head = load_acquire(&ringbuf->head);
+  size_t capacity = ringbuf->mask + 1;
+  size_t offset = tail & ringbuf->mask;
+
+  /* Data up to the end of the buffer */
+  *len = min(head - tail, capacity - offset);
+
+  return &ringbuf->buffer[offset];
+}
+
+uint8_t ringbuf_get_byte(ringbuf_t *ringbuf, size_t offset) {
+  return ringbuf->buffer[(load_relaxed(&ringbuf->tail) + offset) &
+                         ringbuf->mask];
+}
+
+bool ringbuf_find(ringbuf_t *ringbuf, size_t *offset, uint8_t value) {
+  size_t tail = load_relaxed(&ringbuf->tail);
+  size_t len = load_acquire(&ringbuf->head) - tail;
+  size_t capacity = ringbuf->mask + 1;
+  size_t start, run;
+  uint8_t *match;
+
+  /* Search up to the end of the buffer, then wrap around to the start */
+  while (*offset < len) {
+    start = (tail + *offset) & ringbuf->mask;
+    run = min(len - *offset, capacity - start);
+
+    match = memchr(&ringbuf->buffer[start], value, run);
+    if (match != NULL) {
+      *offset += match - &ringbuf->buffer[start];
+      return true;
+    }
+
+    *offset += run;
+  }
+
+  *offset = len;
+  return false;
+}
+
+void ringbuf_consume(ringbuf_t *ringbuf, size_t len) {
+  store_release(&ringbuf->tail, load_relaxed(&ringbuf->tail) + len);
+}
+
 void ringbuf_flush(ringbuf_t *ringbuf) {
-  ringbuf->head = 0;
-  ringbuf->tail = 0;
-  ringbuf->length = 0;
-  ringbuf->buffer[0] = 0;
+  store_release(&ringbuf->tail, load_acquire(&ringbuf->head));
 }
 
 
 size_t ringbuf_get_len(ringbuf_t *ringbuf) {
-  return ringbuf->length;
+  size_t tail = load_acquire(&ringbuf->tail);
+
+  return load_acquire(&ringbuf->head) - tail;
 }
 
 
 size_t
 ringbuf_get_space(ringbuf_t *ringbuf)
 {
-    return ringbuf->capacity - ringbuf->length;
+    return ringbuf->mask + 1 - ringbuf_get_len(ringbuf);
 }
 
 
 bool ringbuf_has_data(ringbuf_t * ringbuf) {
-  if (ringbuf->length)
+  if (ringbuf_get_len(ringbuf))
     return true;
 
   return false;
@@ -82,18 +170,19 @@ bool ringbuf_has_data(ringbuf_t * ringbuf) {
 uint32_t
 ringbuf_pop(ringbuf_t *ringbuf, uint8_t *data)
 {
+    size_t tail = load_relaxed(&ringbuf->tail);
+
     /* Can't read from an empty buffer */
-    if (!ringbuf_has_data(ringbuf))
+    if (load_acquire(&ringbuf->head) == tail)
     {
         return 0;
     }
 
     /* Copy data from the buffer */
-    *data = ringbuf->buffer[ringbuf->tail];
-    ringbuf->tail = (ringbuf->tail + 1) % ringbuf->capacity;
+    *data = ringbuf->buffer[tail & ringbuf->mask];
 
-    /* Update the buffer length */
-    ringbuf->length--;
+    /* Hand the space back to the producer */
+    store_release(&ringbuf->tail, tail + 1);
 
     return 1;
 }
@@ -5,20 +5,29 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+/**
+ * A single producer, single consumer ring buffer. One context (e.g. thread
+ * code) may write while another (e.g. an ISR) reads, without locking.
+ * ringbuf_write, ringbuf_reserve and ringbuf_commit are the producer side.
+ * ringbuf_read, ringbuf_pop, ringbuf_peek, ringbuf_get_byte, ringbuf_find,
+ * ringbuf_consume and ringbuf_flush are the consumer side.
+ */
 typedef struct ringbuf_t {
-  volatile uint8_t *buffer;
-  volatile size_t head;
-  volatile size_t tail;
-  volatile size_t length;
-  size_t capacity;
+  uint8_t *buffer;
+  size_t head;  /* Only written by the producer */
+  size_t tail;  /* Only written by the consumer */
+  size_t mask;  /* Capacity - 1, the capacity is a power of two */
 } ringbuf_t;
 
 /**
  * Initialises a ring buffer
  * @param buf A block of memory to use
- * @param size The size in octets of the buffer
+ * @param size The size in octets of the buffer, which must be a power of
+ * two
+ * @returns True if the size was valid. If not, the ring has no room and
+ * every write fails.
  */
-extern void ringbuf_init(ringbuf_t *ringbuf, volatile uint8_t *buf, size_t size);
+extern bool ringbuf_init(ringbuf_t *ringbuf, uint8_t *buf, size_t size);
 
 /**
  * Write data into ring buffer
@@ -40,7 +49,68 @@ extern size_t ringbuf_write(ringbuf_t *ringbuf, uint8_t *data, size_t len);
 extern size_t ringbuf_read(ringbuf_t *ringbuf, uint8_t *data, size_t len);
 
 /**
- * Flush all data from the ring buffer
+ * Get a contiguous block of free space to build data in place. Nothing is
+ * visible to the consumer until it is committed.
+ * @param ringbuf The buffer to write into
+ * @param len Set to the number of octets available at the returned address.
+ * This is less than the free space when the free space wraps around.
+ * @returns The address to write to
+ */
+extern uint8_t *ringbuf_reserve(ringbuf_t *ringbuf, size_t *len);
+
+
+/**
+ * Publish data written into the space given by ringbuf_reserve
+ * @param ringbuf The buffer written into
+ * @param len The number of octets to publish
+ */
+extern void ringbuf_commit(ringbuf_t *ringbuf, size_t len);
+
+
+/**
+ * Get a contiguous block of data to read in place. The data stays in the
+ * buffer until it is consumed.
+ * @param ringbuf The buffer to read from
+ * @param len Set to the number of octets available at the returned address.
+ * This is less than the buffer length when the data wraps around.
+ * @returns The address to read from
+ */
+extern uint8_t *ringbuf_peek(ringbuf_t *ringbuf, size_t *len);
+
+
+/**
+ * Read a byte in place without consuming it
+ * @param ringbuf The buffer to read from
+ * @param offset How far the byte is from the front of the buffer. This must
+ * be less than ringbuf_get_len.
+ * @returns The byte
+ */
+extern uint8_t ringbuf_get_byte(ringbuf_t *ringbuf, size_t offset);
+
+
+/**
+ * Search the data in the buffer for a byte, without consuming anything
+ * @param ringbuf The buffer to search
+ * @param offset How far from the front of the buffer to start. Set to the
+ * offset of the match, or to the length of the data searched if there
+ * isn't one.
+ * @param value The byte to look for
+ * @returns True if the byte was found
+ */
+extern bool ringbuf_find(ringbuf_t *ringbuf, size_t *offset, uint8_t value);
+
+
+/**
+ * Drop data from the front of the buffer once it has been read in place
+ * @param ringbuf The buffer read from
+ * @param len The number of octets to drop
+ */
+extern void ringbuf_consume(ringbuf_t *ringbuf, size_t len);
+
+
+/**
+ * Flush all data from the ring buffer. This is a read, so it must be called
+ * from the consumer side.
  * @param ringbuf The buffer to flush */
 extern void ringbuf_flush(ringbuf_t *ringbuf);
 
@@ -1,6 +1,12 @@
 #include "dcc_hal.h"
+#include "dcc_hal_priv.h"
+
+#include <string.h>
 
 #include "ringbuf.h"
+#include "systick.h"
+#include "prof.h"
+#include "log.h"
 
 
 /* Dead time to allow transistors in the H bridge to switch off completely
@@ -8,43 +14,98 @@
 #define DEAD_TIME (10)
 
 
-/* Data buffer */
-#define BUF_SIZE (256)
+/* Packet queue. Each packet takes a fixed size slot in the ring buffer: a
+ * length byte followed by up to DCC_HAL_MAX_PACKET bytes, with the packet id
+ * in the last byte. The slots are
+ * always committed and consumed whole, so the ISR never sees part of a
+ * packet. The buffer holds a whole number of slots, so a slot never wraps
+ * around and packets can be built and sent in place. */
+#define SLOT_SIZE (8)
+#define SLOT_ID (SLOT_SIZE - 1)
+#define BUF_SIZE (32 * SLOT_SIZE)
 static uint8_t data[BUF_SIZE];
 static ringbuf_t buf;
 
 
+/* Finished packets, written by the ISR and read by dcc_hal_get_completion.
+ * Like the packet queue, each takes a slot that never wraps. */
+#define DONE_SLOT_SIZE (16)
+#define DONE_BUF_SIZE (DCC_HAL_COMPLETIONS * DONE_SLOT_SIZE)
+static uint8_t done_data[DONE_BUF_SIZE];
+static ringbuf_t done_buf;
+
+
 /*
- * ISR state variables
+ * Bit source state. The packet being sent is copied out of its slot, which
+ * is freed as soon as it's taken from the queue. The DMA encoder plays half
+ * bits, so it gets the packet expanded into half bit symbols, and tx_len
+ * and tx_pos count those. The others take a bit at a time from the bytes,
+ * and tx_len and tx_pos count bytes. tx_len is zero while the preamble is
+ * sent.
  */
-bool output_state = false;
-bool transmitting = false;
-int8_t bit_shift;
-uint16_t byte;
-uint8_t irq_count;
+#if DCC_HAL_USES_HALF_BITS
+static uint32_t tx_half_bits[DCC_HAL_HALF_BIT_WORDS];
+static bool tx_idle_half;       /* The second half of a one is next */
+#else
+static uint8_t tx_packet[DCC_HAL_MAX_PACKET];
+static uint8_t tx_byte;
+static uint8_t tx_shift;        /* Bits of tx_byte still to send */
+#endif
+static volatile uint8_t tx_len;
+static uint8_t tx_pos;
+static uint8_t tx_ones;
+static dcc_hal_stats_t tx_stats;
 
 
-void
-dcc_hal_init(void)
+/* The packet on the wire, and whether its end bit has been taken */
+static dcc_hal_completion_t tx_done;
+static bool tx_ending;
+
+
+/* Sent at every packet boundary instead of the queue while urgent_len is
+ * set */
+static uint8_t urgent_packet[DCC_HAL_MAX_PACKET];
+static volatile uint8_t urgent_len;
+
+
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_DMA)
+#define ENCODER_NAME "dma"
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_VARIABLE)
+#define ENCODER_NAME "variable"
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_TIM1)
+#define ENCODER_NAME "tim1"
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_SPI)
+#define ENCODER_NAME "spi"
+#else
+#define ENCODER_NAME "tick"
+#endif
+
+
+const dcc_hal_backend_t dcc_hal_backend =
+{
+    .name = ENCODER_NAME,
+    .init = dcc_hal_init,
+    .reserve = dcc_hal_reserve,
+    .commit = dcc_hal_commit,
+    .get_pending = dcc_hal_get_pending,
+    .replace = dcc_hal_replace,
+    .flush = dcc_hal_flush,
+    .set_urgent = dcc_hal_set_urgent,
+    .get_completion = dcc_hal_get_completion,
+    .get_stats = dcc_hal_get_stats,
+};
+
+
+#if DCC_HAL_USES_TIM2
+static void
+tick_init(void)
 {
-    GPIO_InitTypeDef gpio_cfg;
     TIM_TimeBaseInitTypeDef tim_cfg;
     NVIC_InitTypeDef nvic_cfg;
 
-    /* Prepare ring buffer */
-    ringbuf_init(&buf, data, BUF_SIZE);
-
-    /* Peripheral clock = HCLK/4, enable GPIO and timer 2 clock */
-    RCC_PCLK1Config(RCC_HCLK_Div4);
-    RCC_APB2PeriphClockCmd(DCC_HAL_GPIO_RCC, ENABLE);
+    /* Enable timer 2 clock */
     RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM2, ENABLE);
 
-    /* Set DCC_PIN_1 and DCC_PIN_2 as outputs */
-    gpio_cfg.GPIO_Pin = DCC_HAL_GPIO_PIN_1 | DCC_HAL_GPIO_PIN_2;
-    gpio_cfg.GPIO_Speed = GPIO_Speed_50MHz;
-    gpio_cfg.GPIO_Mode = GPIO_Mode_Out_PP;
-    GPIO_Init(DCC_HAL_GPIO, &gpio_cfg);
-
     /* Configure a timer to interrupt every 58 microseconds, as per NRMA
      * standard S-91
      *
@@ -53,8 +114,12 @@ dcc_hal_init(void)
      * 58us / 56ns = 1044
      * => Interrupt every 1044 timer ticks
      * => load value = 1043
+     *
+     * The variable period encoder changes the load value as it goes. ARR
+     * isn't preloaded, so a new value applies to the period that has just
+     * started.
      */
-    tim_cfg.TIM_Period = 1043;
+    tim_cfg.TIM_Period = DCC_HAL_ONE_RELOAD;
     tim_cfg.TIM_Prescaler = 1;
     tim_cfg.TIM_ClockDivision = 0;
     tim_cfg.TIM_CounterMode = TIM_CounterMode_Up;
@@ -73,23 +138,380 @@ dcc_hal_init(void)
     /* Enable the timer */
     TIM_Cmd(TIM2, ENABLE);
 }
+#endif
+
+
+void
+dcc_hal_init(void)
+{
+#if DCC_HAL_USES_GPIO
+    GPIO_InitTypeDef gpio_cfg;
+#endif
+
+    /* Prepare ring buffer */
+    ringbuf_init(&buf, data, BUF_SIZE);
+    ringbuf_init(&done_buf, done_data, DONE_BUF_SIZE);
+    memset(&tx_stats, 0, sizeof(tx_stats));
+    tx_ending = false;
+
+    /* Peripheral clock = HCLK/4 */
+    RCC_PCLK1Config(RCC_HCLK_Div4);
+
+#if DCC_HAL_USES_GPIO
+    /* Set DCC_PIN_1 and DCC_PIN_2 as outputs */
+    RCC_APB2PeriphClockCmd(DCC_HAL_GPIO_RCC, ENABLE);
+    gpio_cfg.GPIO_Pin = DCC_HAL_GPIO_PIN_1 | DCC_HAL_GPIO_PIN_2;
+    gpio_cfg.GPIO_Speed = GPIO_Speed_50MHz;
+    gpio_cfg.GPIO_Mode = GPIO_Mode_Out_PP;
+    GPIO_Init(DCC_HAL_GPIO, &gpio_cfg);
+#endif
+
+    /* Start the waveform */
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_DMA)
+    dcc_hal_dma_init();
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_TIM1)
+    dcc_hal_tim1_init();
+#elif (DCC_HAL_ENCODER == DCC_HAL_ENCODER_SPI)
+    dcc_hal_spi_init();
+#else
+    tick_init();
+#endif
+}
 
 
 uint8_t
 dcc_hal_write(uint8_t *data, uint8_t len)
 {
-    printf("writing %d bytes\n", len);
+    uint8_t *packet;
+
+    if (len == 0 || len > DCC_HAL_MAX_PACKET)
+        return 0;
 
-    /* This check is NOT safe, however the length value will only ever go
-     * down. This means the worst case is we fail to write data. */
-    if (ringbuf_get_space(&buf) < len)
+    packet = dcc_hal_reserve();
+    if (packet == NULL)
     {
-        printf("buffer too full!\n");
+        LOG("dcc_hal: queue full, %u bytes dropped", len);
         return 0;
     }
 
-    return (uint8_t)ringbuf_write(&buf, data, len);
+    memcpy(packet, data, len);
+    dcc_hal_commit(len, 0);
+
+    return len;
+}
+
+
+uint8_t *
+dcc_hal_reserve(void)
+{
+    uint8_t *slot;
+    size_t len;
+
+    /* Only the ISR frees space, so if there's room now there'll still be
+     * room when we commit */
+    slot = ringbuf_reserve(&buf, &len);
+    if (len < SLOT_SIZE)
+        return NULL;
+
+    return &slot[1];
+}
+
+
+void
+dcc_hal_commit(uint8_t len, uint8_t id)
+{
+    uint8_t *slot;
+    size_t space;
+
+    if (len == 0 || len > DCC_HAL_MAX_PACKET)
+        return;
+
+    /* This is the same slot that was reserved, as nothing else writes */
+    slot = ringbuf_reserve(&buf, &space);
+    if (space < SLOT_SIZE)
+        return;
+
+    slot[0] = len;
+    slot[SLOT_ID] = id;
+    ringbuf_commit(&buf, SLOT_SIZE);
+}
+
+
+uint8_t
+dcc_hal_get_pending(void)
+{
+    uint8_t pending;
+
+    /* Read the queue first. If the ISR takes a packet in between, it's
+     * counted twice rather than not at all. */
+    pending = (uint8_t)(ringbuf_get_len(&buf) / SLOT_SIZE);
+    if (tx_len != 0)
+        pending++;
+
+    return pending;
+}
+
+
+bool
+dcc_hal_replace(uint8_t id, const uint8_t *packet, uint8_t len)
+{
+    uint8_t *slot;
+    size_t queued, offset;
+    bool replaced = false;
+
+    if (len == 0 || len > DCC_HAL_MAX_PACKET)
+        return false;
+
+    /* The ISR takes a packet by copying it out of its slot and freeing it,
+     * so while it's held off, a slot still in the queue is ours to change */
+    __disable_irq();
+
+    slot = ringbuf_peek(&buf, &queued);
+    queued = ringbuf_get_len(&buf);
+
+    for (offset = 0; offset < queued; offset += SLOT_SIZE, slot += SLOT_SIZE)
+    {
+        /* Slots never wrap, but the run of them does */
+        if (slot == &data[BUF_SIZE])
+            slot = data;
+
+        if (slot[SLOT_ID] == id)
+        {
+            slot[0] = len;
+            memcpy(&slot[1], packet, len);
+            replaced = true;
+            break;
+        }
+    }
+
+    __enable_irq();
+
+    return replaced;
+}
+
+
+void
+dcc_hal_flush(void)
+{
+    /* Only the ISR reads the queue, so keep it out while we do */
+    __disable_irq();
+    ringbuf_flush(&buf);
+    __enable_irq();
+}
+
+
+void
+dcc_hal_set_urgent(const uint8_t *packet, uint8_t len)
+{
+    if (len > DCC_HAL_MAX_PACKET)
+        return;
+
+    /* Nothing queued before the urgent packet may follow it onto the wire,
+     * so the flush and the switch over happen together */
+    __disable_irq();
+
+    if (len > 0)
+    {
+        memcpy(urgent_packet, packet, len);
+        ringbuf_flush(&buf);
+    }
+
+    urgent_len = len;
+
+    __enable_irq();
+}
+
+
+bool
+dcc_hal_get_completion(dcc_hal_completion_t *completion)
+{
+    uint8_t *slot;
+    size_t len;
+
+    slot = ringbuf_peek(&done_buf, &len);
+    if (len < DONE_SLOT_SIZE)
+        return false;
+
+    memcpy(completion, slot, sizeof(dcc_hal_completion_t));
+    ringbuf_consume(&done_buf, DONE_SLOT_SIZE);
+
+    return true;
+}
+
+
+void
+dcc_hal_get_stats(dcc_hal_stats_t *stats)
+{
+    *stats = tx_stats;
+}
+
+
+/* Report the packet that has just finished on the wire */
+static void
+complete_packet(uint32_t lead_us)
+{
+    uint8_t *slot;
+    size_t len;
+
+    tx_done.end_us = systick_get_us() + lead_us;
+    tx_ending = false;
+
+    slot = ringbuf_reserve(&done_buf, &len);
+    if (len < DONE_SLOT_SIZE)
+    {
+        tx_stats.dropped++;
+        return;
+    }
+
+    memcpy(slot, &tx_done, sizeof(tx_done));
+    ringbuf_commit(&done_buf, DONE_SLOT_SIZE);
+}
+
+
+#if DCC_HAL_USES_HALF_BITS
+static void
+load_packet(const uint8_t *packet, uint8_t len)
+{
+    tx_len = dcc_hal_expand_packet(packet, len, tx_half_bits);
+}
+#else
+static void
+load_packet(const uint8_t *packet, uint8_t len)
+{
+    memcpy(tx_packet, packet, len);
+    tx_len = len;
+    tx_shift = 0;
+}
+#endif
+
+
+/* Start the next bit on the wire. Returns true if it's part of a packet, or
+ * false for a one of the preamble or of the idle time between packets. Once
+ * the preamble is out, the next packet is taken from the urgent packet or
+ * the queue. The bit goes onto the wire lead_us from now, which is when the
+ * completion times are stamped for. */
+static bool
+start_bit(uint32_t lead_us)
+{
+    uint8_t *slot;
+    size_t len;
+
+    tx_stats.bits++;
+
+    /* Taking this bit means the end bit of the last packet is done */
+    if (tx_ending)
+        complete_packet(lead_us);
+
+    if (tx_len != 0)
+        return true;
+
+    /* Send the preamble, and keep sending ones while there's nothing to
+     * send */
+    if (tx_ones < DCC_HAL_PREAMBLE_BITS)
+    {
+        tx_ones++;
+        return false;
+    }
+
+    if (urgent_len != 0)
+    {
+        load_packet(urgent_packet, urgent_len);
+        tx_done.id = DCC_HAL_URGENT_ID;
+        tx_stats.urgent++;
+    }
+    else
+    {
+        slot = ringbuf_peek(&buf, &len);
+        if (len < SLOT_SIZE)
+        {
+            tx_stats.idle_bits++;
+            return false;
+        }
+
+        load_packet(&slot[1], slot[0]);
+        tx_done.id = slot[SLOT_ID];
+        ringbuf_consume(&buf, SLOT_SIZE);
+    }
+
+    tx_done.start_us = systick_get_us() + lead_us;
+    tx_pos = 0;
+    tx_stats.packets++;
+
+    return true;
+}
+
+
+/* The end bit of the packet has been taken */
+static void
+end_packet(void)
+{
+    tx_len = 0;
+    tx_ones = 0;
+    tx_ending = true;
+}
+
+
+#if DCC_HAL_USES_HALF_BITS
+bool
+dcc_hal_next_half_bit(uint32_t lead_us)
+{
+    bool half;
+
+    if (tx_idle_half)
+    {
+        tx_idle_half = false;
+        return true;
+    }
+
+    /* Every bit starts on an even half bit */
+    if ((tx_pos & 1) == 0 && !start_bit(lead_us))
+    {
+        tx_idle_half = true;
+        return true;
+    }
+
+    half = DCC_HAL_HALF_BIT(tx_half_bits, tx_pos);
+
+    if (++tx_pos == tx_len)
+        end_packet();
+
+    return half;
 }
+#else
+bool
+dcc_hal_next_bit(uint32_t lead_us)
+{
+    if (!start_bit(lead_us))
+        return true;
+
+    /* A start bit goes before each byte, and the end bit after the last */
+    if (tx_shift == 0)
+    {
+        if (tx_pos < tx_len)
+        {
+            tx_byte = tx_packet[tx_pos++];
+            tx_shift = 8;
+            return false;
+        }
+
+        end_packet();
+        return true;
+    }
+
+    tx_shift--;
+
+    return (tx_byte >> tx_shift) & 1;
+}
+#endif
+
+
+#if DCC_HAL_USES_TIM2
+/*
+ * ISR state variables
+ */
+static bool output_state = false;
+static bool second_half = false;
+static bool bit_value;
 
 
 static void
@@ -121,78 +543,68 @@ set_output(bool output_state)
 }
 
 
+/* Move on to the next half bit. The first half of each bit is low. */
+static void
+next_half_bit(void)
+{
+    /* Both halves of a bit are the same length, so we only need a new bit
+     * at the start of the first half */
+    if (!second_half)
+        bit_value = dcc_hal_next_bit(0);
+
+    output_state = second_half;
+    second_half = !second_half;
+
+    GPIO_WriteBit(GPIOB, GPIO_Pin_9, tx_len ? Bit_RESET : Bit_SET);
+
+    set_output(output_state);
+}
+
+
+/* Core clock cycles per TIM2 count, for profiling */
+#define CYCLES_PER_TICK (4)
+
+
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_VARIABLE)
 void
 TIM2_IRQHandler(void)
 {
-    int bit;
+    PROF_START();
+    PROF_SAMPLE(PROF_TIM2_LATENCY, TIM_GetCounter(TIM2) * CYCLES_PER_TICK);
 
     TIM_ClearITPendingBit(TIM2, TIM_IT_Update);
 
-    irq_count++;
-    if (irq_count > 254)
-        irq_count = 254;
+    next_half_bit();
 
-    /* If we're not transmitting, figure out if we should be */
-    if (!transmitting)
-    {
-        if (ringbuf_has_data(&buf) && irq_count > 15)
-        {
-            /* Get ready for the new transfer */
-            transmitting = true;
-            irq_count = 0;
-            bit_shift = 8;
-            /* The 9th bit will always be zero, which gets us an easy way
-             * to send the inter-byte zero */
-            ringbuf_pop(&buf, (uint8_t *)&byte);
-        }
-        else
-        {
-            /* Keep sending preamble */
-            output_state = !output_state;
-        }
-    }
+    TIM_SetAutoreload(TIM2, bit_value ? DCC_HAL_ONE_RELOAD :
+                                        DCC_HAL_ZERO_RELOAD);
 
-    GPIO_WriteBit(GPIOB, GPIO_Pin_9, transmitting ? Bit_RESET : Bit_SET);
+    PROF_END(PROF_TIM2);
+}
+#else
+static uint8_t irq_count;
 
-    /* Figure out the output state */
-    if (transmitting)
-    {
-        bit = ((1 << bit_shift) & byte) >> bit_shift;
 
-        if (irq_count == 1)
-        {
-            output_state = false;
-        }
-        else if (bit)
-        {
-            if (irq_count == 2)
-            {
-                output_state = true;
-                irq_count = 0;
-                bit_shift--;
-            }
-        }
-        else
-        {
-            if (irq_count == 3)
-            {
-                output_state = true;
-            }
-            else if (irq_count == 4)
-            {
-                irq_count = 0;
-                bit_shift--;
-            }
-        }
+void
+TIM2_IRQHandler(void)
+{
+    PROF_START();
+    PROF_SAMPLE(PROF_TIM2_LATENCY, TIM_GetCounter(TIM2) * CYCLES_PER_TICK);
 
-        /* If we've reached the end of the byte, then set the state so we
-         * prepare the next byte */
-        if (bit_shift < 0)
-        {
-            transmitting = false;
-            irq_count = ringbuf_has_data(&buf) ? 15 : 0;
-        }
+    TIM_ClearITPendingBit(TIM2, TIM_IT_Update);
+
+    /* A one half bit lasts for one tick, and a zero half bit for two */
+    if (irq_count > 0)
+    {
+        irq_count--;
+    }
+    else
+    {
+        next_half_bit();
+        irq_count = bit_value ? 0 : 1;
     }
 
-    set_output(output_state);
+    PROF_END(PROF_TIM2);
 }
+#endif /* DCC_HAL_ENCODER_VARIABLE */
+#endif
@@ -17,6 +17,132 @@
 #define DCC_HAL_GPIO_PIN_2   (GPIO_Pin_10)
 
 
+/*
+ * Waveform encoders. DCC_HAL_ENCODER selects one at build time.
+ *
+ * TICK:     TIM2 interrupts every 58us and the ISR drives the pins
+ * DMA:      TIM3 reload values and pin writes are fed by DMA, and the CPU
+ *           only runs to refill the buffer of half bit durations
+ * VARIABLE: TIM2 interrupts once per half bit, and the ISR reloads it with
+ *           the length of the next one. The ISR switches the pins, so
+ *           this is the fewest interrupts TIM2 can manage: about 28%
+ *           fewer than TICK on typical packets.
+ * TIM1:     TIM1 drives the H bridge from a complementary output pair with
+ *           hardware dead time, and interrupts once per bit. This uses its
+ *           own pins, see dcc_hal_tim1.c.
+ * SPI:      SPI1 shifts the waveform out of a single pin, fed by DMA, and
+ *           the CPU only runs to refill the buffer. See dcc_hal_spi.c.
+ *
+ * The other encoders drive DCC_HAL_GPIO_PIN_1 and DCC_HAL_GPIO_PIN_2 as
+ * plain GPIO.
+ */
+#define DCC_HAL_ENCODER_TICK     (0)
+#define DCC_HAL_ENCODER_DMA      (1)
+#define DCC_HAL_ENCODER_VARIABLE (2)
+#define DCC_HAL_ENCODER_TIM1     (3)
+#define DCC_HAL_ENCODER_SPI      (4)
+
+#ifndef DCC_HAL_ENCODER
+#define DCC_HAL_ENCODER          (DCC_HAL_ENCODER_TICK)
+#endif
+
+
+/* Longest packet that can be queued, including the address and checksum
+ * bytes */
+#define DCC_HAL_MAX_PACKET (6)
+
+
+/* Number of one bits before each packet, as per NMRA standard S-9.2. This
+ * doesn't include the end bit of the previous packet. */
+#define DCC_HAL_PREAMBLE_BITS (14)
+
+
+/* Length of a packet on the wire in bits, given its length in octets. Each
+ * octet has a start bit, and there's a single end bit. */
+#define DCC_HAL_PACKET_BITS(len) (DCC_HAL_PREAMBLE_BITS + (len) * 9 + 1)
+
+
+/* Number of finished packets held until they're read */
+#define DCC_HAL_COMPLETIONS (16)
+
+
+/**
+ * What has gone out on the wire. Each count is updated by the encoder
+ * interrupt and read on its own.
+ */
+typedef struct
+{
+    uint32_t packets;   /**< Packets taken off the queue */
+    uint32_t bits;      /**< Bits sent, including preambles and idle */
+    uint32_t idle_bits; /**< Ones sent past the preamble with nothing queued */
+    uint32_t urgent;    /**< Urgent packets sent, out of all the packets */
+    uint32_t dropped;   /**< Completions lost because none were read */
+} dcc_hal_stats_t;
+
+
+/* Packet id reported for the urgent packet, which isn't given one. Ids for
+ * queued packets should be kept below this. */
+#define DCC_HAL_URGENT_ID (0xff)
+
+
+/**
+ * A packet that has finished on the wire. The times are from systick_get_us,
+ * for when the first start bit of the packet and the bit after its end bit
+ * go onto the wire. The TICK and VARIABLE encoders take each bit as it goes
+ * out. The others take bits ahead of the wire, by a bit for TIM1 and by up
+ * to a buffer for DMA and SPI, and move the times on by however far ahead
+ * they are.
+ */
+typedef struct
+{
+    uint32_t start_us;
+    uint32_t end_us;
+    uint8_t id;         /**< As given to dcc_hal_commit */
+} dcc_hal_completion_t;
+
+
+/**
+ * An output backend. The DCC driver only talks to the backend through this
+ * table, so the same scheduler can drive any of the encoders below, or a
+ * model of the wire in the host simulator.
+ */
+typedef struct
+{
+    const char *name;
+
+    /** Start the backend, sending idle until a packet is queued */
+    void (*init)(void);
+
+    /** As dcc_hal_reserve */
+    uint8_t *(*reserve)(void);
+
+    /** As dcc_hal_commit */
+    void (*commit)(uint8_t len, uint8_t id);
+
+    /** As dcc_hal_get_pending */
+    uint8_t (*get_pending)(void);
+
+    /** As dcc_hal_replace */
+    bool (*replace)(uint8_t id, const uint8_t *packet, uint8_t len);
+
+    /** As dcc_hal_flush */
+    void (*flush)(void);
+
+    /** As dcc_hal_set_urgent */
+    void (*set_urgent)(const uint8_t *packet, uint8_t len);
+
+    /** As dcc_hal_get_completion */
+    bool (*get_completion)(dcc_hal_completion_t *completion);
+
+    /** As dcc_hal_get_stats */
+    void (*get_stats)(dcc_hal_stats_t *stats);
+} dcc_hal_backend_t;
+
+
+/* The backend built from the functions below, using DCC_HAL_ENCODER */
+extern const dcc_hal_backend_t dcc_hal_backend;
+
+
 /**
  * Initialises the DCC low level driver
  */
@@ -25,13 +151,97 @@ dcc_hal_init(void);
 
 
 /**
- * Writes the data out the DCC port
- * \param data memory buffer holding the data to write
- * \param len the number of octets to write
- * \return the number of octets written
+ * Queues a packet to be written out the DCC port. The preamble, start bits
+ * and end bit are added by the driver.
+ * \param data memory buffer holding the packet, including the checksum
+ * \param len the number of octets in the packet, at most DCC_HAL_MAX_PACKET
+ * \return the number of octets queued, which is 0 if the packet didn't fit
  */
 extern uint8_t
 dcc_hal_write(uint8_t *data, uint8_t len);
 
 
+/**
+ * Get space in the transmit queue to build the next packet in place. Call
+ * dcc_hal_commit to send it.
+ * \return memory for up to DCC_HAL_MAX_PACKET octets, or NULL if the queue
+ * is full
+ */
+extern uint8_t *
+dcc_hal_reserve(void);
+
+
+/**
+ * Queue the packet built in the space given by dcc_hal_reserve. The
+ * preamble, start bits and end bit are added by the driver.
+ * \param len the number of octets in the packet, including the checksum
+ * \param id reported back with the packet once it has gone out, see
+ * dcc_hal_get_completion
+ */
+extern void
+dcc_hal_commit(uint8_t len, uint8_t id);
+
+
+/**
+ * Get the number of packets in the transmit queue
+ * \return the number of packets, including the one being sent
+ */
+extern uint8_t
+dcc_hal_get_pending(void);
+
+
+/**
+ * Overwrite a queued packet, if it hasn't started on the wire yet. This
+ * lets a newer packet for the same decoder take the old one's place rather
+ * than queueing behind it. The packet keeps its place and its id.
+ * \param id the id the packet was committed with
+ * \param packet the new packet, including the checksum
+ * \param len the number of octets in the packet
+ * \return true if the packet was overwritten, false if no packet with the
+ * id is waiting
+ */
+extern bool
+dcc_hal_replace(uint8_t id, const uint8_t *packet, uint8_t len);
+
+
+/**
+ * Drop every packet that is queued but hasn't started on the wire. The
+ * packet being sent is finished first.
+ */
+extern void
+dcc_hal_flush(void);
+
+
+/**
+ * Send a packet over and over, back to back, ahead of anything queued. The
+ * queue is flushed as it's set, and the packet goes out from the next
+ * packet boundary until it's cleared.
+ * \param packet the packet to send, including the checksum
+ * \param len the number of octets in the packet, or 0 to clear it and go
+ * back to the queue
+ */
+extern void
+dcc_hal_set_urgent(const uint8_t *packet, uint8_t len);
+
+
+/**
+ * Get the next packet to finish on the wire, oldest first. Packets that are
+ * flushed never finish, and if completions aren't read they're dropped once
+ * DCC_HAL_COMPLETIONS are waiting.
+ * \param completion filled in with the packet id and its times
+ * \return true if there was one, false if nothing has finished since the
+ * last call
+ */
+extern bool
+dcc_hal_get_completion(dcc_hal_completion_t *completion);
+
+
+/**
+ * Get the counts of what has been sent since dcc_hal_init
+ * \param stats filled in with the counts
+ */
+extern void
+dcc_hal_get_stats(dcc_hal_stats_t *stats);
+
+
 #endif /* _DCC_HAL_H */
@@ -0,0 +1,182 @@
+#include "dcc_hal.h"
+#include "dcc_hal_priv.h"
+
+#include "prof.h"
+
+
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_DMA)
+
+/*
+ * The waveform is generated without the CPU touching the pins. TIM3 runs one
+ * period per half bit, and three DMA channels are triggered from it:
+ *
+ * TIM3_UP  (DMA1 channel 3) loads the next half bit duration into ARR
+ * TIM3_CH3 (DMA1 channel 2) switches both legs of the H bridge off at the
+ *                           start of each half bit
+ * TIM3_CH1 (DMA1 channel 6) switches the next leg on once the dead time has
+ *                           passed
+ *
+ * TIM2 isn't used as its DMA requests share channels with the ADC and
+ * USART1 RX. The only interrupts are the half and full transfer interrupts
+ * on channel 3, which refill the half of the duration buffer that has just
+ * been played.
+ */
+
+
+/* Dead time to allow transistors in the H bridge to switch off completely
+ * before the next set is switched on. 18 ticks = 1us */
+#define DEAD_TICKS (18)
+
+
+/* Number of half bits in the duration buffer. The stop packet can only go
+ * out after what has already been filled, so this is kept short enough for
+ * it to reach the rail within 10ms of the button. */
+#define RELOAD_BUF_LEN (32)
+
+
+/* ARR is preloaded. The value written at the end of one half bit is moved
+ * into the shadow register at the end of the next, so the first two periods
+ * use the initial value and the buffer starts on the third. */
+static uint16_t reload_buf[RELOAD_BUF_LEN];
+
+
+/* Values for the GPIO bit set/reset register. The legs are switched off
+ * together, then switched on in turn. The first half of every bit drives
+ * PIN_2, to match the tick encoder. */
+static uint32_t pins_off = (DCC_HAL_GPIO_PIN_1 | DCC_HAL_GPIO_PIN_2) << 16;
+static uint32_t pins_on[2] = { DCC_HAL_GPIO_PIN_2, DCC_HAL_GPIO_PIN_1 };
+
+
+/* Each half bit is a period of its own, so the symbols go straight into the
+ * buffer. The first one plays once the ahead entries have, and the rest
+ * follow it, which tells the HAL how far ahead of the pins it's working. */
+static void
+fill(uint16_t *reload, int len, const uint16_t *ahead, int ahead_len)
+{
+    uint32_t ticks = 0;
+    int i;
+
+    for (i = 0; i < ahead_len; i++)
+        ticks += ahead[i] + 1;
+
+    for (i = 0; i < len; i++)
+    {
+        reload[i] = dcc_hal_next_half_bit(DCC_HAL_TICKS_US(ticks)) ?
+            DCC_HAL_ONE_RELOAD : DCC_HAL_ZERO_RELOAD;
+        ticks += reload[i] + 1;
+    }
+}
+
+
+static void
+dma_channel_init(DMA_Channel_TypeDef *channel, volatile void *periph,
+                 void *mem, uint32_t len, bool word)
+{
+    DMA_InitTypeDef dma_cfg;
+
+    DMA_DeInit(channel);
+    dma_cfg.DMA_PeripheralBaseAddr = (uintptr_t)periph;
+    dma_cfg.DMA_MemoryBaseAddr = (uintptr_t)mem;
+    dma_cfg.DMA_DIR = DMA_DIR_PeripheralDST;
+    dma_cfg.DMA_BufferSize = len;
+    dma_cfg.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    dma_cfg.DMA_MemoryInc = len > 1 ? DMA_MemoryInc_Enable :
+                                      DMA_MemoryInc_Disable;
+    dma_cfg.DMA_PeripheralDataSize = word ? DMA_PeripheralDataSize_Word :
+                                            DMA_PeripheralDataSize_HalfWord;
+    dma_cfg.DMA_MemoryDataSize = word ? DMA_MemoryDataSize_Word :
+                                        DMA_MemoryDataSize_HalfWord;
+    dma_cfg.DMA_Mode = DMA_Mode_Circular;
+    dma_cfg.DMA_Priority = DMA_Priority_VeryHigh;
+    dma_cfg.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(channel, &dma_cfg);
+}
+
+
+void
+dcc_hal_dma_init(void)
+{
+    TIM_TimeBaseInitTypeDef tim_cfg;
+    TIM_OCInitTypeDef oc_cfg;
+    NVIC_InitTypeDef nvic_cfg;
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    RCC_APB1PeriphClockCmd(RCC_APB1Periph_TIM3, ENABLE);
+
+    /* Get the first lot of bits ready before the timer starts */
+    fill(reload_buf, RELOAD_BUF_LEN, NULL, 0);
+
+    dma_channel_init(DMA1_Channel3, &TIM3->ARR, reload_buf, RELOAD_BUF_LEN,
+                     false);
+    dma_channel_init(DMA1_Channel2, &DCC_HAL_GPIO->BSRR, &pins_off, 1, true);
+    dma_channel_init(DMA1_Channel6, &DCC_HAL_GPIO->BSRR, pins_on, 2, true);
+
+    /* Refill on half and full transfer of the duration buffer */
+    DMA_ITConfig(DMA1_Channel3, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+    nvic_cfg.NVIC_IRQChannel = DMA1_Channel3_IRQn;
+    nvic_cfg.NVIC_IRQChannelPreemptionPriority = 0;
+    nvic_cfg.NVIC_IRQChannelSubPriority = 1;
+    nvic_cfg.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&nvic_cfg);
+
+    DMA_Cmd(DMA1_Channel3, ENABLE);
+    DMA_Cmd(DMA1_Channel2, ENABLE);
+    DMA_Cmd(DMA1_Channel6, ENABLE);
+
+    /* Same 18MHz time base as the tick encoder, starting with a one */
+    tim_cfg.TIM_Period = DCC_HAL_ONE_RELOAD;
+    tim_cfg.TIM_Prescaler = 1;
+    tim_cfg.TIM_ClockDivision = 0;
+    tim_cfg.TIM_CounterMode = TIM_CounterMode_Up;
+    TIM_TimeBaseInit(TIM3, &tim_cfg);
+    TIM_ARRPreloadConfig(TIM3, ENABLE);
+
+    /* The compare channels only generate DMA requests, they aren't
+     * connected to any pins */
+    oc_cfg.TIM_OCMode = TIM_OCMode_Timing;
+    oc_cfg.TIM_OutputState = TIM_OutputState_Disable;
+    oc_cfg.TIM_OutputNState = TIM_OutputNState_Disable;
+    oc_cfg.TIM_OCPolarity = TIM_OCPolarity_High;
+    oc_cfg.TIM_OCNPolarity = TIM_OCNPolarity_High;
+    oc_cfg.TIM_OCIdleState = TIM_OCIdleState_Reset;
+    oc_cfg.TIM_OCNIdleState = TIM_OCNIdleState_Reset;
+
+    oc_cfg.TIM_Pulse = 0;
+    TIM_OC3Init(TIM3, &oc_cfg);
+
+    oc_cfg.TIM_Pulse = DEAD_TICKS;
+    TIM_OC1Init(TIM3, &oc_cfg);
+
+    TIM_DMACmd(TIM3, TIM_DMA_Update | TIM_DMA_CC1 | TIM_DMA_CC3, ENABLE);
+
+    TIM_Cmd(TIM3, ENABLE);
+}
+
+
+void
+DMA1_Channel3_IRQHandler(void)
+{
+    PROF_START();
+
+    /* The first half has been played, and the DMA is working on the
+     * second */
+    if (DMA_GetITStatus(DMA1_IT_HT3) != RESET)
+    {
+        DMA_ClearITPendingBit(DMA1_IT_HT3);
+        fill(reload_buf, RELOAD_BUF_LEN / 2,
+             &reload_buf[RELOAD_BUF_LEN / 2], RELOAD_BUF_LEN / 2);
+    }
+
+    /* The second half has been played, and the DMA has wrapped around */
+    if (DMA_GetITStatus(DMA1_IT_TC3) != RESET)
+    {
+        DMA_ClearITPendingBit(DMA1_IT_TC3);
+        fill(&reload_buf[RELOAD_BUF_LEN / 2], RELOAD_BUF_LEN / 2,
+             reload_buf, RELOAD_BUF_LEN / 2);
+    }
+
+    PROF_END(PROF_DMA1_CH3);
+}
+
+#endif /* DCC_HAL_ENCODER_DMA */
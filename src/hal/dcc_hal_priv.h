@@ -0,0 +1,122 @@
+#ifndef _DCC_HAL_PRIV_H
+#define _DCC_HAL_PRIV_H
+
+/*
+ * Shared between the DCC HAL and its waveform encoders. Not for use outside
+ * of src/hal.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/* True for the encoders that are driven by the TIM2 interrupt */
+#define DCC_HAL_USES_TIM2 \
+    ((DCC_HAL_ENCODER == DCC_HAL_ENCODER_TICK) || \
+     (DCC_HAL_ENCODER == DCC_HAL_ENCODER_VARIABLE))
+
+
+/* True for the encoders that play half bits rather than whole bits */
+#define DCC_HAL_USES_HALF_BITS (DCC_HAL_ENCODER == DCC_HAL_ENCODER_DMA)
+
+
+/* True for the encoders that drive DCC_HAL_GPIO_PIN_1 and PIN_2 */
+#define DCC_HAL_USES_GPIO \
+    (DCC_HAL_USES_TIM2 || (DCC_HAL_ENCODER == DCC_HAL_ENCODER_DMA))
+
+
+/* Timer reload values for each half bit. The encoder timers run at 18MHz,
+ * so one tick is 56ns.
+ *
+ * 58us / 56ns = 1044 => load value 1043
+ * 100us / 56ns = 1800 => load value 1799
+ */
+#define DCC_HAL_ONE_RELOAD  (1043)
+#define DCC_HAL_ZERO_RELOAD (1799)
+
+
+/* Whole microseconds in a number of 18MHz timer ticks */
+#define DCC_HAL_TICKS_US(ticks) ((ticks) / 18)
+
+
+/* Half bits in an expanded packet, leaving out the preamble: a start bit
+ * before each byte, the data bits and the end bit, two halves each */
+#define DCC_HAL_PACKET_HALF_BITS(len) (2 * ((len) * 9 + 1))
+
+
+/* Words needed to hold the longest expanded packet */
+#define DCC_HAL_HALF_BIT_WORDS \
+    ((DCC_HAL_PACKET_HALF_BITS(DCC_HAL_MAX_PACKET) + 31) / 32)
+
+
+/* Get half bit i of an expanded packet. 1 is a one half bit, 0 a zero. */
+#define DCC_HAL_HALF_BIT(half_bits, i) \
+    (((half_bits)[(i) >> 5] >> (31 - ((i) & 31))) & 1)
+
+
+/* Half bit symbols for each byte value, MSB first. The start bit before the
+ * byte is the two zero bits above the entry. */
+extern const uint16_t dcc_hal_half_bits[256];
+
+
+/**
+ * Expand a packet into half bit symbols, MSB first in each word. A start
+ * bit goes before each byte and the end bit after the last. Any bits after
+ * the end of the packet in the last word are zero.
+ * \param packet the bytes to send, including the checksum
+ * \param len number of bytes in the packet
+ * \param half_bits where to put the symbols, at least
+ * DCC_HAL_HALF_BIT_WORDS words for a full length packet
+ * \return number of half bits written
+ */
+extern uint8_t
+dcc_hal_expand_packet(const uint8_t *packet, uint8_t len, uint32_t *half_bits);
+
+
+/**
+ * Get the next bit to put on the wire. Each queued packet is framed with
+ * its preamble, start bits and end bit, and idle time is filled with one
+ * bits. Called from the encoder interrupt. Not built for the encoders that
+ * use dcc_hal_next_half_bit.
+ * \param lead_us how long from now until the bit goes onto the wire, for
+ * encoders that work ahead of the pins. The packet times in the completions
+ * are moved on by this much, so they're the times on the wire.
+ * \return the value of the bit
+ */
+extern bool
+dcc_hal_next_bit(uint32_t lead_us);
+
+
+/**
+ * As dcc_hal_next_bit, but a half bit at a time, played from the packet
+ * expanded by dcc_hal_expand_packet. Only built when
+ * DCC_HAL_USES_HALF_BITS.
+ * \param lead_us how long from now until the half bit goes onto the wire
+ * \return 1 for a one half bit, 0 for a zero
+ */
+extern bool
+dcc_hal_next_half_bit(uint32_t lead_us);
+
+
+/**
+ * Configure the timer and DMA channels for the DMA encoder and start it
+ */
+extern void
+dcc_hal_dma_init(void);
+
+
+/**
+ * Configure TIM1 and its output pins for the TIM1 encoder and start it
+ */
+extern void
+dcc_hal_tim1_init(void);
+
+
+/**
+ * Configure SPI1 and its DMA channel for the SPI encoder and start it
+ */
+extern void
+dcc_hal_spi_init(void);
+
+
+#endif /* _DCC_HAL_PRIV_H */
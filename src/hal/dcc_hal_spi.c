@@ -0,0 +1,176 @@
+#include "dcc_hal.h"
+#include "dcc_hal_priv.h"
+
+#include "prof.h"
+
+
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_SPI)
+
+/*
+ * SPI1 shifts the waveform out of MOSI, with DMA1 channel 3 feeding it from
+ * a circular buffer. The CPU only runs on the half and full transfer
+ * interrupts, to refill the half of the buffer that has just been sent.
+ *
+ * SPI1 runs from the 72MHz APB2 clock divided by 256, so each SPI bit is a
+ * 3.56us cell:
+ *
+ *   one half bit  = 16 cells = 56.9us
+ *   zero half bit = 28 cells = 99.6us
+ *
+ * A one bit is then four whole bytes and a zero bit seven, so every DCC bit
+ * starts on a byte boundary. MOSI is low for the first half of each bit, to
+ * match the other encoders.
+ *
+ * There's only one output, so it suits a booster with a single direction
+ * input, such as the LMD18200, which provides its own dead time. MOSI comes
+ * out on PB5 using the SPI1 remap, as PA7 is taken by the display.
+ */
+#define SPI_GPIO     (GPIOB)
+#define SPI_GPIO_PIN (GPIO_Pin_5)
+
+
+/* Bytes in the DMA buffer. Each half takes 0.9ms to send. The stop packet
+ * can only go out after what has already been filled, so this is kept short
+ * enough for it to reach the rail within 10ms of the button. */
+#define SPI_BUF_LEN (64)
+
+
+static uint8_t spi_buf[SPI_BUF_LEN];
+
+
+static const uint8_t one_pattern[] = { 0x00, 0x00, 0xff, 0xff };
+static const uint8_t zero_pattern[] =
+{
+    0x00, 0x00, 0x00, 0x0f, 0xff, 0xff, 0xff
+};
+
+
+/* The bit being copied into the buffer, which may carry on into the next
+ * refill */
+static const uint8_t *pattern;
+static uint8_t pattern_left;
+
+
+/* Nanoseconds to send one byte, at 256 core clocks per SPI bit */
+#define BYTE_NS (8 * 256 * 1000 / 72)
+
+
+/* The first byte of buf goes out once ahead bytes have */
+static void
+fill(uint8_t *buf, int len, int ahead)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (pattern_left == 0)
+        {
+            if (dcc_hal_next_bit((ahead + i) * BYTE_NS / 1000))
+            {
+                pattern = one_pattern;
+                pattern_left = sizeof(one_pattern);
+            }
+            else
+            {
+                pattern = zero_pattern;
+                pattern_left = sizeof(zero_pattern);
+            }
+        }
+
+        buf[i] = *pattern++;
+        pattern_left--;
+    }
+}
+
+
+void
+dcc_hal_spi_init(void)
+{
+    GPIO_InitTypeDef gpio_cfg;
+    DMA_InitTypeDef dma_cfg;
+    SPI_InitTypeDef spi_cfg;
+    NVIC_InitTypeDef nvic_cfg;
+
+    RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOB | RCC_APB2Periph_AFIO |
+                           RCC_APB2Periph_SPI1, ENABLE);
+
+    /* Only MOSI is used. SCK and MISO are left as they are. */
+    GPIO_PinRemapConfig(GPIO_Remap_SPI1, ENABLE);
+    gpio_cfg.GPIO_Pin = SPI_GPIO_PIN;
+    gpio_cfg.GPIO_Speed = GPIO_Speed_50MHz;
+    gpio_cfg.GPIO_Mode = GPIO_Mode_AF_PP;
+    GPIO_Init(SPI_GPIO, &gpio_cfg);
+
+    /* Get the first lot of bits ready before the SPI starts */
+    fill(spi_buf, SPI_BUF_LEN, 0);
+
+    DMA_DeInit(DMA1_Channel3);
+    dma_cfg.DMA_PeripheralBaseAddr = (uintptr_t)&SPI1->DR;
+    dma_cfg.DMA_MemoryBaseAddr = (uintptr_t)spi_buf;
+    dma_cfg.DMA_DIR = DMA_DIR_PeripheralDST;
+    dma_cfg.DMA_BufferSize = SPI_BUF_LEN;
+    dma_cfg.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    dma_cfg.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    dma_cfg.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    dma_cfg.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    dma_cfg.DMA_Mode = DMA_Mode_Circular;
+    dma_cfg.DMA_Priority = DMA_Priority_VeryHigh;
+    dma_cfg.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init(DMA1_Channel3, &dma_cfg);
+
+    /* Refill on half and full transfer */
+    DMA_ITConfig(DMA1_Channel3, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+    nvic_cfg.NVIC_IRQChannel = DMA1_Channel3_IRQn;
+    nvic_cfg.NVIC_IRQChannelPreemptionPriority = 0;
+    nvic_cfg.NVIC_IRQChannelSubPriority = 1;
+    nvic_cfg.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&nvic_cfg);
+
+    DMA_Cmd(DMA1_Channel3, ENABLE);
+
+    /* Transmit only master. Each byte follows the last with no gap while
+     * the DMA keeps up. */
+    spi_cfg.SPI_Direction = SPI_Direction_1Line_Tx;
+    spi_cfg.SPI_Mode = SPI_Mode_Master;
+    spi_cfg.SPI_DataSize = SPI_DataSize_8b;
+    spi_cfg.SPI_CPOL = SPI_CPOL_Low;
+    spi_cfg.SPI_CPHA = SPI_CPHA_1Edge;
+    spi_cfg.SPI_NSS = SPI_NSS_Soft;
+    spi_cfg.SPI_BaudRatePrescaler = SPI_BaudRatePrescaler_256;
+    spi_cfg.SPI_FirstBit = SPI_FirstBit_MSB;
+    spi_cfg.SPI_CRCPolynomial = 7;
+    SPI_Init(SPI1, &spi_cfg);
+
+    /* Stop NSS dropping the SPI out of master mode */
+    SPI_NSSInternalSoftwareConfig(SPI1, SPI_NSSInternalSoft_Set);
+
+    SPI_I2S_DMACmd(SPI1, SPI_I2S_DMAReq_Tx, ENABLE);
+    SPI_Cmd(SPI1, ENABLE);
+}
+
+
+void
+DMA1_Channel3_IRQHandler(void)
+{
+    PROF_START();
+
+    /* The first half has been sent, and the DMA is working on the second */
+    if (DMA_GetITStatus(DMA1_IT_HT3) != RESET)
+    {
+        DMA_ClearITPendingBit(DMA1_IT_HT3);
+        fill(spi_buf, SPI_BUF_LEN / 2, SPI_BUF_LEN / 2);
+    }
+
+    /* The second half has been sent, and the DMA has wrapped around */
+    if (DMA_GetITStatus(DMA1_IT_TC3) != RESET)
+    {
+        DMA_ClearITPendingBit(DMA1_IT_TC3);
+        fill(&spi_buf[SPI_BUF_LEN / 2], SPI_BUF_LEN / 2, SPI_BUF_LEN / 2);
+    }
+
+    PROF_END(PROF_DMA1_CH3);
+}
+
+#endif /* DCC_HAL_ENCODER_SPI */
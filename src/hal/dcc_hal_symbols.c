@@ -0,0 +1,64 @@
+#include "dcc_hal.h"
+#include "dcc_hal_priv.h"
+
+
+/*
+ * Byte to half bit expansion. Each data bit of a byte becomes two equal
+ * half bit symbols, so bit n of the byte lands in bits 2n and 2n + 1 of the
+ * table entry. The table is built by the preprocessor and lives in flash.
+ */
+#define HALVES(b, n) ((((b) >> (n)) & 1u) * (3u << (2 * (n))))
+#define SYMBOLS(b) \
+    (HALVES(b, 7) | HALVES(b, 6) | HALVES(b, 5) | HALVES(b, 4) | \
+     HALVES(b, 3) | HALVES(b, 2) | HALVES(b, 1) | HALVES(b, 0))
+
+#define ROW_4(b) \
+    SYMBOLS(b), SYMBOLS((b) + 1), SYMBOLS((b) + 2), SYMBOLS((b) + 3)
+#define ROW_16(b) \
+    ROW_4(b), ROW_4((b) + 4), ROW_4((b) + 8), ROW_4((b) + 12)
+#define ROW_64(b) \
+    ROW_16(b), ROW_16((b) + 16), ROW_16((b) + 32), ROW_16((b) + 48)
+
+
+const uint16_t dcc_hal_half_bits[256] =
+{
+    ROW_64(0), ROW_64(64), ROW_64(128), ROW_64(192)
+};
+
+
+uint8_t
+dcc_hal_expand_packet(const uint8_t *packet, uint8_t len, uint32_t *half_bits)
+{
+    uint64_t acc = 0;
+    uint8_t n = 0;
+    uint8_t i;
+
+    /* The two zero half bits of the start bit come for free as the top of
+     * each 18 bit group */
+    for (i = 0; i < len; i++)
+    {
+        acc = (acc << 18) | dcc_hal_half_bits[packet[i]];
+        n += 18;
+
+        if (n >= 32)
+        {
+            n -= 32;
+            *half_bits++ = (uint32_t)(acc >> n);
+        }
+    }
+
+    /* Packet end bit */
+    acc = (acc << 2) | 3;
+    n += 2;
+
+    if (n >= 32)
+    {
+        n -= 32;
+        *half_bits++ = (uint32_t)(acc >> n);
+    }
+
+    if (n > 0)
+        *half_bits = (uint32_t)(acc << (32 - n));
+
+    return DCC_HAL_PACKET_HALF_BITS(len);
+}
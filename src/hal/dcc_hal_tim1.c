@@ -0,0 +1,146 @@
+#include "dcc_hal.h"
+#include "dcc_hal_priv.h"
+
+#include "prof.h"
+
+
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_TIM1)
+
+/*
+ * TIM1 channel 3 drives one leg of the H bridge and its complementary
+ * output drives the other, so the pins never need touching from software.
+ * Each timer period is a whole bit, with the compare value at the middle:
+ *
+ *   CH3  (PA10) is on for the first half of the bit
+ *   CH3N (PB1)  is on for the second half
+ *
+ * The dead time generator holds both outputs off for DEAD_TICKS at each
+ * switch over. ARR and CCR3 are preloaded, so the update interrupt at the
+ * start of each bit sets up the one after it.
+ *
+ * The pins come from the TIM1 partial remap. PB1 is the same pin as
+ * DCC_HAL_GPIO_PIN_1, and PA10 replaces DCC_HAL_GPIO_PIN_2. PA10 is also
+ * the default USART1 RX pin, so uart_init remaps USART1 to PB6/PB7 when
+ * this encoder is built.
+ */
+#define TIM1_GPIO_P     (GPIOA)
+#define TIM1_GPIO_P_PIN (GPIO_Pin_10)
+#define TIM1_GPIO_N     (GPIOB)
+#define TIM1_GPIO_N_PIN (GPIO_Pin_1)
+
+
+/* TIM1 runs from the 72MHz APB2 clock. Dividing by four gives the same
+ * 18MHz time base as the other encoders. */
+#define PRESCALER (3)
+
+
+/* Dead time in 72MHz clock cycles. 72 cycles = 1us */
+#define DEAD_TICKS (72)
+
+
+/* Timer period and compare value for each bit */
+#define BIT_RELOAD(half) (2 * ((half) + 1) - 1)
+#define BIT_COMPARE(half) ((half) + 1)
+
+
+static void
+load_bit(bool bit)
+{
+    if (bit)
+    {
+        TIM_SetAutoreload(TIM1, BIT_RELOAD(DCC_HAL_ONE_RELOAD));
+        TIM_SetCompare3(TIM1, BIT_COMPARE(DCC_HAL_ONE_RELOAD));
+    }
+    else
+    {
+        TIM_SetAutoreload(TIM1, BIT_RELOAD(DCC_HAL_ZERO_RELOAD));
+        TIM_SetCompare3(TIM1, BIT_COMPARE(DCC_HAL_ZERO_RELOAD));
+    }
+}
+
+
+void
+dcc_hal_tim1_init(void)
+{
+    GPIO_InitTypeDef gpio_cfg;
+    TIM_TimeBaseInitTypeDef tim_cfg;
+    TIM_OCInitTypeDef oc_cfg;
+    TIM_BDTRInitTypeDef bdtr_cfg;
+    NVIC_InitTypeDef nvic_cfg;
+
+    RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA | RCC_APB2Periph_GPIOB |
+                           RCC_APB2Periph_AFIO | RCC_APB2Periph_TIM1, ENABLE);
+
+    /* Move CH3N onto PB1 */
+    GPIO_PinRemapConfig(GPIO_PartialRemap_TIM1, ENABLE);
+
+    gpio_cfg.GPIO_Speed = GPIO_Speed_50MHz;
+    gpio_cfg.GPIO_Mode = GPIO_Mode_AF_PP;
+    gpio_cfg.GPIO_Pin = TIM1_GPIO_P_PIN;
+    GPIO_Init(TIM1_GPIO_P, &gpio_cfg);
+    gpio_cfg.GPIO_Pin = TIM1_GPIO_N_PIN;
+    GPIO_Init(TIM1_GPIO_N, &gpio_cfg);
+
+    /* Start with a one bit */
+    tim_cfg.TIM_Period = BIT_RELOAD(DCC_HAL_ONE_RELOAD);
+    tim_cfg.TIM_Prescaler = PRESCALER;
+    tim_cfg.TIM_ClockDivision = 0;
+    tim_cfg.TIM_CounterMode = TIM_CounterMode_Up;
+    tim_cfg.TIM_RepetitionCounter = 0;
+    TIM_TimeBaseInit(TIM1, &tim_cfg);
+
+    /* CH3 is active below the compare value, CH3N above it */
+    oc_cfg.TIM_OCMode = TIM_OCMode_PWM1;
+    oc_cfg.TIM_OutputState = TIM_OutputState_Enable;
+    oc_cfg.TIM_OutputNState = TIM_OutputNState_Enable;
+    oc_cfg.TIM_Pulse = BIT_COMPARE(DCC_HAL_ONE_RELOAD);
+    oc_cfg.TIM_OCPolarity = TIM_OCPolarity_High;
+    oc_cfg.TIM_OCNPolarity = TIM_OCNPolarity_High;
+    oc_cfg.TIM_OCIdleState = TIM_OCIdleState_Reset;
+    oc_cfg.TIM_OCNIdleState = TIM_OCNIdleState_Reset;
+    TIM_OC3Init(TIM1, &oc_cfg);
+
+    /* New values are only picked up at the start of the next bit */
+    TIM_OC3PreloadConfig(TIM1, TIM_OCPreload_Enable);
+    TIM_ARRPreloadConfig(TIM1, ENABLE);
+
+    /* Both outputs are held off while the main output is disabled */
+    bdtr_cfg.TIM_OSSRState = TIM_OSSRState_Enable;
+    bdtr_cfg.TIM_OSSIState = TIM_OSSIState_Enable;
+    bdtr_cfg.TIM_LOCKLevel = TIM_LOCKLevel_OFF;
+    bdtr_cfg.TIM_DeadTime = DEAD_TICKS;
+    bdtr_cfg.TIM_Break = TIM_Break_Disable;
+    bdtr_cfg.TIM_BreakPolarity = TIM_BreakPolarity_High;
+    bdtr_cfg.TIM_AutomaticOutput = TIM_AutomaticOutput_Disable;
+    TIM_BDTRConfig(TIM1, &bdtr_cfg);
+
+    /* Interrupt at the start of each bit */
+    TIM_ClearITPendingBit(TIM1, TIM_IT_Update);
+    TIM_ITConfig(TIM1, TIM_IT_Update, ENABLE);
+
+    nvic_cfg.NVIC_IRQChannel = TIM1_UP_IRQn;
+    nvic_cfg.NVIC_IRQChannelPreemptionPriority = 0;
+    nvic_cfg.NVIC_IRQChannelSubPriority = 1;
+    nvic_cfg.NVIC_IRQChannelCmd = ENABLE;
+    NVIC_Init(&nvic_cfg);
+
+    TIM_Cmd(TIM1, ENABLE);
+    TIM_CtrlPWMOutputs(TIM1, ENABLE);
+}
+
+
+void
+TIM1_UP_IRQHandler(void)
+{
+    PROF_START();
+
+    TIM_ClearITPendingBit(TIM1, TIM_IT_Update);
+
+    /* The bit that has just started was loaded last time, so this one goes
+     * out once it's done. ARR still holds its length. */
+    load_bit(dcc_hal_next_bit(DCC_HAL_TICKS_US(TIM1->ARR + 1)));
+
+    PROF_END(PROF_TIM1);
+}
+
+#endif /* DCC_HAL_ENCODER_TIM1 */
@@ -0,0 +1,116 @@
+#include "log.h"
+
+#include <string.h>
+
+#include "systick.h"
+
+
+/* Words in the longest record */
+#define RECORD_WORDS (2 + LOG_MAX_ARGS)
+
+
+/*
+ * The ring. Writers claim space by moving head on with a compare and swap,
+ * fill it in and write the header last. The drain reads from tail until it
+ * finds a header that isn't valid yet, and zeroes each record as it goes,
+ * so a record that's still being written is never mistaken for an old one.
+ * Both indices count words and run freely.
+ */
+static uint32_t ring[LOG_WORDS];
+static uint32_t head;
+static uint32_t tail;
+static uint32_t dropped;
+
+static log_output_t output;
+
+
+void
+log_init(log_output_t out)
+{
+    memset(ring, 0, sizeof(ring));
+    head = 0;
+    tail = 0;
+    dropped = 0;
+    output = out;
+}
+
+
+void
+log_record(uint32_t header, const uint32_t *args)
+{
+    uint32_t n = 2 + ((header >> LOG_NARGS_SHIFT) & LOG_NARGS_MASK);
+    uint32_t start;
+    uint32_t i;
+
+    /* Claim the space. If something preempts us and logs, the swap fails
+     * and we try again after it. */
+    start = __atomic_load_n(&head, __ATOMIC_RELAXED);
+    do
+    {
+        if (start + n - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) > LOG_WORDS)
+        {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&head, &start, start + n, true,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    ring[(start + 1) & (LOG_WORDS - 1)] = (uint32_t)systicks;
+    for (i = 2; i < n; i++)
+        ring[(start + i) & (LOG_WORDS - 1)] = args[i - 2];
+
+    /* Publish it */
+    __atomic_store_n(&ring[start & (LOG_WORDS - 1)], header, __ATOMIC_RELEASE);
+}
+
+
+/* Send a record made by the drain itself */
+static void
+send_dropped(uint32_t count)
+{
+    static const char fmt[] __attribute__((section("log_fmt"), used)) =
+        "log: %u records dropped";
+    uint32_t words[3];
+
+    words[0] = LOG_VALID | (1 << LOG_NARGS_SHIFT) |
+        (uint32_t)(fmt - __start_log_fmt);
+    words[1] = (uint32_t)systicks;
+    words[2] = count;
+
+    output(words, 3);
+}
+
+
+void
+log_drain(void)
+{
+    uint32_t words[RECORD_WORDS];
+    uint32_t header, count;
+    uint8_t n, i;
+
+    for (;;)
+    {
+        header = __atomic_load_n(&ring[tail & (LOG_WORDS - 1)],
+                                 __ATOMIC_ACQUIRE);
+        if (!(header & LOG_VALID))
+            break;
+
+        n = 2 + ((header >> LOG_NARGS_SHIFT) & LOG_NARGS_MASK);
+        for (i = 0; i < n; i++)
+        {
+            words[i] = ring[(tail + i) & (LOG_WORDS - 1)];
+            ring[(tail + i) & (LOG_WORDS - 1)] = 0;
+        }
+
+        /* Only give the space back once it's clear */
+        __atomic_store_n(&tail, tail + n, __ATOMIC_RELEASE);
+
+        if (output != NULL)
+            output(words, n);
+    }
+
+    count = __atomic_exchange_n(&dropped, 0, __ATOMIC_RELAXED);
+    if (count > 0 && output != NULL)
+        send_dropped(count);
+}
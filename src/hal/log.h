@@ -0,0 +1,113 @@
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+/*
+ * Binary log. LOG() records a format string id, the time and up to
+ * LOG_MAX_ARGS integer arguments in a RAM ring, without formatting
+ * anything, so it's cheap enough for interrupt handlers and the DCC hot
+ * path. log_drain() sends the records on from the main loop, and
+ * host/log_decode.py turns them back into text using the format strings in
+ * the ELF.
+ *
+ * The format strings go in their own section, which the linker script
+ * keeps out of flash. Only integer conversions (%d, %u, %x, %c and so on)
+ * can be used.
+ *
+ * Any context may log, including interrupts that preempt each other.
+ * Records that don't fit are dropped and counted.
+ */
+
+
+/* Most arguments a record can carry */
+#define LOG_MAX_ARGS (4)
+
+
+/* Words in the ring. Must be a power of two. */
+#define LOG_WORDS (128)
+
+
+/* ITM stimulus port the firmware sends the log out of. Port 0 carries the
+ * text from printf. */
+#define LOG_ITM_PORT (1)
+
+
+/*
+ * Each record is a header word, the time in milliseconds and the
+ * arguments. The header has LOG_VALID set, the number of arguments and the
+ * offset of the format string in the log_fmt section.
+ */
+#define LOG_VALID         (0x80000000)
+#define LOG_NARGS_SHIFT   (24)
+#define LOG_NARGS_MASK    (0x7f)
+#define LOG_ID_MASK       (0x00ffffff)
+
+
+/**
+ * Where log_drain sends the records. Called with one whole record at a
+ * time.
+ */
+typedef void (*log_output_t)(const uint32_t *words, uint8_t n);
+
+
+/* Start of the format string section, from the linker */
+extern const char __start_log_fmt[];
+
+
+/* Count the arguments given to LOG, from 0 up to LOG_MAX_ARGS */
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, n, ...) (n)
+
+
+/**
+ * Log a message. The format must be a string literal.
+ */
+#define LOG(fmt, ...)                                                       \
+    do                                                                      \
+    {                                                                       \
+        static const char log_fmt[]                                         \
+            __attribute__((section("log_fmt"), used)) = fmt;                \
+        const uint32_t log_args[LOG_MAX_ARGS] = { __VA_ARGS__ };            \
+                                                                            \
+        log_record(LOG_VALID |                                              \
+                   (LOG_NARGS(__VA_ARGS__) << LOG_NARGS_SHIFT) |            \
+                   (uint32_t)(log_fmt - __start_log_fmt), log_args);        \
+    } while (0)
+
+
+/**
+ * Start the log, empty
+ * \param output where log_drain sends the records, or NULL to drop them
+ */
+extern void
+log_init(log_output_t output);
+
+
+/**
+ * Add a record to the ring. Use LOG rather than calling this.
+ * \param header the record header
+ * \param args the arguments, as many as the header says
+ */
+extern void
+log_record(uint32_t header, const uint32_t *args);
+
+
+/**
+ * Send every complete record to the output. Call from the main loop.
+ */
+extern void
+log_drain(void);
+
+
+/**
+ * Send a record out of the ITM port LOG_ITM_PORT, if the debugger has
+ * enabled it. Defined in retarget.c.
+ */
+extern void
+log_itm_output(const uint32_t *words, uint8_t n);
+
+
+#endif /* _LOG_H */
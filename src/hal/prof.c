@@ -0,0 +1,172 @@
+#include "prof.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "systick.h"
+
+
+#if PROF_ENABLE
+
+/* Core debug registers. These aren't in the CMSIS headers that come with
+ * the StdPeriph library, and the host build provides its own. */
+#ifndef DWT_CYCCNT
+#define DEMCR      (*(volatile uint32_t *)0xe000edfc)
+#define DWT_CTRL   (*(volatile uint32_t *)0xe0001000)
+#define DWT_CYCCNT (*(volatile uint32_t *)0xe0001004)
+#endif
+
+#define DEMCR_TRCENA       (1 << 24)
+#define DWT_CTRL_CYCCNTENA (1 << 0)
+
+
+/* Percentages are printed to two decimal places without floating point,
+ * which printf in newlib nano doesn't support */
+#define PERCENT_X100(part, whole) ((unsigned long)((part) * 10000 / (whole)))
+
+
+typedef struct
+{
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t histogram[PROF_BUCKETS];
+} prof_stats_t;
+
+
+static const char *names[PROF_N] =
+{
+    [PROF_TIM2] = "TIM2",
+    [PROF_TIM1] = "TIM1",
+    [PROF_DMA1_CH3] = "DMA1 CH3",
+    [PROF_SYSTICK] = "SysTick",
+    [PROF_USART1] = "USART1",
+    [PROF_DMA1_CH4] = "DMA1 CH4",
+    [PROF_DMA1_CH5] = "DMA1 CH5",
+    [PROF_DMA1_CH7] = "DMA1 CH7",
+    [PROF_TIM2_LATENCY] = "TIM2 latency",
+};
+
+
+/* Each entry is only written by its own interrupt, so they don't need
+ * locking against each other */
+static prof_stats_t stats[PROF_N];
+
+/* Time the statistics were cleared, for working out the CPU share */
+static size_t start_ticks;
+
+volatile bool prof_dump_request;
+
+
+void
+prof_init(void)
+{
+    /* The DWT is part of the trace block, which is off until enabled */
+    DEMCR |= DEMCR_TRCENA;
+    DWT_CTRL |= DWT_CTRL_CYCCNTENA;
+
+    __disable_irq();
+    memset(stats, 0, sizeof(stats));
+    start_ticks = systicks;
+    __enable_irq();
+}
+
+
+uint32_t
+prof_cycles(void)
+{
+    return DWT_CYCCNT;
+}
+
+
+void
+prof_record(prof_id_t id, uint32_t cycles)
+{
+    prof_stats_t *s = &stats[id];
+    int bucket;
+
+    if (s->count == 0 || cycles < s->min)
+        s->min = cycles;
+    if (cycles > s->max)
+        s->max = cycles;
+    s->total += cycles;
+    s->count++;
+
+    /* log2, which is a single CLZ instruction */
+    bucket = cycles > 0 ? 31 - __builtin_clz(cycles) : 0;
+    if (bucket >= PROF_BUCKETS)
+        bucket = PROF_BUCKETS - 1;
+    s->histogram[bucket]++;
+}
+
+
+void
+prof_dump(void)
+{
+    prof_stats_t copy[PROF_N];
+    uint64_t elapsed;
+    uint64_t busy = 0;
+    int i, j;
+
+    /* Take a consistent copy, printing is far too slow to do with
+     * interrupts off */
+    __disable_irq();
+    memcpy(copy, stats, sizeof(stats));
+    elapsed = (uint64_t)(systicks - start_ticks) * (SystemCoreClock / 1000);
+    __enable_irq();
+
+    printf("%-12s %9s %7s %7s %7s %6s\n",
+           "cycles", "count", "min", "max", "mean", "cpu%");
+
+    for (i = 0; i < PROF_N; i++)
+    {
+        if (copy[i].count == 0)
+        {
+            printf("%-12s %9d\n", names[i], 0);
+            continue;
+        }
+
+        printf("%-12s %9lu %7lu %7lu %7lu",
+               names[i], (unsigned long)copy[i].count,
+               (unsigned long)copy[i].min, (unsigned long)copy[i].max,
+               (unsigned long)(copy[i].total / copy[i].count));
+
+        /* Latency isn't time spent in the handler */
+        if (i < PROF_N_ISRS && elapsed > 0)
+        {
+            busy += copy[i].total;
+            printf(" %3lu.%02lu",
+                   PERCENT_X100(copy[i].total, elapsed) / 100,
+                   PERCENT_X100(copy[i].total, elapsed) % 100);
+        }
+        printf("\n");
+
+        printf("  log2:");
+        for (j = 0; j < PROF_BUCKETS; j++)
+        {
+            if (copy[i].histogram[j] > 0)
+                printf(" %d:%lu", j, (unsigned long)copy[i].histogram[j]);
+        }
+        printf("\n");
+    }
+
+    if (elapsed > 0)
+        printf("total cpu: %lu.%02lu%% of %lu ms\n",
+               PERCENT_X100(busy, elapsed) / 100,
+               PERCENT_X100(busy, elapsed) % 100,
+               (unsigned long)(elapsed / (SystemCoreClock / 1000)));
+}
+
+
+void
+prof_poll(void)
+{
+    if (!prof_dump_request)
+        return;
+
+    prof_dump_request = false;
+    prof_dump();
+}
+
+#endif /* PROF_ENABLE */
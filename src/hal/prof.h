@@ -0,0 +1,112 @@
+#ifndef _PROF_H
+#define _PROF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "stm32f10x.h"
+
+
+/*
+ * Interrupt profiling using the DWT cycle counter. This is only built in
+ * when PROF_ENABLE is set, e.g. make PROF_ENABLE=1. Otherwise the macros
+ * below compile to nothing.
+ */
+#ifndef PROF_ENABLE
+#define PROF_ENABLE (0)
+#endif
+
+
+/**
+ * Things that are profiled. The interrupt handlers are timed from entry to
+ * exit, including anything that preempts them. TIM2 latency is the time
+ * from the update event to the handler starting, which shows the jitter
+ * added by other work.
+ */
+typedef enum
+{
+    PROF_TIM2,
+    PROF_TIM1,
+    PROF_DMA1_CH3,
+    PROF_SYSTICK,
+    PROF_USART1,
+    PROF_DMA1_CH4,
+    PROF_DMA1_CH5,
+    PROF_DMA1_CH7,
+    PROF_N_ISRS,
+
+    PROF_TIM2_LATENCY = PROF_N_ISRS,
+    PROF_N
+} prof_id_t;
+
+
+/* Histogram buckets, each twice as wide as the last. Bucket n counts
+ * samples of 2^n to 2^(n+1) - 1 cycles, and the last bucket holds
+ * everything longer. */
+#define PROF_BUCKETS (16)
+
+
+#if PROF_ENABLE
+
+/**
+ * Set by a debugger, or the code, to have the next PROF_POLL() print the
+ * report
+ */
+extern volatile bool prof_dump_request;
+
+
+/**
+ * Start the cycle counter and clear the statistics
+ */
+extern void
+prof_init(void);
+
+
+/**
+ * Read the cycle counter
+ */
+extern uint32_t
+prof_cycles(void);
+
+
+/**
+ * Add a sample
+ * \param id what was measured
+ * \param cycles how long it took
+ */
+extern void
+prof_record(prof_id_t id, uint32_t cycles);
+
+
+/**
+ * Print the statistics with printf, which goes out over ITM
+ */
+extern void
+prof_dump(void);
+
+
+/**
+ * Print the statistics if they've been asked for. Call from the main loop.
+ */
+extern void
+prof_poll(void);
+
+
+#define PROF_INIT() prof_init()
+#define PROF_POLL() prof_poll()
+#define PROF_START() uint32_t prof_start = prof_cycles()
+#define PROF_END(id) prof_record((id), prof_cycles() - prof_start)
+#define PROF_SAMPLE(id, cycles) prof_record((id), (cycles))
+
+#else
+
+#define PROF_INIT() do { } while (0)
+#define PROF_POLL() do { } while (0)
+#define PROF_START() do { } while (0)
+#define PROF_END(id) do { } while (0)
+#define PROF_SAMPLE(id, cycles) do { } while (0)
+
+#endif /* PROF_ENABLE */
+
+
+#endif /* _PROF_H */
@@ -1,6 +1,19 @@
 #include "stm32f10x.h"
 
+#include "log.h"
+#include "uart.h"
 
+
+#if UART_PRINTF
+/* Queue the text on the debug port and carry on. Whatever doesn't fit in
+ * the transmit buffer is dropped, as waiting for it would stall the main
+ * loop. */
+int _write(int fd, char *ptr, int len) {
+    uart_send_data(UART_DEBUG_PORT, (uint8_t *)ptr, len);
+
+    return len;
+}
+#else
 int _write(int fd, char *ptr, int len) {
     int i;
 
@@ -10,3 +23,21 @@ int _write(int fd, char *ptr, int len) {
 
     return len;
 }
+#endif
+
+
+/* Binary log records go out of their own stimulus port, a word at a time, so
+ * they don't get mixed up with the text above */
+void log_itm_output(const uint32_t *words, uint8_t n) {
+    int i;
+
+    if (!(ITM->TCR & ITM_TCR_ITMENA_Msk) ||
+        !(ITM->TER & (1UL << LOG_ITM_PORT)))
+        return;
+
+    for (i = 0; i < n; i++) {
+        while (ITM->PORT[LOG_ITM_PORT].u32 == 0)
+            ;
+        ITM->PORT[LOG_ITM_PORT].u32 = words[i];
+    }
+}
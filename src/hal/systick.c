@@ -4,6 +4,8 @@
 
 #include "stm32f10x.h"
 
+#include "prof.h"
+
 volatile size_t systicks;
 
 systick_callback_t callback;
@@ -36,9 +38,33 @@ bool systick_test_duration(size_t timestamp, size_t duration) {
   return delta >= duration;
 }
 
+uint32_t systick_get_us(void) {
+  size_t ticks;
+  uint32_t count;
+
+  /* Make sure the count goes with the tick we read */
+  do {
+    ticks = systicks;
+    count = SysTick->VAL;
+  } while (ticks != systicks);
+
+  /* If the systick interrupt is held off, the timer may have wrapped without
+   * systicks moving on. A count near the top means it wrapped before we read
+   * it, rather than just after. */
+  if ((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) && count > SysTick->LOAD / 2)
+    ticks++;
+
+  return (uint32_t)ticks * 1000 +
+    (SysTick->LOAD - count) / (SystemCoreClock / 1000000);
+}
+
 void SysTick_Handler(void) {
+  PROF_START();
+
   systicks++;
 
   if (callback != NULL)
       callback();
+
+  PROF_END(PROF_SYSTICK);
 }
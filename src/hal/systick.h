@@ -2,6 +2,7 @@
 #define _SYSTICK_H
 
 #include <stddef.h>
+#include <stdint.h>
 #include <stdbool.h>
 
 
@@ -29,4 +30,13 @@ extern void systick_delay(size_t duration);
  */
 extern bool systick_test_duration(size_t timestamp, size_t duration);
 
+/**
+ * Get the time since the systick timer started, to the microsecond.  This is
+ * safe to call from any interrupt, including ones that hold off the systick
+ * interrupt.  It wraps every 71 minutes, so compare timestamps by
+ * subtracting them.
+ * @returns the time in microseconds
+ */
+extern uint32_t systick_get_us(void);
+
 #endif
@@ -5,54 +5,180 @@
 
 #include "stm32f10x.h"
 
+#include "dcc_hal.h"
+#include "prof.h"
+#include "log.h"
+
 #define RX_BUF_LEN 1024
+#define TX_BUF_LEN 512
+
+/* Space kept between the reader and the DMA. Anything closer to being
+ * written over is dropped when the ring is fetched, so a reader copying a
+ * frame out has this many bytes' time before the DMA can reach it. */
+#define RX_HEADROOM 64
+
+/* The command port pins. The TIM1 DCC encoder drives PA10, so USART1 is
+ * remapped to PB6/PB7 when it's used. */
+#if (DCC_HAL_ENCODER == DCC_HAL_ENCODER_TIM1)
+#define CMD_GPIO GPIOB
+#define CMD_GPIO_RCC RCC_APB2Periph_GPIOB
+#define CMD_TX_PIN GPIO_Pin_6
+#define CMD_RX_PIN GPIO_Pin_7
+#define CMD_REMAP 1
+#else
+#define CMD_GPIO GPIOA
+#define CMD_GPIO_RCC RCC_APB2Periph_GPIOA
+#define CMD_TX_PIN GPIO_Pin_9
+#define CMD_RX_PIN GPIO_Pin_10
+#define CMD_REMAP 0
+#endif
 
 static volatile size_t icount = 0;
 
 static uint32_t baud_rate = 115200;
 static bool flowcontrol = false;
 
+/* Each port sends from a ring that the main loop fills and DMA drains. The
+ * DMA sends one contiguous run of the ring at a time, and its transfer
+ * complete interrupt frees that run and starts the next. tx_len is the
+ * length of the run being sent, or 0 when the DMA is idle.
+ *
+ * Ports that receive have DMA write straight into the receive ring's
+ * buffer, round and round. The line going idle and the DMA reaching half
+ * way or the end of the buffer all interrupt, and the bytes written since
+ * rx_pos are committed to the ring then. */
 typedef struct uart_port_t {
   ringbuf_t *rx_ringbuf;
+  ringbuf_t *tx_ringbuf;
   void *uart;
+  DMA_Channel_TypeDef *tx_dma;
+  volatile uint16_t tx_len;
+  DMA_Channel_TypeDef *rx_dma;
+  uint16_t rx_pos;
 } uart_port_t;
 
-/* Modem receive buffer */
-static volatile uint8_t uart0_rx_buf[RX_BUF_LEN];
+/* Command port receive buffer. This is the DMA buffer too. */
+static uint8_t uart0_rx_buf[RX_BUF_LEN];
 static ringbuf_t uart0_ringbuf;
 
+/* Rings only take power of two sizes */
+#if (RX_BUF_LEN & (RX_BUF_LEN - 1)) || (TX_BUF_LEN & (TX_BUF_LEN - 1))
+#error "RX_BUF_LEN and TX_BUF_LEN must be powers of two"
+#endif
+
+/* Transmit buffers */
+static uint8_t uart0_tx_buf[TX_BUF_LEN];
+static ringbuf_t uart0_tx_ringbuf;
+static uint8_t uart1_tx_buf[TX_BUF_LEN];
+static ringbuf_t uart1_tx_ringbuf;
+
 /* UART ports */
 #define UART_COUNT 2
 static uart_port_t uart_ports[UART_COUNT];
 
 
+static void uart_tx_dma_init(uart_port_t *port, uint8_t irq) {
+  DMA_InitTypeDef dma;
+  NVIC_InitTypeDef nvic;
+
+  /* Memory to the data register, a byte at a time. The memory address and
+   * length are set for each run. */
+  DMA_DeInit(port->tx_dma);
+  dma.DMA_PeripheralBaseAddr = (uint32_t)&((USART_TypeDef *)port->uart)->DR;
+  dma.DMA_MemoryBaseAddr = (uint32_t)port->tx_ringbuf->buffer;
+  dma.DMA_DIR = DMA_DIR_PeripheralDST;
+  dma.DMA_BufferSize = 1;
+  dma.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  dma.DMA_MemoryInc = DMA_MemoryInc_Enable;
+  dma.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  dma.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+  dma.DMA_Mode = DMA_Mode_Normal;
+  dma.DMA_Priority = DMA_Priority_Low;
+  dma.DMA_M2M = DMA_M2M_Disable;
+  DMA_Init(port->tx_dma, &dma);
+
+  DMA_ITConfig(port->tx_dma, DMA_IT_TC, ENABLE);
+
+  /* Below the DCC encoder, which has subpriority 1 */
+  nvic.NVIC_IRQChannel = irq;
+  nvic.NVIC_IRQChannelPreemptionPriority = 0;
+  nvic.NVIC_IRQChannelSubPriority = 2;
+  nvic.NVIC_IRQChannelCmd = ENABLE;
+  NVIC_Init(&nvic);
+
+  USART_DMACmd(port->uart, USART_DMAReq_Tx, ENABLE);
+}
+
+static void uart_rx_dma_init(uart_port_t *port, uint8_t irq) {
+  DMA_InitTypeDef dma;
+  NVIC_InitTypeDef nvic;
+
+  /* The data register to the whole receive buffer, round and round */
+  DMA_DeInit(port->rx_dma);
+  dma.DMA_PeripheralBaseAddr = (uint32_t)&((USART_TypeDef *)port->uart)->DR;
+  dma.DMA_MemoryBaseAddr = (uint32_t)port->rx_ringbuf->buffer;
+  dma.DMA_DIR = DMA_DIR_PeripheralSRC;
+  dma.DMA_BufferSize = RX_BUF_LEN;
+  dma.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+  dma.DMA_MemoryInc = DMA_MemoryInc_Enable;
+  dma.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+  dma.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+  dma.DMA_Mode = DMA_Mode_Circular;
+  dma.DMA_Priority = DMA_Priority_High;
+  dma.DMA_M2M = DMA_M2M_Disable;
+  DMA_Init(port->rx_dma, &dma);
+
+  port->rx_pos = 0;
+
+  DMA_ITConfig(port->rx_dma, DMA_IT_HT | DMA_IT_TC, ENABLE);
+
+  nvic.NVIC_IRQChannel = irq;
+  nvic.NVIC_IRQChannelPreemptionPriority = 0;
+  nvic.NVIC_IRQChannelSubPriority = 2;
+  nvic.NVIC_IRQChannelCmd = ENABLE;
+  NVIC_Init(&nvic);
+
+  USART_DMACmd(port->uart, USART_DMAReq_Rx, ENABLE);
+  DMA_Cmd(port->rx_dma, ENABLE);
+
+  /* Catch the end of each burst */
+  USART_ITConfig(port->uart, USART_IT_IDLE, ENABLE);
+}
+
 void uart_init(void) {
   GPIO_InitTypeDef gpio;
   USART_InitTypeDef uart;
   NVIC_InitTypeDef nvic;
 
   /* GPIO Clocks */
-  RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA, ENABLE);
+  RCC_APB2PeriphClockCmd(RCC_APB2Periph_GPIOA | CMD_GPIO_RCC, ENABLE);
 
-  /* GSM TX, Debug TX */
-  gpio.GPIO_Pin = GPIO_Pin_9 | GPIO_Pin_2;
+  /* Command TX */
+  gpio.GPIO_Pin = CMD_TX_PIN;
   gpio.GPIO_Mode = GPIO_Mode_AF_PP;
   gpio.GPIO_Speed = GPIO_Speed_50MHz;
+  GPIO_Init(CMD_GPIO, &gpio);
+
+  /* Debug TX */
+  gpio.GPIO_Pin = GPIO_Pin_2;
   GPIO_Init(GPIOA, &gpio);
 
-  /* GSM RX */
-  gpio.GPIO_Pin = GPIO_Pin_10;
+  /* Command RX */
+  gpio.GPIO_Pin = CMD_RX_PIN;
   gpio.GPIO_Mode = GPIO_Mode_IN_FLOATING;
   gpio.GPIO_Speed = GPIO_Speed_50MHz;
-  GPIO_Init(GPIOA, &gpio);
+  GPIO_Init(CMD_GPIO, &gpio);
 
   /* Alternate Functionality */
   RCC_APB2PeriphClockCmd(RCC_APB2Periph_AFIO, ENABLE);
+#if CMD_REMAP
+  GPIO_PinRemapConfig(GPIO_Remap_USART1, ENABLE);
+#endif
 
-  /* GSM Interrupt */
+  /* Command port interrupt, for the line going idle */
   nvic.NVIC_IRQChannel = USART1_IRQn;
   nvic.NVIC_IRQChannelPreemptionPriority = 0;
-  nvic.NVIC_IRQChannelSubPriority = 0;
+  nvic.NVIC_IRQChannelSubPriority = 2;
   nvic.NVIC_IRQChannelCmd = ENABLE;
   NVIC_Init(&nvic);
 
@@ -72,20 +198,38 @@ void uart_init(void) {
   uart.USART_Mode = USART_Mode_Tx;
   USART_Init(USART2, &uart);
 
-  USART_ITConfig(USART1, USART_IT_RXNE, ENABLE);
-
   USART_Cmd(USART1, ENABLE);
   USART_Cmd(USART2, ENABLE);
 
   /* Receive buffer */
   ringbuf_init(&uart0_ringbuf, uart0_rx_buf, RX_BUF_LEN);
 
+  /* Transmit buffers */
+  ringbuf_init(&uart0_tx_ringbuf, uart0_tx_buf, TX_BUF_LEN);
+  ringbuf_init(&uart1_tx_ringbuf, uart1_tx_buf, TX_BUF_LEN);
+
   /* UART Ports */
   uart_ports[0].rx_ringbuf = &uart0_ringbuf;
+  uart_ports[0].tx_ringbuf = &uart0_tx_ringbuf;
   uart_ports[0].uart = USART1;
+  uart_ports[0].tx_dma = DMA1_Channel4;
+  uart_ports[0].tx_len = 0;
+  uart_ports[0].rx_dma = DMA1_Channel5;
 
   uart_ports[1].rx_ringbuf = NULL;
+  uart_ports[1].tx_ringbuf = &uart1_tx_ringbuf;
   uart_ports[1].uart = USART2;
+  uart_ports[1].tx_dma = DMA1_Channel7;
+  uart_ports[1].tx_len = 0;
+  uart_ports[1].rx_dma = NULL;
+
+  /* Transmit DMA. USART1 TX is on DMA1 channel 4, and USART2 TX on 7. */
+  RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+  uart_tx_dma_init(&uart_ports[0], DMA1_Channel4_IRQn);
+  uart_tx_dma_init(&uart_ports[1], DMA1_Channel7_IRQn);
+
+  /* Receive DMA. USART1 RX is on DMA1 channel 5. */
+  uart_rx_dma_init(&uart_ports[0], DMA1_Channel5_IRQn);
 }
 
 void uart_set_baud(uint8_t port, uint32_t baud) {
@@ -120,27 +264,97 @@ void uart_enable_flow_control(uint8_t port) {
   flowcontrol = true;
 }
 
+/* Send the next run of the transmit ring, if the DMA is idle. Called from
+ * the DMA interrupt, or with interrupts held off. */
+static void uart_tx_start(uart_port_t *port) {
+  uint8_t *data;
+  size_t len;
+
+  if (port->tx_len != 0)
+    return;
+
+  data = ringbuf_peek(port->tx_ringbuf, &len);
+  if (len == 0)
+    return;
+
+  DMA_Cmd(port->tx_dma, DISABLE);
+  port->tx_dma->CMAR = (uint32_t)data;
+  port->tx_dma->CNDTR = len;
+  port->tx_len = len;
+  DMA_Cmd(port->tx_dma, ENABLE);
+}
+
 uint16_t uart_send_data(uint8_t port, uint8_t *buf, uint16_t len) {
+  uint16_t queued;
+
   if (port > UART_COUNT - 1)
     return 0;
 
-  for (int i = 0; i < len; i++) {
-    _uart_putch(port, buf[i]);
-  }
+  queued = ringbuf_write(uart_ports[port].tx_ringbuf, buf, len);
+
+  /* Keep the DMA interrupt out, so only one of us starts the next run */
+  __disable_irq();
+  uart_tx_start(&uart_ports[port]);
+  __enable_irq();
+
+  return queued;
+}
+
+uint16_t uart_get_tx_space(uint8_t port) {
+  if (port > UART_COUNT - 1)
+    return 0;
 
-  return len;
+  return ringbuf_get_space(uart_ports[port].tx_ringbuf);
+}
+
+bool uart_tx_busy(uint8_t port) {
+  if (port > UART_COUNT - 1)
+    return false;
+
+  return uart_ports[port].tx_len != 0 ||
+    USART_GetFlagStatus(uart_ports[port].uart, USART_FLAG_TC) == RESET;
+}
+
+static void uart_rx_update(uint8_t port);
+
+/* Catch up with the DMA, then drop whatever it has written over or is about
+ * to, leaving RX_HEADROOM */
+static void uart_rx_resync(uint8_t port) {
+  ringbuf_t *rb = uart_ports[port].rx_ringbuf;
+  size_t len;
+
+  __disable_irq();
+  uart_rx_update(port);
+  __enable_irq();
+
+  len = ringbuf_get_len(rb);
+  if (len > RX_BUF_LEN - RX_HEADROOM) {
+    ringbuf_consume(rb, len - (RX_BUF_LEN - RX_HEADROOM));
+    LOG("uart: %u bytes lost to a full receive buffer",
+        len - (RX_BUF_LEN - RX_HEADROOM));
+  }
 }
 
 uint16_t uart_get_data(uint8_t port, uint8_t *buf, uint16_t len) {
+  uart_rx_resync(port);
   return ringbuf_read(uart_ports[port].rx_ringbuf, buf, len);
 }
 
+ringbuf_t *uart_get_rx_ringbuf(uint8_t port) {
+  if (port > UART_COUNT - 1 || uart_ports[port].rx_ringbuf == NULL)
+    return NULL;
+
+  uart_rx_resync(port);
+  return uart_ports[port].rx_ringbuf;
+}
+
 void uart_flush_rx_buffer(uint8_t port) {
   ringbuf_flush(uart_ports[port].rx_ringbuf);
 }
 
 
 uint16_t uart_get_buf_length(uint8_t port) {
+  uart_rx_resync(port);
   return ringbuf_get_len(uart_ports[port].rx_ringbuf);
 }
 
@@ -148,35 +362,87 @@ uint16_t uart_get_buf_length(uint8_t port) {
 /*
  * Interrupts
  */
-static void uart_rx_handler(uint8_t port) {
-  uint16_t c;
-
-  /* There is an issue causing commands to always time out. Added printf so we
-   * can see any overrun errors (which shouldn't happen when flow control is
-   * enabled). I haven't found a way to produce the error reliably. */
-
-  /* Read the character from the USART */
-  c = (uint8_t)USART_ReceiveData(uart_ports[port].uart);
-
-  /* Technically this shouldn't clear the flags, but it seems to be related to
-   * the timeout issue. */
-  if (USART_GetFlagStatus(uart_ports[port].uart, USART_FLAG_NE) ||
-      USART_GetFlagStatus(uart_ports[port].uart, USART_FLAG_FE) ||
-      USART_GetFlagStatus(uart_ports[port].uart, USART_FLAG_PE) ||
-      USART_GetFlagStatus(uart_ports[port].uart, USART_FLAG_ORE)) {
-    c = -1;
-    fprintf(stderr, "UART: Error flag set.\n");
+/* Commit whatever the DMA has written since the last call. The ring's head
+ * has to follow the DMA, so it's committed even if the main loop hasn't
+ * kept up and the DMA has written over the oldest data. The reader skips
+ * past that with uart_rx_resync, which also calls this to see the DMA's
+ * position as it is, with interrupts off. */
+static void uart_rx_update(uint8_t port) {
+  uart_port_t *p = &uart_ports[port];
+  uint16_t pos, len;
+
+  pos = RX_BUF_LEN - DMA_GetCurrDataCounter(p->rx_dma);
+  if (pos == RX_BUF_LEN)
+    pos = 0;
+
+  len = (pos - p->rx_pos) & (RX_BUF_LEN - 1);
+  p->rx_pos = pos;
+
+  ringbuf_commit(p->rx_ringbuf, len);
+}
+
+void USART1_IRQHandler(void) {
+  uint16_t sr;
+
+  PROF_START();
+
+  /* Reading the status then the data register clears the idle and error
+   * flags. The DMA has already taken any data. */
+  sr = USART1->SR;
+  if (sr & (USART_FLAG_IDLE | USART_FLAG_ORE | USART_FLAG_NE |
+            USART_FLAG_FE | USART_FLAG_PE)) {
+    (void)USART_ReceiveData(USART1);
+
+    if (sr & (USART_FLAG_ORE | USART_FLAG_NE | USART_FLAG_FE | USART_FLAG_PE))
+      LOG("uart: receive error, status 0x%x", sr);
+
+    uart_rx_update(UART_CMD_PORT);
   }
 
-  /* Add the character to the buffer */
-  if (c != -1)
-    ringbuf_write(uart_ports[port].rx_ringbuf, (uint8_t *)&c, 1);
+  PROF_END(PROF_USART1);
 }
 
-void USART1_IRQHandler(void) {
-  if (USART_GetITStatus(USART1, USART_IT_RXNE) != RESET) {
-    uart_rx_handler(UART_GSM_PORT);
+void DMA1_Channel5_IRQHandler(void) {
+  PROF_START();
+
+  if (DMA_GetITStatus(DMA1_IT_HT5) != RESET ||
+      DMA_GetITStatus(DMA1_IT_TC5) != RESET) {
+    DMA_ClearITPendingBit(DMA1_IT_HT5 | DMA1_IT_TC5);
+    uart_rx_update(UART_CMD_PORT);
   }
+
+  PROF_END(PROF_DMA1_CH5);
+}
+
+
+/* The run being sent has gone, so free it and send the next */
+static void uart_tx_dma_handler(uint8_t port) {
+  ringbuf_consume(uart_ports[port].tx_ringbuf, uart_ports[port].tx_len);
+  uart_ports[port].tx_len = 0;
+
+  uart_tx_start(&uart_ports[port]);
+}
+
+void DMA1_Channel4_IRQHandler(void) {
+  PROF_START();
+
+  if (DMA_GetITStatus(DMA1_IT_TC4) != RESET) {
+    DMA_ClearITPendingBit(DMA1_IT_TC4);
+    uart_tx_dma_handler(UART_CMD_PORT);
+  }
+
+  PROF_END(PROF_DMA1_CH4);
+}
+
+void DMA1_Channel7_IRQHandler(void) {
+  PROF_START();
+
+  if (DMA_GetITStatus(DMA1_IT_TC7) != RESET) {
+    DMA_ClearITPendingBit(DMA1_IT_TC7);
+    uart_tx_dma_handler(UART_DEBUG_PORT);
+  }
+
+  PROF_END(PROF_DMA1_CH7);
 }
 
 
@@ -189,6 +455,11 @@ void _uart_putch(uint8_t port, uint8_t c) {
 }
 
 uint8_t _uart_getch(uint8_t port) {
-  while(USART_GetITStatus(uart_ports[port].uart, USART_IT_RXNE) == RESET);
-  return USART_ReceiveData(uart_ports[port].uart);
+  uint8_t c;
+
+  /* The DMA takes everything received, so wait for it in the ring */
+  do {
+    uart_rx_resync(port);
+  } while (ringbuf_pop(uart_ports[port].rx_ringbuf, &c) == 0);
+  return c;
 }
@@ -5,9 +5,20 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "ringbuf.h"
 
+
+/* Send printf out of the debug port rather than ITM, e.g. make
+ * UART_PRINTF=1 */
+#ifndef UART_PRINTF
+#define UART_PRINTF (0)
+#endif
+
+
+/* The command port is USART1, which a PC drives the trains through. The
+ * debug port is USART2, which only sends. */
 typedef enum uart_file_t {
-  UART_GSM_PORT = 0,
+  UART_CMD_PORT = 0,
   UART_DEBUG_PORT
 } uart_file_t;
 
@@ -35,13 +46,32 @@ extern void uart_set_baud(uint8_t port, uint32_t baud);
 extern void uart_enable_flow_control(uint8_t port);
 
 /**
- * Send data out the UART
+ * Queue data to send out the UART. This doesn't wait: the data is copied
+ * into the port's transmit buffer and sent by DMA. Only call it from one
+ * context, e.g. the main loop.
  * @param port The UART port to send data to
  * @param buf The buffer to read data from
  * @param len The number of bytes to send
+ * @returns The number of bytes queued, which is less than len if the
+ * transmit buffer is full
  */
 extern uint16_t uart_send_data(uint8_t port, uint8_t *buf, uint16_t len);
 
+/**
+ * Get the space in the transmit buffer, to check a message fits before
+ * sending it
+ * @param port The UART port to test
+ * @returns The number of bytes uart_send_data would take
+ */
+extern uint16_t uart_get_tx_space(uint8_t port);
+
+/**
+ * Test whether the UART is still sending
+ * @param port The UART port to test
+ * @returns true until everything queued has left the pin
+ */
+extern bool uart_tx_busy(uint8_t port);
+
 /**
  * Get data from the UART
  * @param port The UART port to read from
@@ -51,6 +81,18 @@ extern uint16_t uart_send_data(uint8_t port, uint8_t *buf, uint16_t len);
  */
 extern uint16_t uart_get_data(uint8_t port, uint8_t *buf, uint16_t len);
 
+/**
+ * Get the receive ring, to read data where it is rather than copying it
+ * out. The ring is brought up to where the DMA is, and anything it has
+ * written over or is about to is dropped first, so call this each time
+ * before reading. The DMA carries on writing while the data is read, so
+ * read anything that needs more than one pass out of the ring first, and
+ * check the ring hasn't then been written past its capacity.
+ * @param port The UART port to read from
+ * @returns The ring, or NULL if the port doesn't receive
+ */
+extern ringbuf_t *uart_get_rx_ringbuf(uint8_t port);
+
 /**
  * Clear data from the UART receive buffer
  * @param port The UART port to flush
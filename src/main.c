@@ -14,14 +14,27 @@
 #include "systick.h"
 #include "dcc.h"
 #include "sseg.h"
+#include "prof.h"
+#include "log.h"
+#include "uart.h"
+#include "cmd.h"
+#include "dccpp.h"
 
 
 /* Number of milliseconds between tasks */
 #define STATE_UPDATE (100)
-#define DCC_UPDATE (25)
 #define THROTTLE_UPDATE (7) /* units are 100 milliseconds */
 
 
+/* Number of trains that can be picked from the buttons. The display only has
+ * room for two digits. */
+#define N_TRAINS (10)
+
+
+/* Speed step mode used for the selected train */
+#define SPEED_STEPS DCC_SPEED_STEPS_128
+
+
 /* Button indicies */
 #define BLEFT    (0)
 #define BRIGHT   (1)
@@ -109,16 +122,26 @@ calculate_throttle(uint8_t *throttle, bool *reverse)
         adc_val = 0x800 - adc_val;
     }
 
-    /* Transform the value into a 29 value range */
-    adc_val /= 73;
+    /* Transform the value into a 127 value range */
+    adc_val /= 16;
     *throttle = (uint8_t)adc_val;
 
     /* Constain the throttle value */
-    if (*throttle > 28)
-        *throttle = 28;
+    if (*throttle > DCC_MAX_SPEED)
+        *throttle = DCC_MAX_SPEED;
 }
 
 
+#if CMD_DCCPP
+/* Send DCC++ replies back to the PC */
+static void
+send_reply(const char *text, size_t len)
+{
+    uart_send_data(UART_CMD_PORT, (uint8_t *)text, len);
+}
+#endif
+
+
 int
 main(void)
 {
@@ -136,12 +159,14 @@ main(void)
 
     /* Timer variables */
     size_t state_time = 0;
-    size_t dcc_time = 0;
     size_t throttle_time = 0;
 
 
     /* Init our drivers */
     systick_init(update_buttons);
+    uart_init();
+    log_init(log_itm_output);
+    PROF_INIT();
     dcc_init();
     sseg_init();
 
@@ -216,8 +241,36 @@ main(void)
 
     while(1)
     {
+        PROF_POLL();
+        log_drain();
+
         calculate_throttle(&throttle, &reverse);
 
+        /* Follow an emergency stop started or ended from the PC */
+        if (dcc_is_e_stopped() != (state == STATE_E_STOP))
+            state = dcc_is_e_stopped() ? STATE_E_STOP : STATE_SELECT;
+
+        /* e stop. This is checked on every pass rather than with the other
+         * buttons, and stops on the first sample of a press without
+         * waiting for the debounce. Going again needs a debounced
+         * press, and then the train has to be selected again, as the
+         * stop forgets its speed and speed steps. */
+        if (!buttons_checked[BESTOP])
+        {
+            if (state != STATE_E_STOP && buttons[BESTOP] > 0)
+            {
+                state = STATE_E_STOP;
+                dcc_e_stop(true);
+                buttons_checked[BESTOP] = true;
+            }
+            else if (state == STATE_E_STOP && buttons[BESTOP] == 5)
+            {
+                state = STATE_SELECT;
+                dcc_e_stop(false);
+                buttons_checked[BESTOP] = true;
+            }
+        }
+
         /* Update state based on button presses */
         if (systick_test_duration(state_time, STATE_UPDATE))
         {
@@ -232,7 +285,7 @@ main(void)
                 }
                 else
                 {
-                    selected_train = DCC_N_TRAINS;
+                    selected_train = N_TRAINS;
                 }
                 state = STATE_SELECT;
 
@@ -240,7 +293,7 @@ main(void)
             } else if (buttons[BRIGHT] == 5 && !buttons_checked[BRIGHT] &&
 				state != STATE_E_STOP)
             {
-                if (selected_train < DCC_N_TRAINS)
+                if (selected_train < N_TRAINS)
                 {
                     selected_train++;
                 }
@@ -260,28 +313,12 @@ main(void)
                 state = STATE_THROTTLE;
 
                 /* This sets the initial throttle (enables the train) */
+                dcc_set_speed_steps(selected_train, SPEED_STEPS);
                 dcc_set_speed(selected_train, throttle, reverse);
 
                 buttons_checked[BSELECT] = true;
             }
 
-            /* e stop */
-            if (buttons[BESTOP] == 5 && !buttons_checked[BESTOP])
-            {
-			  if (state != STATE_E_STOP)
-				{
-				  state = STATE_E_STOP;
-				  dcc_e_stop(true);
-				}
-			  else
-				{
-				  state = STATE_THROTTLE;
-				  dcc_e_stop(false);
-				}
-
-				buttons_checked[BESTOP] = true;
-            }
-
             /* Update the display and DCC */
             switch (state)
             {
@@ -329,13 +366,15 @@ main(void)
             state_time = systicks;
         }
 
-        /* Send the DCC controls */
-        if (systick_test_duration(dcc_time, DCC_UPDATE))
-        {
-            dcc_update();
+        /* Commands from the PC */
+#if CMD_DCCPP
+        dccpp_poll(uart_get_rx_ringbuf(UART_CMD_PORT), send_reply);
+#else
+        cmd_poll(uart_get_rx_ringbuf(UART_CMD_PORT));
+#endif
 
-            dcc_time = systicks;
-        }
+        /* Send the DCC controls */
+        dcc_update();
     }
 
     return 0;